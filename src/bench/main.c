@@ -0,0 +1,355 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <time.h>
+#endif
+
+#include "../../src/octree.h"
+
+#define BENCH_SIZE 1000
+#define BENCH_LEAF_CAPACITY 16
+#define BENCH_MIN_OBJECTS 1000
+#define BENCH_DEFAULT_MAX_OBJECTS 1000000
+#define BENCH_QUERIES 1000
+#define BENCH_RESULT_CAPACITY (1 << 20)
+#define BENCH_KNN 16
+#define BENCH_CLUSTERS 64
+#define BENCH_SPIRAL_ARMS 4
+#define BENCH_DUPLICATE_RATIO 100
+
+#define BENCH_PI 3.14159265358979323846
+
+typedef void (*BenchGenerator)(Position* positions, size_t count);
+
+/**
+ * @brief A point set the benchmark builds trees from.
+ */
+typedef struct _BenchDistribution
+{
+    const char* name;
+    BenchGenerator generate;
+} BenchDistribution;
+
+/**
+ * @brief Runs one query around a point picked from the objects. The result
+ * is handed back so the compiler can not drop the query.
+ */
+typedef size_t (*BenchQuery)(Octree* octree, Position position,
+                             uint64_t* indices, float* distances);
+
+typedef struct _BenchQueryType
+{
+    const char* name;
+    BenchQuery run;
+} BenchQueryType;
+
+static uint64_t bench_state = 0x9e3779b97f4a7c15ull;
+
+/**
+ * @brief xorshift64*, so every run and platform sees the same points.
+ */
+static uint64_t
+bench_random()
+{
+    bench_state ^= bench_state >> 12;
+    bench_state ^= bench_state << 25;
+    bench_state ^= bench_state >> 27;
+    return bench_state * 0x2545f4914f6cdd1dull;
+}
+
+static double
+bench_uniform(double min, double max)
+{
+    return min + (max - min) * ((bench_random() >> 11) * 0x1.0p-53);
+}
+
+static double
+bench_gaussian(double sigma)
+{
+    double u = bench_uniform(1e-12, 1);
+    double v = bench_uniform(0, 1);
+    return sigma * sqrt(-2 * log(u)) * cos(2 * BENCH_PI * v);
+}
+
+static float
+bench_clamp(double value)
+{
+    double limit = BENCH_SIZE * 0.999;
+    return (float)(value < -limit ? -limit : value > limit ? limit : value);
+}
+
+static double
+bench_time()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void
+generate_uniform(Position* positions, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        positions[i].x = (float)bench_uniform(-BENCH_SIZE, BENCH_SIZE);
+        positions[i].y = (float)bench_uniform(-BENCH_SIZE, BENCH_SIZE);
+        positions[i].z = (float)bench_uniform(-BENCH_SIZE, BENCH_SIZE);
+    }
+}
+
+static void
+generate_clusters(Position* positions, size_t count)
+{
+    Position centers[BENCH_CLUSTERS];
+    generate_uniform(centers, BENCH_CLUSTERS);
+
+    double sigma = 0.02 * BENCH_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        Position center = centers[bench_random() % BENCH_CLUSTERS];
+        positions[i].x = bench_clamp(0.8 * center.x + bench_gaussian(sigma));
+        positions[i].y = bench_clamp(0.8 * center.y + bench_gaussian(sigma));
+        positions[i].z = bench_clamp(0.8 * center.z + bench_gaussian(sigma));
+    }
+}
+
+/**
+ * @brief A thin disk with logarithmic spiral arms and an exponential radial
+ * profile around a spherical bulge holding a fifth of the stars.
+ */
+static void
+generate_spiral(Position* positions, size_t count)
+{
+    double scale_length = 0.25 * BENCH_SIZE;
+    double pitch = tan(12.0 * BENCH_PI / 180.0);
+    for (size_t i = 0; i < count; i++) {
+        if (bench_random() % 5 == 0) {
+            double sigma = 0.05 * BENCH_SIZE;
+            positions[i].x = bench_clamp(bench_gaussian(sigma));
+            positions[i].y = bench_clamp(bench_gaussian(sigma));
+            positions[i].z = bench_clamp(bench_gaussian(sigma));
+            continue;
+        }
+
+        double radius = -scale_length * log(bench_uniform(1e-6, 1));
+        double arm = (double)(bench_random() % BENCH_SPIRAL_ARMS);
+        double angle = arm * 2 * BENCH_PI / BENCH_SPIRAL_ARMS +
+                       log(1 + radius / scale_length) / pitch +
+                       bench_gaussian(0.3);
+        positions[i].x = bench_clamp(radius * cos(angle));
+        positions[i].y = bench_clamp(radius * sin(angle));
+        positions[i].z = bench_clamp(bench_gaussian(0.01 * BENCH_SIZE));
+    }
+}
+
+/**
+ * @brief Every point is one of count / BENCH_DUPLICATE_RATIO places, which
+ * piles objects into leaves at max_depth.
+ */
+static void
+generate_duplicates(Position* positions, size_t count)
+{
+    size_t distinct = count / BENCH_DUPLICATE_RATIO + 1;
+    generate_uniform(positions, distinct);
+    for (size_t i = distinct; i < count; i++) {
+        positions[i] = positions[bench_random() % distinct];
+    }
+}
+
+static size_t
+query_aabb(Octree* octree, Position position, uint64_t* indices,
+           float* distances)
+{
+    (void)distances;
+    float extent = 0.02f * BENCH_SIZE;
+    Position min = {position.x - extent, position.y - extent,
+                    position.z - extent};
+    Position max = {position.x + extent, position.y + extent,
+                    position.z + extent};
+    return oct_query_aabb(octree, min, max, indices, BENCH_RESULT_CAPACITY);
+}
+
+static size_t
+query_sphere(Octree* octree, Position position, uint64_t* indices,
+             float* distances)
+{
+    (void)distances;
+    return oct_query_sphere(octree, position, 0.02f * BENCH_SIZE, indices,
+                            BENCH_RESULT_CAPACITY);
+}
+
+static size_t
+query_knn(Octree* octree, Position position, uint64_t* indices,
+          float* distances)
+{
+    return oct_query_knn(octree, position, BENCH_KNN, indices, distances);
+}
+
+/**
+ * @brief A ray from a random point on the boundary through the position.
+ */
+static size_t
+query_ray(Octree* octree, Position position, uint64_t* indices,
+          float* distances)
+{
+    (void)indices;
+    Ray ray;
+    ray.origin.x = (float)bench_uniform(-BENCH_SIZE, BENCH_SIZE);
+    ray.origin.y = (float)bench_uniform(-BENCH_SIZE, BENCH_SIZE);
+    ray.origin.z = -BENCH_SIZE;
+    ray.direction.x = position.x - ray.origin.x;
+    ray.direction.y = position.y - ray.origin.y;
+    ray.direction.z = position.z - ray.origin.z;
+
+    RayHit hit;
+    bool found = oct_query_ray(octree, ray, 0.001f * BENCH_SIZE, INFINITY,
+                               &hit);
+    distances[0] = hit.distance;
+    return found;
+}
+
+/**
+ * @brief A camera at the position looking along +z with a 60 degree field of
+ * view and a far plane a tenth of the tree away.
+ */
+static size_t
+query_frustum(Octree* octree, Position position, uint64_t* indices,
+              float* distances)
+{
+    (void)distances;
+    float far = 0.1f * BENCH_SIZE;
+    float slope = (float)tan(30.0 * BENCH_PI / 180.0);
+    Plane planes[6] = {
+        {0, 0, 1, -(position.z + 1)},
+        {0, 0, -1, position.z + far},
+        {1, 0, slope, -position.x - slope * position.z},
+        {-1, 0, slope, position.x - slope * position.z},
+        {0, 1, slope, -position.y - slope * position.z},
+        {0, -1, slope, position.y - slope * position.z},
+    };
+    return oct_query_frustum(octree, planes, indices, BENCH_RESULT_CAPACITY);
+}
+
+static size_t
+query_point(Octree* octree, Position position, uint64_t* indices,
+            float* distances)
+{
+    (void)indices;
+    (void)distances;
+    return oct_point_locate(octree, position) != NULL;
+}
+
+static const BenchDistribution distributions[] = {
+    {"uniform", generate_uniform},
+    {"clusters", generate_clusters},
+    {"spiral", generate_spiral},
+    {"duplicates", generate_duplicates},
+};
+
+static const BenchQueryType query_types[] = {
+    {"aabb", query_aabb},   {"sphere", query_sphere},
+    {"knn", query_knn},     {"ray", query_ray},
+    {"frustum", query_frustum}, {"point", query_point},
+};
+
+static int
+compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void
+bench_queries(Octree* octree, const Position* positions, size_t count,
+              uint64_t* indices, float* distances, double* latencies)
+{
+    for (size_t q = 0; q < sizeof query_types / sizeof *query_types; q++) {
+        size_t results = 0;
+        for (size_t i = 0; i < BENCH_QUERIES; i++) {
+            Position position = positions[bench_random() % count];
+            double start = bench_time();
+            results += query_types[q].run(octree, position, indices,
+                                          distances);
+            latencies[i] = (bench_time() - start) * 1e6;
+        }
+
+        qsort(latencies, BENCH_QUERIES, sizeof *latencies, compare_doubles);
+        printf("    %-8s %10.2f %10.2f %10.2f %10.2f %12.1f\n",
+               query_types[q].name, latencies[BENCH_QUERIES / 2],
+               latencies[BENCH_QUERIES * 9 / 10],
+               latencies[BENCH_QUERIES * 99 / 100],
+               latencies[BENCH_QUERIES - 1],
+               (double)results / BENCH_QUERIES);
+    }
+}
+
+/**
+ * Build trees from every distribution at every power of ten from
+ * BENCH_MIN_OBJECTS up to the first argument, 10^6 by default, and time
+ * queries around points of each tree.
+ */
+int
+main(int argc, char** argv)
+{
+    size_t max_count = BENCH_DEFAULT_MAX_OBJECTS;
+    if (argc > 1) {
+        max_count = (size_t)strtod(argv[1], NULL);
+    }
+
+    Position* positions = malloc(max_count * sizeof *positions);
+    uint64_t* indices = malloc(BENCH_RESULT_CAPACITY * sizeof *indices);
+    float* distances = malloc(BENCH_KNN * sizeof *distances);
+    double* latencies = malloc(BENCH_QUERIES * sizeof *latencies);
+    if (positions == NULL || indices == NULL || distances == NULL ||
+        latencies == NULL) {
+        fprintf(stderr, "not enough memory for %zu objects\n", max_count);
+        return 1;
+    }
+
+    Position center = {0, 0, 0};
+    for (size_t d = 0; d < sizeof distributions / sizeof *distributions;
+         d++) {
+        for (size_t count = BENCH_MIN_OBJECTS; count <= max_count;
+             count *= 10) {
+            distributions[d].generate(positions, count);
+            Octree* octree = oct_octree_init(center, BENCH_SIZE,
+                                             BENCH_LEAF_CAPACITY,
+                                             OCT_MAX_DEPTH);
+            if (octree == NULL) {
+                fprintf(stderr, "octree init failed\n");
+                return 1;
+            }
+
+            double start = bench_time();
+            oct_octree_build_parallel(octree, positions, count, 0);
+            double build_time = bench_time() - start;
+
+            OctStats stats;
+            oct_octree_get_stats(octree, &stats);
+            printf("%s, %zu objects\n", distributions[d].name, count);
+            printf("    build %.2f ms, %.2f M objects/s, %zu leaves, "
+                   "%zu branches, depth %d, %.1f bytes/object\n",
+                   build_time * 1e3, count / build_time * 1e-6,
+                   octree->leaf_count, octree->inner_count, stats.depth,
+                   stats.bytes_per_object);
+            printf("    %-8s %10s %10s %10s %10s %12s\n", "query", "p50 us",
+                   "p90 us", "p99 us", "max us", "results");
+            bench_queries(octree, positions, count, indices, distances,
+                          latencies);
+
+            oct_octree_free(octree);
+        }
+    }
+
+    free(latencies);
+    free(distances);
+    free(indices);
+    free(positions);
+    return 0;
+}
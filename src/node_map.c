@@ -0,0 +1,274 @@
+#include "node_map.h"
+
+#include <stdlib.h>
+
+#define NODE_MAP_MIN_CAPACITY 16
+
+/**
+ * @brief Location codes of siblings only differ in their lowest bits, so the
+ * key is run through the murmur3 finalizer to spread them over the table.
+ */
+static inline size_t
+node_map_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+static inline size_t
+node_map_probe_length(const node_map* map, uint64_t key, size_t index)
+{
+    return (index - node_map_hash(key)) & map->mask;
+}
+
+/**
+ * @brief The load factor is kept at or below 7/8.
+ */
+size_t
+node_map_capacity_for(size_t size)
+{
+    size_t capacity = NODE_MAP_MIN_CAPACITY;
+    while (capacity - capacity / 8 < size) {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
+
+static bool
+node_map_rehash(node_map* map, size_t capacity)
+{
+    NodeMapSlot* slots = calloc(capacity, sizeof *slots);
+    if (slots == NULL) {
+        return false;
+    }
+
+    NodeMapSlot* old_slots = map->slots;
+    size_t old_capacity = map->capacity;
+
+    map->slots = slots;
+    map->capacity = capacity;
+    map->mask = capacity - 1;
+    map->max_size = capacity - capacity / 8;
+    map->size = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i].key != 0) {
+            node_map_put(map, old_slots[i].key, old_slots[i].value, NULL);
+        }
+    }
+    free(old_slots);
+
+    return true;
+}
+
+node_map*
+node_map_alloc(size_t initial_capacity)
+{
+    node_map* map = malloc(sizeof *map);
+    if (map == NULL) {
+        return NULL;
+    }
+
+    map->slots = NULL;
+    map->capacity = 0;
+    map->size = 0;
+    if (!node_map_rehash(map, node_map_capacity_for(initial_capacity))) {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void
+node_map_free(node_map* map)
+{
+    if (map == NULL) {
+        return;
+    }
+
+    free(map->slots);
+    free(map);
+}
+
+bool
+node_map_reserve(node_map* map, size_t capacity)
+{
+    size_t new_capacity = node_map_capacity_for(capacity);
+    if (new_capacity <= map->capacity) {
+        return true;
+    }
+
+    return node_map_rehash(map, new_capacity);
+}
+
+bool
+node_map_shrink(node_map* map)
+{
+    size_t new_capacity = node_map_capacity_for(map->size);
+    if (new_capacity >= map->capacity) {
+        return true;
+    }
+
+    return node_map_rehash(map, new_capacity);
+}
+
+bool
+node_map_put(node_map* map, uint64_t key, void* value, void** old_value)
+{
+    if (map->size >= map->max_size &&
+        !node_map_rehash(map, map->capacity << 1)) {
+        return false;
+    }
+    if (old_value != NULL) {
+        *old_value = NULL;
+    }
+
+    size_t index = node_map_hash(key) & map->mask;
+    size_t distance = 0;
+    for (;;) {
+        NodeMapSlot* slot = &map->slots[index];
+        if (slot->key == 0) {
+            slot->key = key;
+            slot->value = value;
+            map->size++;
+            return true;
+        }
+
+        if (slot->key == key) {
+            if (old_value != NULL) {
+                *old_value = slot->value;
+            }
+            slot->value = value;
+            return true;
+        }
+
+        // Take the slot from an entry that is closer to home and carry that
+        // entry further down the table instead.
+        size_t slot_distance = node_map_probe_length(map, slot->key, index);
+        if (slot_distance < distance) {
+            NodeMapSlot displaced = *slot;
+            slot->key = key;
+            slot->value = value;
+            key = displaced.key;
+            value = displaced.value;
+            distance = slot_distance;
+        }
+
+        index = (index + 1) & map->mask;
+        distance++;
+    }
+}
+
+static inline size_t
+node_map_find(const node_map* map, uint64_t key)
+{
+    size_t index = node_map_hash(key) & map->mask;
+    for (size_t distance = 0;; distance++) {
+        const NodeMapSlot* slot = &map->slots[index];
+        if (slot->key == key) {
+            return index;
+        }
+
+        if (slot->key == 0 ||
+            node_map_probe_length(map, slot->key, index) < distance) {
+            return map->capacity;
+        }
+
+        index = (index + 1) & map->mask;
+    }
+}
+
+void*
+node_map_get(const node_map* map, uint64_t key)
+{
+    size_t index = node_map_find(map, key);
+    return index < map->capacity ? map->slots[index].value : NULL;
+}
+
+void*
+node_map_remove(node_map* map, uint64_t key)
+{
+    size_t index = node_map_find(map, key);
+    if (index == map->capacity) {
+        return NULL;
+    }
+
+    void* value = map->slots[index].value;
+
+    // Shift the entries after the removed one back by one slot until an
+    // empty slot or an entry that already sits in its home slot is reached.
+    size_t next = (index + 1) & map->mask;
+    while (map->slots[next].key != 0 &&
+           node_map_probe_length(map, map->slots[next].key, next) != 0) {
+        map->slots[index] = map->slots[next];
+        index = next;
+        next = (next + 1) & map->mask;
+    }
+    map->slots[index].key = 0;
+    map->slots[index].value = NULL;
+    map->size--;
+
+    return value;
+}
+
+void
+node_map_clear(node_map* map)
+{
+    for (size_t i = 0; i < map->capacity; i++) {
+        map->slots[i].key = 0;
+        map->slots[i].value = NULL;
+    }
+    map->size = 0;
+}
+
+size_t
+node_map_size(const node_map* map)
+{
+    return map ? map->size : 0;
+}
+
+bool
+node_map_next(const node_map* map, size_t* position, uint64_t* key,
+              void** value)
+{
+    for (size_t i = *position; i < map->capacity; i++) {
+        if (map->slots[i].key != 0) {
+            *key = map->slots[i].key;
+            *value = map->slots[i].value;
+            *position = i + 1;
+            return true;
+        }
+    }
+
+    *position = map->capacity;
+    return false;
+}
+
+size_t
+node_map_probe_lengths(const node_map* map, size_t* counts, size_t bin_count)
+{
+    for (size_t i = 0; i < bin_count; i++) {
+        counts[i] = 0;
+    }
+
+    size_t max_length = 0;
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->slots[i].key == 0) {
+            continue;
+        }
+
+        size_t length = node_map_probe_length(map, map->slots[i].key, i);
+        counts[length < bin_count ? length : bin_count - 1]++;
+        if (length > max_length) {
+            max_length = length;
+        }
+    }
+
+    return max_length;
+}
@@ -0,0 +1,164 @@
+#ifndef NODE_MAP_H
+#define NODE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /**
+     * @brief One slot of the node map. The key and the node pointer are stored
+     * inline in the table. A key of 0 marks an empty slot, which is free
+     * because a location code always has its sentinel bit set.
+     */
+    typedef struct _NodeMapSlot
+    {
+        uint64_t key;
+        void* value;
+    } NodeMapSlot;
+
+    /**
+     * @brief Open addressing hash map from 64-bit location codes to nodes.
+     *
+     * Collisions are resolved with Robin Hood linear probing: an insert takes
+     * the slot of any entry that sits closer to its home slot than the entry
+     * being inserted. This keeps probe lengths short and lets a lookup stop as
+     * soon as it passes the point where its key would have been placed.
+     * Removal shifts the following entries back instead of leaving
+     * tombstones.
+     */
+    typedef struct _NodeMap
+    {
+        NodeMapSlot* slots;
+        size_t capacity;
+        size_t mask;
+        size_t size;
+        size_t max_size;
+    } node_map;
+
+    /**
+     * @brief Allocate an empty map that can hold at least initial_capacity
+     * entries before it has to grow.
+     *
+     * @param initial_capacity
+     * @return node_map* map NULL if the allocation failed
+     */
+    node_map* node_map_alloc(size_t initial_capacity);
+
+    /**
+     * @brief Deallocate the map. The nodes stored in it are not freed.
+     *
+     * @param map
+     */
+    void node_map_free(node_map* map);
+
+    /**
+     * @brief Grow the map so it can hold at least capacity entries without
+     * rehashing.
+     *
+     * @param map
+     * @param capacity
+     * @return bool success false if the allocation failed
+     */
+    bool node_map_reserve(node_map* map, size_t capacity);
+
+    /**
+     * @brief Shrink the slot array to the smallest that holds the current
+     * entries.
+     *
+     * @param map
+     * @return bool success false if the allocation failed, the map is then
+     * left as it was
+     */
+    bool node_map_shrink(node_map* map);
+
+    /**
+     * @brief The amount of slots a map that holds size entries has.
+     *
+     * @param size
+     * @return size_t capacity
+     */
+    size_t node_map_capacity_for(size_t size);
+
+    /**
+     * @brief Map key to value. If the key was already mapped the value is
+     * replaced.
+     *
+     * @param map
+     * @param key Location code, must not be 0
+     * @param value
+     * @param old_value Receives the replaced value, or NULL if the key was not
+     * mapped. May be NULL.
+     * @return bool success false if the map had to grow and the allocation
+     * failed, the map is then left as it was
+     */
+    bool node_map_put(node_map* map, uint64_t key, void* value,
+                      void** old_value);
+
+    /**
+     * @brief Find the value mapped to key.
+     *
+     * @param map
+     * @param key
+     * @return void* value NULL if the key is not mapped
+     */
+    void* node_map_get(const node_map* map, uint64_t key);
+
+    /**
+     * @brief Remove the mapping of key.
+     *
+     * @param map
+     * @param key
+     * @return void* value The removed value, NULL if the key was not mapped
+     */
+    void* node_map_remove(node_map* map, uint64_t key);
+
+    /**
+     * @brief Remove all mappings, keeping the allocated table.
+     *
+     * @param map
+     */
+    void node_map_clear(node_map* map);
+
+    /**
+     * @brief Get the amount of mappings in the map.
+     *
+     * @param map
+     * @return size_t size
+     */
+    size_t node_map_size(const node_map* map);
+
+    /**
+     * @brief Step through all mappings in table order. Start with *position
+     * set to 0. The map must not be modified during the iteration.
+     *
+     * @param map
+     * @param position Iteration state, advanced by the call
+     * @param key Receives the key of the next mapping
+     * @param value Receives the value of the next mapping
+     * @return bool found false if all mappings have been visited
+     */
+    bool node_map_next(const node_map* map, size_t* position, uint64_t* key,
+                       void** value);
+
+    /**
+     * @brief Count the mappings by how many slots they sit past their home
+     * slot, which is how many slots a lookup of them probes in vain.
+     * Mappings bin_count - 1 or more slots away share the last bin.
+     *
+     * @param map
+     * @param counts Receives bin_count counts
+     * @param bin_count
+     * @return size_t max_length The longest probe length in the map
+     */
+    size_t node_map_probe_lengths(const node_map* map, size_t* counts,
+                                  size_t bin_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
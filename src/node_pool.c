@@ -0,0 +1,209 @@
+#include "node_pool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NODE_POOL_MIN_SLAB 64
+#define NODE_POOL_MAX_SLAB 65536
+
+static NodePoolSlab*
+node_pool_slab_alloc(node_pool* pool, size_t capacity)
+{
+    size_t bytes = sizeof(NodePoolSlab) + capacity * pool->element_size;
+    NodePoolSlab* slab = malloc(bytes);
+    if (slab == NULL) {
+        return NULL;
+    }
+
+    slab->next = NULL;
+    slab->capacity = capacity;
+    pool->slab_count++;
+    pool->allocated_bytes += bytes;
+
+    return slab;
+}
+
+/**
+ * @brief Released elements hold the free list link. Nodes only hold 64-bit
+ * fields, so 8-byte alignment is enough for every element.
+ */
+static size_t
+node_pool_element_size(size_t element_size)
+{
+    size_t align = sizeof(uint64_t);
+    if (element_size < sizeof(void*)) {
+        element_size = sizeof(void*);
+    }
+    return (element_size + align - 1) / align * align;
+}
+
+void
+node_pool_init(node_pool* pool, size_t element_size)
+{
+    pool->element_size = node_pool_element_size(element_size);
+    pool->slabs = NULL;
+    pool->current = NULL;
+    pool->current_used = 0;
+    pool->free_list = NULL;
+    pool->slab_count = 0;
+    pool->allocated_bytes = 0;
+}
+
+void
+node_pool_destroy(node_pool* pool)
+{
+    NodePoolSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        NodePoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    node_pool_init(pool, pool->element_size);
+}
+
+void*
+node_pool_alloc(node_pool* pool)
+{
+    if (pool->free_list != NULL) {
+        void* element = pool->free_list;
+        pool->free_list = *(void**)element;
+        return element;
+    }
+
+    if (pool->current == NULL || pool->current_used == pool->current->capacity) {
+        NodePoolSlab* next = pool->current ? pool->current->next : pool->slabs;
+        if (next == NULL) {
+            size_t capacity = pool->current
+                ? pool->current->capacity * 2
+                : NODE_POOL_MIN_SLAB;
+            if (capacity > NODE_POOL_MAX_SLAB) {
+                capacity = NODE_POOL_MAX_SLAB;
+            }
+
+            next = node_pool_slab_alloc(pool, capacity);
+            if (next == NULL) {
+                return NULL;
+            }
+            if (pool->current) {
+                pool->current->next = next;
+            } else {
+                pool->slabs = next;
+            }
+        }
+
+        pool->current = next;
+        pool->current_used = 0;
+    }
+
+    char* elements = (char*)pool->current->elements;
+    return elements + pool->element_size * pool->current_used++;
+}
+
+void
+node_pool_release(node_pool* pool, void* element)
+{
+    *(void**)element = pool->free_list;
+    pool->free_list = element;
+}
+
+void
+node_pool_reset(node_pool* pool)
+{
+    pool->current = NULL;
+    pool->current_used = 0;
+    pool->free_list = NULL;
+}
+
+void
+node_pool_adopt(node_pool* pool, node_pool* other)
+{
+    if (other->slabs == NULL) {
+        return;
+    }
+
+    // The adopted slabs go in front of the slabs this pool is handing out,
+    // where the bump allocation never looks until the pool is reset. A pool
+    // that has not handed anything out yet continues after them.
+    NodePoolSlab* last = other->slabs;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+    last->next = pool->slabs;
+    pool->slabs = other->slabs;
+    if (pool->current == NULL) {
+        pool->current = last;
+        pool->current_used = last->capacity;
+    }
+    pool->slab_count += other->slab_count;
+    pool->allocated_bytes += other->allocated_bytes;
+
+    node_pool_init(other, other->element_size);
+}
+
+bool
+node_pool_reserve(node_pool* pool, size_t count)
+{
+    NodePoolSlab* last = pool->current;
+    size_t available = 0;
+    if (last != NULL) {
+        available = last->capacity - pool->current_used;
+    } else if (pool->slabs != NULL) {
+        last = pool->slabs;
+        available = last->capacity;
+    }
+    while (last != NULL && last->next != NULL) {
+        last = last->next;
+        available += last->capacity;
+    }
+    if (available >= count) {
+        return true;
+    }
+
+    size_t capacity = count - available;
+    NodePoolSlab* slab = node_pool_slab_alloc(
+        pool, capacity > NODE_POOL_MIN_SLAB ? capacity : NODE_POOL_MIN_SLAB);
+    if (slab == NULL) {
+        return false;
+    }
+    if (last != NULL) {
+        last->next = slab;
+    } else {
+        pool->slabs = slab;
+    }
+    return true;
+}
+
+void
+node_pool_trim(node_pool* pool)
+{
+    NodePoolSlab* slab;
+    if (pool->current != NULL) {
+        slab = pool->current->next;
+        pool->current->next = NULL;
+    } else {
+        slab = pool->slabs;
+        pool->slabs = NULL;
+    }
+
+    while (slab != NULL) {
+        NodePoolSlab* next = slab->next;
+        pool->slab_count--;
+        pool->allocated_bytes -=
+            sizeof(NodePoolSlab) + slab->capacity * pool->element_size;
+        free(slab);
+        slab = next;
+    }
+}
+
+size_t
+node_pool_bytes_for(size_t element_size, size_t count)
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t capacity = count > NODE_POOL_MIN_SLAB ? count : NODE_POOL_MIN_SLAB;
+    return sizeof(NodePoolSlab) +
+           capacity * node_pool_element_size(element_size);
+}
@@ -0,0 +1,119 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /**
+     * @brief A slab of elements. Slabs are chained in the order they were
+     * allocated so a reset pool can reuse them from the start.
+     */
+    typedef struct _NodePoolSlab
+    {
+        struct _NodePoolSlab* next;
+        size_t capacity;
+        max_align_t elements[];
+    } NodePoolSlab;
+
+    /**
+     * @brief Fixed size allocator for nodes. Elements are cut from slabs that
+     * double in size up to NODE_POOL_MAX_SLAB elements, and released elements
+     * go on a free list that is used before any new memory is touched.
+     */
+    typedef struct _NodePool
+    {
+        size_t element_size;
+        NodePoolSlab* slabs;
+        NodePoolSlab* current;
+        size_t current_used;
+        void* free_list;
+        size_t slab_count;
+        size_t allocated_bytes;
+    } node_pool;
+
+    /**
+     * @brief Initialize an empty pool. No memory is allocated until the first
+     * element is requested.
+     *
+     * @param pool
+     * @param element_size Size of one element in bytes
+     */
+    void node_pool_init(node_pool* pool, size_t element_size);
+
+    /**
+     * @brief Release all slabs of the pool.
+     *
+     * @param pool
+     */
+    void node_pool_destroy(node_pool* pool);
+
+    /**
+     * @brief Take an element from the pool.
+     *
+     * @param pool
+     * @return void* element NULL if a new slab was needed and malloc failed
+     */
+    void* node_pool_alloc(node_pool* pool);
+
+    /**
+     * @brief Give an element back to the pool so it can be handed out again.
+     *
+     * @param pool
+     * @param element Element previously taken from this pool
+     */
+    void node_pool_release(node_pool* pool, void* element);
+
+    /**
+     * @brief Release every element at once. The slabs are kept and handed out
+     * again from the start, so a rebuild does not go back to malloc.
+     *
+     * @param pool
+     */
+    void node_pool_reset(node_pool* pool);
+
+    /**
+     * @brief Move all slabs of other into pool. The elements other handed out
+     * stay valid and now belong to pool; other is left empty. The adopted
+     * slabs are only reused after the next reset.
+     *
+     * @param pool
+     * @param other
+     */
+    void node_pool_adopt(node_pool* pool, node_pool* other);
+
+    /**
+     * @brief Make sure count more elements can be handed out without a new
+     * slab. Missing room is added as one slab at the end of the chain.
+     *
+     * @param pool
+     * @param count
+     * @return bool success false if malloc failed
+     */
+    bool node_pool_reserve(node_pool* pool, size_t count);
+
+    /**
+     * @brief Free the slabs the pool has not handed out anything from since
+     * it was last reset.
+     *
+     * @param pool
+     */
+    void node_pool_trim(node_pool* pool);
+
+    /**
+     * @brief The bytes an empty pool allocates to reserve count elements.
+     *
+     * @param element_size Size of one element in bytes
+     * @param count
+     * @return size_t bytes
+     */
+    size_t node_pool_bytes_for(size_t element_size, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
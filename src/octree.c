@@ -1,6 +1,165 @@
 #include "octree.h"
 
 #include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define OCT_MORTON_AVX2
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define OCT_DEFAULT_NODE_CAPACITY 1024
+
+// A tree sized for its objects up front expects up to four leaves per
+// leaf_capacity objects, as objects do not fill the octants evenly, and one
+// branch per six leaves.
+#define OCT_SIZED_LEAVES_PER_CAPACITY 4
+#define OCT_SIZED_LEAVES_PER_BRANCH 6
+#define OCT_CELL_COUNT (1u << OCT_MAX_DEPTH)
+#define OCT_SENTINEL_BIT (1ull << (3 * OCT_MAX_DEPTH))
+
+// A parallel build splits the objects by their octant two levels below the
+// root and builds the 64 subtrees independently.
+#define OCT_PARTITION_DEPTH 2
+#define OCT_PARTITION_COUNT (1 << (3 * OCT_PARTITION_DEPTH))
+#define OCT_PARALLEL_MIN_OBJECTS 4096
+
+// The object ranges of leaves are packed again once more than half of the
+// slots in object_indices are no longer used by any leaf.
+#define OCT_COMPACT_MIN_SLOTS 1024
+
+// A streaming build reads positions in chunks of up to OCT_STREAM_CHUNK and
+// merges at most OCT_STREAM_MAX_FAN_IN runs at once, giving each run a buffer
+// of at least OCT_STREAM_MIN_RUN_BUFFER bytes.
+#define OCT_STREAM_MIN_BUDGET (64 * 1024)
+#define OCT_STREAM_CHUNK 65536
+#define OCT_STREAM_MAX_FAN_IN 64
+#define OCT_STREAM_MIN_RUN_BUFFER 4096
+
+// The aggregate values of a level are computed in parallel once it has at
+// least this many nodes.
+#define OCT_AGGREGATE_PARALLEL_MIN 256
+
+// Concurrent inserts take nodes from budgets sized for the objects to come:
+// a few leaves and branches per leaf_capacity objects, plus some room for
+// deep splits of clustered objects. The lock bit marks a full leaf that is
+// being replaced.
+#define OCT_CONCURRENT_LEAF_GROWTH 4
+#define OCT_CONCURRENT_BRANCH_GROWTH 2
+#define OCT_CONCURRENT_MIN_NODES (64 * (OCT_MAX_DEPTH + 1))
+#define OCT_CONCURRENT_LOCKED 0x80000000u
+
+#ifndef OCT_NO_STATS
+#define OCT_COUNT(counter) ((counter)++)
+#else
+#define OCT_COUNT(counter) ((void)0)
+#endif
+
+/**
+ * @brief An object's location code paired with its index, used to sort the
+ * objects into Morton order during the build.
+ */
+typedef struct _OctSortItem
+{
+    uint64_t location_code;
+    uint64_t object_index;
+} OctSortItem;
+
+#define OCT_SORT_ITEM_STRIDE (sizeof(OctSortItem) / sizeof(uint64_t))
+
+/**
+ * @brief A leaf while objects are inserted concurrently. reserved counts the
+ * slots handed out, with OCT_CONCURRENT_LOCKED set while one thread replaces
+ * the full leaf, and written the slots that have been filled in. The range
+ * and capacity do not change once the leaf is in the index.
+ */
+typedef struct _OctConcurrentLeaf
+{
+    LeafNode leaf;
+    atomic_uint reserved;
+    atomic_uint written;
+} OctConcurrentLeaf;
+
+/**
+ * @brief A branch while objects are inserted concurrently. The bit of a
+ * child is set once its node can be found in the index.
+ */
+typedef struct _OctConcurrentBranch
+{
+    BaseNode base;
+    atomic_uchar child_exists;
+} OctConcurrentBranch;
+
+/**
+ * @brief An entry of the concurrent node index. A key is claimed once and
+ * never removed; replacing a leaf swaps the value.
+ */
+typedef struct _OctConcurrentEntry
+{
+    atomic_uint_fast64_t key;
+    _Atomic(BaseNode*) value;
+} OctConcurrentEntry;
+
+struct _OctConcurrent
+{
+    OctConcurrentEntry* index;
+    size_t index_mask;
+    OctConcurrentLeaf* leaves;
+    size_t leaf_budget;
+    atomic_size_t leaf_used;
+    OctConcurrentBranch* branches;
+    size_t branch_budget;
+    atomic_size_t branch_used;
+    uint64_t* slots;
+    size_t slot_budget;
+    atomic_size_t slot_used;
+    atomic_uint_fast64_t* codes;
+    size_t code_count;
+    atomic_size_t object_count;
+    atomic_size_t splits;
+};
+
+/**
+ * @brief Tell the processor the thread is waiting on another one.
+ */
+static inline void
+oct_cpu_relax()
+{
+#if defined(OCT_MORTON_AVX2) // immintrin.h is included
+    _mm_pause();
+#endif
+}
+
+static void
+oct_concurrent_free(OctConcurrent* concurrent)
+{
+    if (concurrent == NULL) {
+        return;
+    }
+
+    free(concurrent->index);
+    free(concurrent->leaves);
+    free(concurrent->branches);
+    free(concurrent->slots);
+    free(concurrent->codes);
+    free(concurrent);
+}
 
 size_t
 hash_func(void* key)
@@ -14,9 +173,135 @@ equals_func(void* key1, void* key2)
     return (*(size_t*)key1) == (*(size_t*)key2);
 }
 
+/**
+ * @brief Map a whole file read-only. Returns NULL if the file could not be
+ * opened or is empty.
+ */
+static void*
+oct_file_map(const char* path, size_t* size)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size;
+    void* mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (view != NULL) {
+            mapping = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(view);
+        }
+        *size = (size_t)file_size.QuadPart;
+    }
+    CloseHandle(file);
+
+    return mapping;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    void* mapping = NULL;
+    if (fstat(file, &file_stat) == 0 && file_stat.st_size > 0) {
+        mapping = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED,
+                       file, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
+        }
+        *size = (size_t)file_stat.st_size;
+    }
+    close(file);
+
+    return mapping;
+#endif
+}
+
+static void
+oct_file_unmap(void* mapping, size_t size)
+{
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
+
+/**
+ * @brief The nodes a tree of object_count objects is expected to have.
+ */
+static void
+oct_octree_estimate_nodes(size_t leaf_capacity, size_t object_count,
+                          size_t* leaf_count, size_t* branch_count)
+{
+    *leaf_count = OCT_SIZED_LEAVES_PER_CAPACITY * object_count / leaf_capacity;
+    if (*leaf_count > object_count) {
+        *leaf_count = object_count;
+    }
+    (*leaf_count)++;
+    *branch_count = *leaf_count / OCT_SIZED_LEAVES_PER_BRANCH;
+}
+
+size_t
+oct_octree_estimate_bytes(size_t leaf_capacity, size_t object_count)
+{
+    size_t leaf_count, branch_count;
+    oct_octree_estimate_nodes(leaf_capacity > 0 ? leaf_capacity : 1,
+                              object_count, &leaf_count, &branch_count);
+    return sizeof(Octree) + sizeof(node_map) +
+           node_map_capacity_for(leaf_count + branch_count) *
+               sizeof(NodeMapSlot) +
+           node_pool_bytes_for(sizeof(LeafNode), leaf_count) +
+           node_pool_bytes_for(sizeof(BranchNode), branch_count) +
+           object_count * (sizeof(uint64_t) + sizeof(uint64_t));
+}
+
+Octree*
+oct_octree_init(Position position, size_t size, size_t leaf_capacity,
+                int max_depth)
+{
+    return oct_octree_init_sized(position, size, leaf_capacity, max_depth, 0,
+                                 0);
+}
+
 Octree*
-oct_octree_init(Position position, size_t size)
+oct_octree_init_sized(Position position, size_t size, size_t leaf_capacity,
+                      int max_depth, size_t expected_objects,
+                      size_t memory_budget)
 {
+    // Leaves count their objects in 32 bits.
+    leaf_capacity = leaf_capacity > 0 ? leaf_capacity : 1;
+    if (leaf_capacity > UINT32_MAX) {
+        leaf_capacity = UINT32_MAX;
+    }
+    if (memory_budget != 0 &&
+        oct_octree_estimate_bytes(leaf_capacity, expected_objects) >
+            memory_budget) {
+        if (oct_octree_estimate_bytes(leaf_capacity, 0) > memory_budget) {
+            return NULL;
+        }
+
+        // Reserve for as many objects as the budget has room for.
+        size_t low = 0;
+        size_t high = expected_objects;
+        while (low < high) {
+            size_t middle = low + (high - low + 1) / 2;
+            if (oct_octree_estimate_bytes(leaf_capacity, middle) <=
+                memory_budget) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+        expected_objects = low;
+    }
+
     Octree* octree = malloc(sizeof *octree);
     if (octree == NULL) {
         return NULL;
@@ -24,11 +309,64 @@ oct_octree_init(Position position, size_t size)
 
     octree->position = position;
     octree->size = size;
+    octree->leaf_capacity = leaf_capacity;
+    octree->max_depth = max_depth >= 0 && max_depth < OCT_MAX_DEPTH
+        ? max_depth
+        : OCT_MAX_DEPTH;
+    octree->object_positions = NULL;
+    octree->object_count = 0;
+    octree->object_indices = NULL;
+    octree->slot_count = 0;
+    octree->slot_capacity = 0;
+    octree->free_slot_count = 0;
+    octree->object_codes = NULL;
+    octree->object_code_count = 0;
+    octree->object_index_count = 0;
     octree->leaf_count = 0;
     octree->inner_count = 0;
-    octree->nodes = unordered_map_alloc(10000000, 0, hash_func, equals_func);
-    octree->root_node = oct_leaf_node_init(octree, 0, 1, ULLONG_MAX);
+    octree->mapping = NULL;
+    octree->mapping_size = 0;
+    octree->mapped_codes = NULL;
+    octree->mapped_nodes = NULL;
+    octree->mapped_levels = NULL;
+    octree->succinct = NULL;
+    octree->concurrent = NULL;
+    octree->aggregate = (OctAggregate){0};
+    octree->aggregates = NULL;
+    octree->counters = (OctCounters){0};
+    node_pool_init(&octree->aggregate_pool, sizeof(void*));
+    node_pool_init(&octree->leaf_pool, sizeof(LeafNode));
+    node_pool_init(&octree->branch_pool, sizeof(BranchNode));
+
+    size_t leaf_count, branch_count;
+    oct_octree_estimate_nodes(leaf_capacity, expected_objects, &leaf_count,
+                              &branch_count);
+    octree->nodes = node_map_alloc(leaf_count + branch_count);
+    if (octree->nodes == NULL) {
+        free(octree);
+        return NULL;
+    }
+    if (!node_pool_reserve(&octree->leaf_pool, leaf_count) ||
+        !node_pool_reserve(&octree->branch_pool, branch_count)) {
+        oct_octree_free(octree);
+        return NULL;
+    }
+    if (expected_objects > 0) {
+        // A code of 0 marks an index that is not in the tree.
+        octree->object_indices =
+            malloc(expected_objects * sizeof *octree->object_indices);
+        octree->object_codes =
+            calloc(expected_objects, sizeof *octree->object_codes);
+        if (octree->object_indices == NULL || octree->object_codes == NULL) {
+            oct_octree_free(octree);
+            return NULL;
+        }
+        octree->slot_capacity = expected_objects;
+        octree->object_code_count = expected_objects;
+    }
+    octree->root_node = oct_leaf_node_init(octree, 0, 1);
     if (octree->root_node == NULL) {
+        oct_octree_free(octree);
         return NULL;
     }
 
@@ -38,248 +376,3691 @@ oct_octree_init(Position position, size_t size)
 void
 oct_octree_free(Octree* octree)
 {
-    unordered_map_clear(octree->nodes);
+    node_map_free(octree->nodes);
+    node_pool_destroy(&octree->leaf_pool);
+    node_pool_destroy(&octree->branch_pool);
+    succinct_tree_free(octree->succinct);
+    oct_concurrent_free(octree->concurrent);
+    node_map_free(octree->aggregates);
+    node_pool_destroy(&octree->aggregate_pool);
+    if (octree->mapping != NULL) {
+        // A succinct mapped tree has its own packed object indices.
+        if (octree->succinct != NULL) {
+            free(octree->object_indices);
+        }
+        oct_file_unmap(octree->mapping, octree->mapping_size);
+    } else {
+        free(octree->object_indices);
+        free(octree->object_codes);
+    }
     free(octree);
 }
 
-void
-oct_octree_build(Octree* octree, Position* object_positions,
-                 size_t object_count)
+/**
+ * @brief Whether the nodes of the tree can not be changed: it is mapped from a
+ * file, in its succinct form or taking concurrent inserts.
+ */
+static inline bool
+oct_octree_read_only(const Octree* octree)
 {
-    octree->object_positions = object_positions;
+    return octree->mapping != NULL || octree->succinct != NULL ||
+           octree->concurrent != NULL;
+}
 
-    for (size_t i = 0; i < object_count; i++) {
-        LeafNode* leaf_node =
-            oct_leaf_node_find(octree, octree->root_node, object_positions[i]);
-        if (leaf_node->object_index != ULLONG_MAX) {
-            oct_leaf_node_split(octree, leaf_node);
-        } else {
-            leaf_node->object_index = i;
-        }
-    }
+static int
+oct_thread_num()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
 }
 
-BranchNode*
-oct_branch_node_init(Octree* octree, uint64_t location_code)
+static int
+oct_thread_count()
 {
-    BranchNode* node = malloc(sizeof *node);
-    if (node == NULL) {
-        return NULL;
-    }
+#ifdef _OPENMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
 
-    node->base.location_code = location_code;
-    node->base.type = INNER_NODE;
-    node->child_exists = 0b00;
+static int
+oct_default_thread_count()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
 
-    unordered_map_put(octree->nodes, &node->base.location_code, node);
-    octree->inner_count++;
+static uint64_t
+oct_morton_spread(uint32_t value)
+{
+    uint64_t x = value & (OCT_CELL_COUNT - 1);
+    x = (x | x << 32) & 0x001f00000000ffffull;
+    x = (x | x << 16) & 0x001f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
 
-    // If we just removed the root node set it to the new inner node
-    if (location_code == 0b1) {
-        octree->root_node = node;
+/**
+ * @brief Gather every third bit into the low bits, the inverse of
+ * oct_morton_spread.
+ */
+static uint32_t
+oct_morton_compact(uint64_t x)
+{
+    x &= 0x1249249249249249ull;
+    x = (x | x >> 2) & 0x10c30c30c30c30c3ull;
+    x = (x | x >> 4) & 0x100f00f00f00f00full;
+    x = (x | x >> 8) & 0x001f0000ff0000ffull;
+    x = (x | x >> 16) & 0x001f00000000ffffull;
+    x = (x | x >> 32) & 0x00000000001fffffull;
+    return (uint32_t)x;
+}
+
+static uint32_t
+oct_quantize(float value, float min, double scale)
+{
+    double cell = ((double)value - min) * scale;
+    if (cell <= 0.0) {
+        return 0;
+    }
+    if (cell >= OCT_CELL_COUNT) {
+        return OCT_CELL_COUNT - 1;
     }
 
-    return node;
+    return (uint32_t)cell;
 }
 
-void
-oct_branch_node_free(Octree* octree, uint64_t location_code) 
+uint64_t
+oct_position_get_location_code(Octree* octree, Position position)
 {
-    unordered_map_remove(octree->nodes, &location_code);
-    octree->inner_count--;
+    double scale = OCT_CELL_COUNT / (2.0 * octree->size);
+    uint32_t x = oct_quantize(position.x,
+                              octree->position.x - octree->size, scale);
+    uint32_t y = oct_quantize(position.y,
+                              octree->position.y - octree->size, scale);
+    uint32_t z = oct_quantize(position.z,
+                              octree->position.z - octree->size, scale);
+
+    return OCT_SENTINEL_BIT | oct_morton_spread(x) |
+           oct_morton_spread(y) << 1 | oct_morton_spread(z) << 2;
 }
 
-LeafNode*
-oct_leaf_node_init(Octree* octree, uint64_t parent_location,
-                   uint8_t child_location, uint64_t object_index)
+#if defined(OCT_MORTON_AVX2)
+/**
+ * @brief Encode four positions per step. The quantization is done on doubles
+ * exactly as oct_quantize does it, and PDEP deposits the cell of every axis
+ * on every third bit. Returns the amount of positions encoded, the rest is
+ * left to the caller.
+ */
+__attribute__((target("avx2,bmi2"))) static size_t
+oct_location_codes_encode_avx2(const Position* positions, size_t count,
+                               const double min[3], double scale,
+                               uint64_t* codes, size_t stride)
 {
-    LeafNode* node = malloc(sizeof *node);
-    if (node == NULL) {
-        /* printf("Error creating node, malloc failed"); */
-        return NULL;
-    }
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d top = _mm256_set1_pd((double)(OCT_CELL_COUNT - 1));
+    const __m256d scales = _mm256_set1_pd(scale);
+    const __m256d min_x = _mm256_set1_pd(min[0]);
+    const __m256d min_y = _mm256_set1_pd(min[1]);
+    const __m256d min_z = _mm256_set1_pd(min[2]);
 
-    uint64_t new_location = (parent_location << 3) | child_location;
-    node->base.location_code = new_location;
-    node->base.type = LEAF_NODE;
-    node->object_index = object_index;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const Position* p = positions + i;
+        __m256d x = _mm256_cvtps_pd(_mm_set_ps(p[3].x, p[2].x, p[1].x, p[0].x));
+        __m256d y = _mm256_cvtps_pd(_mm_set_ps(p[3].y, p[2].y, p[1].y, p[0].y));
+        __m256d z = _mm256_cvtps_pd(_mm_set_ps(p[3].z, p[2].z, p[1].z, p[0].z));
 
-    unordered_map_put(octree->nodes, &node->base.location_code, node);
-    octree->leaf_count++;
+        x = _mm256_mul_pd(_mm256_sub_pd(x, min_x), scales);
+        y = _mm256_mul_pd(_mm256_sub_pd(y, min_y), scales);
+        z = _mm256_mul_pd(_mm256_sub_pd(z, min_z), scales);
 
-    if (parent_location) {
-        BranchNode* parent_node =
-            (BranchNode*)oct_node_lookup(octree, parent_location);
-        parent_node->child_exists |= (1u << child_location);
+        uint32_t cells[3][4];
+        _mm_storeu_si128((__m128i*)cells[0],
+                         _mm256_cvttpd_epi32(_mm256_min_pd(
+                             _mm256_max_pd(x, zero), top)));
+        _mm_storeu_si128((__m128i*)cells[1],
+                         _mm256_cvttpd_epi32(_mm256_min_pd(
+                             _mm256_max_pd(y, zero), top)));
+        _mm_storeu_si128((__m128i*)cells[2],
+                         _mm256_cvttpd_epi32(_mm256_min_pd(
+                             _mm256_max_pd(z, zero), top)));
+
+        for (int lane = 0; lane < 4; lane++) {
+            codes[(i + lane) * stride] =
+                OCT_SENTINEL_BIT |
+                _pdep_u64(cells[0][lane], 0x1249249249249249ull) |
+                _pdep_u64(cells[1][lane], 0x2492492492492492ull) |
+                _pdep_u64(cells[2][lane], 0x4924924924924924ull);
+        }
     }
 
-    // If we just removed the root node set it to the new inner node
-    if (new_location == 0b1) {
-        octree->root_node = node;
+    return i;
+}
+#endif
+
+/**
+ * @brief Encode an array of positions, writing the code of position i to
+ * codes[i * stride]. Uses the AVX2 and BMI2 kernel when the CPU has both.
+ */
+static void
+oct_location_codes_encode(Octree* octree, const Position* positions,
+                          size_t count, uint64_t* codes, size_t stride)
+{
+    size_t done = 0;
+#if defined(OCT_MORTON_AVX2)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        const double min[3] = {
+            (float)(octree->position.x - octree->size),
+            (float)(octree->position.y - octree->size),
+            (float)(octree->position.z - octree->size),
+        };
+        done = oct_location_codes_encode_avx2(
+            positions, count, min, OCT_CELL_COUNT / (2.0 * octree->size),
+            codes, stride);
     }
+#endif
 
-    return node;
+    for (size_t i = done; i < count; i++) {
+        codes[i * stride] = oct_position_get_location_code(octree, positions[i]);
+    }
 }
 
 void
-oct_leaf_node_free(Octree* octree, uint64_t location_code) 
+oct_positions_get_location_codes(Octree* octree, const Position* positions,
+                                 size_t count, uint64_t* out_codes)
 {
-    unordered_map_remove(octree->nodes, &location_code);
-    octree->leaf_count--;
+    oct_location_codes_encode(octree, positions, count, out_codes, 1);
 }
 
-LeafNode*
-oct_leaf_node_find(Octree* octree, BaseNode* node,
-                   Position object_position)
+/**
+ * @brief LSD radix sort on the location codes, one byte per pass. Passes where
+ * every code has the same byte are skipped, which drops the sentinel byte and
+ * any levels that all objects share.
+ */
+static void
+oct_radix_sort(OctSortItem* items, OctSortItem* scratch, size_t count)
 {
-    switch (node->type) {
-        case LEAF_NODE:
-            return (LeafNode*)node;
-            break;
-        case INNER_NODE: {
-            Position node_position = oct_node_get_position(octree, node);
+    static const int pass_count = sizeof(uint64_t);
+    size_t histogram[sizeof(uint64_t)][256];
+    memset(histogram, 0, sizeof histogram);
 
-            uint8_t child_location = 0;
-            child_location |= object_position.x < node_position.x ? 0 : 0b001;
-            child_location |= object_position.y < node_position.y ? 0 : 0b010;
-            child_location |= object_position.z < node_position.z ? 0 : 0b100;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t code = items[i].location_code;
+        for (int pass = 0; pass < pass_count; pass++) {
+            histogram[pass][(code >> (8 * pass)) & 0xff]++;
+        }
+    }
 
-            if (((BranchNode*)node)->child_exists &
-                (1u << child_location)) {
-                return oct_leaf_node_find(
-                    octree,
-                    oct_node_get_child(octree, node->location_code,
-                                       child_location),
-                    object_position);
-            }
+    OctSortItem* src = items;
+    OctSortItem* dst = scratch;
+    for (int pass = 0; pass < pass_count; pass++) {
+        int shift = 8 * pass;
+        size_t* offsets = histogram[pass];
+        if (offsets[(src[0].location_code >> shift) & 0xff] == count) {
+            continue;
+        }
 
-            return oct_leaf_node_init(octree, node->location_code,
-                                      child_location, ULLONG_MAX);
+        size_t sum = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t digit_count = offsets[digit];
+            offsets[digit] = sum;
+            sum += digit_count;
+        }
 
-            break;
+        for (size_t i = 0; i < count; i++) {
+            dst[offsets[(src[i].location_code >> shift) & 0xff]++] = src[i];
         }
-        default: 
-            // If there was an error with the node type exit switch and return NULL
-            break;
+
+        OctSortItem* swap = src;
+        src = dst;
+        dst = swap;
     }
 
-    return NULL;
+    if (src != items) {
+        memcpy(items, src, count * sizeof *items);
+    }
 }
 
-LeafNode*
-oct_leaf_node_split(Octree* octree, LeafNode* node)
+/**
+ * @brief The depth of the node with a location code.
+ */
+static int
+oct_location_code_depth(uint64_t location_code)
 {
-    uint64_t object_index = node->object_index;
-    uint64_t location_code = node->base.location_code;
-    oct_leaf_node_free(octree, location_code);
-
-    BranchNode* inner_node = oct_branch_node_init(octree, location_code);
-    if (node == NULL) {
-        return NULL;
+#if defined(__GNUC__)
+    return (63 - __builtin_clzll(location_code)) / 3;
+#else
+    int depth = 0;
+    while (location_code > 1) {
+        location_code >>= 3;
+        depth++;
     }
-
-    LeafNode* new_child =
-        oct_leaf_node_find(octree, (BaseNode*)inner_node,
-                           octree->object_positions[object_index]);
-    new_child->object_index = object_index;
-
-    return new_child;
+    return depth;
+#endif
 }
 
-Position
-oct_node_get_position(Octree* octree, BaseNode* node)
+/**
+ * @brief The depth of the deepest node that holds both of two full-depth
+ * location codes, OCT_MAX_DEPTH if they are equal.
+ */
+static int
+oct_location_code_common_depth(uint64_t a, uint64_t b)
 {
-    Position position = octree->position;
-
-    int tree_depth = oct_node_get_tree_depth(octree, node);
-    for (int i = 0; i < tree_depth; i += 3) {
-        uint64_t offset = 1;
-        offset = offset << (tree_depth * 3 - 3 * i);
-        uint8_t local_code = node->location_code & offset;
-        position.x = (local_code & 0b001)
-                          ? position.x + octree->size / (2.0f * tree_depth)
-                          : position.x - octree->size / (2.0f * tree_depth);
-        position.y = (local_code & 0b010)
-                          ? position.y + octree->size / (2.0f * tree_depth)
-                          : position.y - octree->size / (2.0f * tree_depth);
-        position.z = (local_code & 0b100)
-                          ? position.z + octree->size / (2.0f * tree_depth)
-                          : position.z - octree->size / (2.0f * tree_depth);
+    uint64_t diff = a ^ b;
+    if (diff == 0) {
+        return OCT_MAX_DEPTH;
     }
 
-    return position;
-}
-
-size_t
-oct_node_get_tree_depth(Octree* octree, const BaseNode* node)
-{
 #if defined(__GNUC__)
-    return (63 - __builtin_clzll(node->location_code)) / 3;
+    int msb = 63 - __builtin_clzll(diff);
 #elif defined(_MSC_VER)
-    long msb;
-    _BitScanReverse(&msb, node->location_code);
-    return msb / 3;
+    unsigned long msb;
+    _BitScanReverse64(&msb, diff);
 #else
-    size_t depth;
-    for (uint32_t lc = node->location_code, depth = 0; lc != 1;
-         lc >>= 3, depth++)
-        ;
-    return depth;
+    int msb = 63;
+    while (!(diff >> msb)) {
+        msb--;
+    }
 #endif
+    return (3 * OCT_MAX_DEPTH - 1 - (int)msb) / 3;
 }
 
-BaseNode*
-oct_node_get_parent(Octree* octree, BaseNode* node)
+static LeafNode*
+oct_leaf_node_alloc(Octree* octree, uint64_t location_code,
+                    uint64_t object_offset, uint32_t object_count)
 {
-    uint64_t location_code_parent = node->location_code >> 3;
-    return oct_node_lookup(octree, location_code_parent);
+    LeafNode* node = node_pool_alloc(&octree->leaf_pool);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->base.location_code = location_code;
+    node->base.type = LEAF_NODE;
+    node->object_offset = object_offset;
+    node->object_count = object_count;
+    node->object_capacity = object_count;
+
+    if (!node_map_put(octree->nodes, location_code, node, NULL)) {
+        node_pool_release(&octree->leaf_pool, node);
+        return NULL;
+    }
+    octree->leaf_count++;
+
+    // If we just removed the root node set it to the new inner node
+    if (location_code == 0b1) {
+        octree->root_node = node;
+    }
+
+    return node;
 }
 
-BaseNode*
-oct_node_get_child(Octree* octree, uint64_t location_code,
-                   uint8_t child_location)
+static void
+oct_octree_clear(Octree* octree)
 {
-    uint64_t child_location_code = (location_code << 3) | child_location;
-    return oct_node_lookup(octree, child_location_code);
+    node_map_clear(octree->nodes);
+    node_pool_reset(&octree->leaf_pool);
+    node_pool_reset(&octree->branch_pool);
+    if (octree->aggregates != NULL) {
+        node_map_clear(octree->aggregates);
+        node_pool_reset(&octree->aggregate_pool);
+    }
+
+    octree->leaf_count = 0;
+    octree->inner_count = 0;
+    octree->root_node = NULL;
 }
 
-BaseNode*
-oct_node_lookup(Octree* octree, uint64_t location_code)
+/**
+ * @brief Give a succinct tree a node map again so it can be built.
+ */
+static bool
+oct_octree_leave_succinct(Octree* octree)
 {
-    return unordered_map_get(octree->nodes, &location_code);
+    if (octree->succinct == NULL) {
+        return true;
+    }
+
+    node_map* nodes = node_map_alloc(OCT_DEFAULT_NODE_CAPACITY);
+    if (nodes == NULL) {
+        return false;
+    }
+    octree->nodes = nodes;
+    succinct_tree_free(octree->succinct);
+    octree->succinct = NULL;
+    return true;
 }
 
-size_t 
-oct_octree_get_size(Octree* octree)
+/**
+ * @brief Drop the aggregate value of a node that is freed.
+ */
+static void
+oct_aggregate_forget(Octree* octree, uint64_t location_code)
 {
-    return octree->size;
+    if (octree->aggregates == NULL) {
+        return;
+    }
+
+    void* value = node_map_remove(octree->aggregates, location_code);
+    if (value != NULL) {
+        node_pool_release(&octree->aggregate_pool, value);
+    }
 }
 
-size_t 
-oct_octree_get_leaf_count(Octree* octree)
+/**
+ * @brief Put node in the place of old_node, a node of the other type with the
+ * same location code, and release old_node. The key is removed before it is
+ * put back, so the map never has to grow and this can not fail.
+ */
+static void
+oct_node_replace(Octree* octree, BaseNode* old_node, BaseNode* node)
 {
-    return octree->leaf_count;
+    uint64_t location_code = node->location_code;
+    node_map_remove(octree->nodes, location_code);
+    node_map_put(octree->nodes, location_code, node, NULL);
+    oct_aggregate_forget(octree, location_code);
+
+    if (old_node->type == LEAF_NODE) {
+        node_pool_release(&octree->leaf_pool, old_node);
+        octree->leaf_count--;
+        octree->inner_count++;
+    } else {
+        node_pool_release(&octree->branch_pool, old_node);
+        octree->inner_count--;
+        octree->leaf_count++;
+    }
+
+    if (location_code == 0b1) {
+        octree->root_node = node;
+    }
 }
 
-size_t 
-oct_octree_get_inner_count(Octree* octree)
+/**
+ * @brief Drop the aggregate after an allocation failure, so no node is left
+ * with a stale value.
+ */
+static void
+oct_aggregate_drop(Octree* octree)
 {
-    return octree->inner_count;
+    node_map_free(octree->aggregates);
+    octree->aggregates = NULL;
+    node_pool_destroy(&octree->aggregate_pool);
+}
+
+/**
+ * @brief Take an aggregate value for a node, reusing the one it has.
+ */
+static void*
+oct_aggregate_value(Octree* octree, uint64_t location_code)
+{
+    void* value = node_map_get(octree->aggregates, location_code);
+    if (value == NULL) {
+        value = node_pool_alloc(&octree->aggregate_pool);
+        if (value != NULL &&
+            !node_map_put(octree->aggregates, location_code, value, NULL)) {
+            node_pool_release(&octree->aggregate_pool, value);
+            value = NULL;
+        }
+    }
+
+    return value;
+}
+
+/**
+ * @brief Fill the aggregate value of a leaf from its objects.
+ */
+static void
+oct_aggregate_leaf(Octree* octree, const OctCursor* cursor, void* value)
+{
+    const OctAggregate* aggregate = &octree->aggregate;
+    size_t count = 0;
+    const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+
+    aggregate->init(value, aggregate->context);
+    for (size_t i = 0; i < count; i++) {
+        aggregate->add_object(value, objects[i],
+                              octree->object_positions[objects[i]],
+                              aggregate->context);
+    }
+}
+
+/**
+ * @brief Compute the aggregate value of every node. The nodes are listed in
+ * level order, so the children of a node come after it and the nodes of a
+ * level lie next to each other. The levels are then computed from the deepest
+ * up, and the nodes of one level in parallel.
+ */
+static bool
+oct_aggregate_compute_all(Octree* octree)
+{
+    if (octree->aggregates == NULL) {
+        return true;
+    }
+
+    node_map_clear(octree->aggregates);
+    node_pool_reset(&octree->aggregate_pool);
+
+    size_t capacity = OCT_DEFAULT_NODE_CAPACITY;
+    size_t count = 1;
+    OctCursor* cursors = malloc(capacity * sizeof *cursors);
+    size_t* first_child = malloc((capacity + 1) * sizeof *first_child);
+    void** values = NULL;
+    bool computed = cursors != NULL && first_child != NULL;
+    if (computed) {
+        cursors[0] = oct_cursor_root(octree);
+    }
+
+    for (size_t i = 0; computed && i < count; i++) {
+        OctCursor cursor = cursors[i];
+        uint8_t child_exists = oct_cursor_child_exists(octree, &cursor);
+        first_child[i] = count;
+        for (uint8_t child = 0; computed && child < 8; child++) {
+            if (!(child_exists & (1u << child))) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                OctCursor* grown = realloc(cursors, capacity * sizeof *grown);
+                cursors = grown != NULL ? grown : cursors;
+                size_t* grown_first =
+                    realloc(first_child, (capacity + 1) * sizeof *grown_first);
+                first_child = grown_first != NULL ? grown_first : first_child;
+                computed = grown != NULL && grown_first != NULL;
+                if (!computed) {
+                    break;
+                }
+            }
+            oct_cursor_child(octree, &cursor, child, &cursors[count++]);
+        }
+    }
+
+    if (computed) {
+        first_child[count] = count;
+        values = malloc(count * sizeof *values);
+        computed = values != NULL &&
+                   node_map_reserve(octree->aggregates, count);
+    }
+    for (size_t i = 0; computed && i < count; i++) {
+        values[i] = node_pool_alloc(&octree->aggregate_pool);
+        computed = values[i] != NULL;
+        if (computed && !node_map_put(octree->aggregates,
+                                      cursors[i].location_code, values[i],
+                                      NULL)) {
+            node_pool_release(&octree->aggregate_pool, values[i]);
+            computed = false;
+        }
+    }
+
+    const OctAggregate* aggregate = &octree->aggregate;
+    size_t end = computed ? count : 0;
+    while (end > 0) {
+        size_t begin = end - 1;
+        while (begin > 0 && cursors[begin - 1].depth == cursors[end - 1].depth) {
+            begin--;
+        }
+
+        size_t i;
+        #pragma omp parallel for schedule(dynamic, 64) \
+            if (end - begin >= OCT_AGGREGATE_PARALLEL_MIN)
+        for (i = begin; i < end; i++) {
+            if (first_child[i] == first_child[i + 1]) {
+                oct_aggregate_leaf(octree, &cursors[i], values[i]);
+                continue;
+            }
+
+            aggregate->init(values[i], aggregate->context);
+            for (size_t child = first_child[i]; child < first_child[i + 1];
+                 child++) {
+                aggregate->combine(values[i], values[child],
+                                   aggregate->context);
+            }
+        }
+        end = begin;
+    }
+
+    free(cursors);
+    free(first_child);
+    free(values);
+    if (!computed) {
+        oct_aggregate_drop(octree);
+    }
+    return computed;
+}
+
+/**
+ * @brief Where the build puts the nodes it creates. The serial build writes
+ * straight into the octree. Each partition of a parallel build gets its own
+ * pools and a list of its nodes, which are merged into the octree afterwards.
+ */
+typedef struct _OctBuildTarget
+{
+    node_pool* leaf_pool;
+    node_pool* branch_pool;
+    node_map* nodes;
+    BaseNode** emitted;
+    size_t emitted_count;
+    size_t emitted_capacity;
+    size_t leaf_count;
+    size_t inner_count;
+    size_t leaf_capacity;
+    int max_depth;
+    bool failed;
+} OctBuildTarget;
+
+static BaseNode*
+oct_build_emit_node(OctBuildTarget* target, uint64_t location_code,
+                    uint8_t type, uint64_t object_offset,
+                    uint32_t object_count)
+{
+    BaseNode* node;
+    if (type == LEAF_NODE) {
+        LeafNode* leaf = node_pool_alloc(target->leaf_pool);
+        if (leaf == NULL) {
+            target->failed = true;
+            return NULL;
+        }
+        leaf->object_offset = object_offset;
+        leaf->object_count = object_count;
+        leaf->object_capacity = object_count;
+        node = &leaf->base;
+        target->leaf_count++;
+    } else {
+        BranchNode* branch = node_pool_alloc(target->branch_pool);
+        if (branch == NULL) {
+            target->failed = true;
+            return NULL;
+        }
+        branch->child_exists = 0;
+        node = &branch->base;
+        target->inner_count++;
+    }
+    node->location_code = location_code;
+    node->type = type;
+
+    if (target->nodes != NULL) {
+        if (!node_map_put(target->nodes, location_code, node, NULL)) {
+            if (type == LEAF_NODE) {
+                node_pool_release(target->leaf_pool, node);
+                target->leaf_count--;
+            } else {
+                node_pool_release(target->branch_pool, node);
+                target->inner_count--;
+            }
+            target->failed = true;
+            return NULL;
+        }
+        return node;
+    }
+
+    if (target->emitted_count == target->emitted_capacity) {
+        size_t capacity = target->emitted_capacity
+            ? 2 * target->emitted_capacity
+            : 64;
+        BaseNode** emitted =
+            realloc(target->emitted, capacity * sizeof *emitted);
+        if (emitted == NULL) {
+            target->failed = true;
+            return node;
+        }
+        target->emitted = emitted;
+        target->emitted_capacity = capacity;
+    }
+    target->emitted[target->emitted_count++] = node;
+
+    return node;
+}
+
+/**
+ * @brief Emit the nodes for a run of sorted location codes in a single pass.
+ *
+ * A node is a branch when it holds more than leaf_capacity objects, so the
+ * leaf that starts at object i sits one level below the deepest node that
+ * holds both object i and object i + leaf_capacity. It also sits below the
+ * deepest ancestor it shares with the previous leaf, and every branch between
+ * that ancestor and itself is new. Branches on the current path are kept so
+ * their child bits can be set without a lookup.
+ *
+ * With base_depth -1 the run is the whole tree. Otherwise all codes share the
+ * branch base_node at base_depth and only the nodes below it are emitted.
+ * Leaf ranges are offset by offset into the octree's object_indices.
+ */
+static void
+oct_build_emit(OctBuildTarget* target, const OctSortItem* items,
+               size_t count, size_t offset, int base_depth,
+               BranchNode* base_node)
+{
+    BranchNode* path[OCT_MAX_DEPTH + 1];
+    if (base_depth >= 0) {
+        path[base_depth] = base_node;
+    }
+
+    int prev_depth = base_depth;
+    size_t i = 0;
+    while (i < count && !target->failed) {
+        uint64_t code = items[i].location_code;
+        size_t split = count - i > target->leaf_capacity
+            ? i + target->leaf_capacity
+            : count;
+        int split_depth = split < count
+            ? oct_location_code_common_depth(code, items[split].location_code)
+            : base_depth;
+        int depth = (prev_depth > split_depth ? prev_depth : split_depth) + 1;
+        if (depth > target->max_depth) {
+            depth = target->max_depth;
+        }
+
+        size_t end = i + 1;
+        while (end < count &&
+               oct_location_code_common_depth(
+                   code, items[end].location_code) >= depth) {
+            end++;
+        }
+
+        for (int d = prev_depth + 1; d <= depth; d++) {
+            uint64_t location_code = code >> (3 * (OCT_MAX_DEPTH - d));
+            BaseNode* node = oct_build_emit_node(
+                target, location_code, d < depth ? INNER_NODE : LEAF_NODE,
+                offset + i, (uint32_t)(end - i));
+            if (node == NULL) {
+                return;
+            }
+            if (d > 0) {
+                path[d - 1]->child_exists |= 1u << (location_code & 0b111);
+            }
+            path[d] = (BranchNode*)node;
+        }
+
+        prev_depth = end < count
+            ? oct_location_code_common_depth(code, items[end].location_code)
+            : base_depth;
+        i = end;
+    }
+}
+
+/**
+ * @brief Make room for the sorted object indices and the location codes of
+ * the objects of a build.
+ */
+static bool
+oct_octree_reserve_objects(Octree* octree, size_t object_count)
+{
+    uint64_t* indices =
+        realloc(octree->object_indices, object_count * sizeof *indices);
+    if (indices == NULL) {
+        return false;
+    }
+    octree->object_indices = indices;
+    octree->slot_capacity = object_count;
+
+    uint64_t* codes =
+        realloc(octree->object_codes, object_count * sizeof *codes);
+    if (codes == NULL) {
+        return false;
+    }
+    octree->object_codes = codes;
+    octree->object_code_count = object_count;
+    octree->object_index_count = object_count;
+
+    octree->object_count = object_count;
+    octree->slot_count = object_count;
+    octree->free_slot_count = 0;
+    return true;
+}
+
+/**
+ * @brief Leave a build that ran out of memory with an empty tree: a root leaf
+ * without objects, so no branch points at a node that was never made.
+ */
+static void
+oct_octree_build_failed(Octree* octree)
+{
+    oct_octree_clear(octree);
+    octree->object_count = 0;
+    octree->slot_count = 0;
+    octree->free_slot_count = 0;
+    octree->object_code_count = 0;
+    octree->object_index_count = 0;
+    oct_leaf_node_alloc(octree, 0b1, 0, 0);
+    oct_aggregate_compute_all(octree);
+}
+
+/**
+ * @brief Sort the location codes of the objects of a cleared tree and emit its
+ * nodes. items needs room for twice count items, the second half is scratch
+ * space for the sort.
+ *
+ * @return false if a node could not be made, the tree is then left empty by
+ * oct_octree_build_failed.
+ */
+static bool
+oct_octree_build_sorted(Octree* octree, OctSortItem* items, size_t count)
+{
+    // A tree has fewer than two nodes per leaf unless the objects are heavily
+    // clustered, so reserve for that up front.
+    node_map_reserve(octree->nodes, 2 * (count / octree->leaf_capacity + 1));
+
+    oct_radix_sort(items, items + count, count);
+    for (size_t i = 0; i < count; i++) {
+        octree->object_indices[i] = items[i].object_index;
+        octree->object_codes[items[i].object_index] = items[i].location_code;
+    }
+
+    OctBuildTarget target = {
+        .leaf_pool = &octree->leaf_pool,
+        .branch_pool = &octree->branch_pool,
+        .nodes = octree->nodes,
+        .leaf_capacity = octree->leaf_capacity,
+        .max_depth = octree->max_depth,
+    };
+    oct_build_emit(&target, items, count, 0, -1, NULL);
+    if (target.failed) {
+        oct_octree_build_failed(octree);
+        return false;
+    }
+    octree->leaf_count = target.leaf_count;
+    octree->inner_count = target.inner_count;
+    octree->root_node = oct_node_lookup(octree, 0b1);
+    return true;
 }
 
-// TEST CASE
 void
-oct_visit_all(Octree* octree, BaseNode* node)
+oct_octree_build(Octree* octree, Position* object_positions,
+                 size_t object_count)
 {
-    for (int i = 0; i < 8; i++) {
-        if (node->type == INNER_NODE) {
-            if (((BranchNode*)node)->child_exists & (1 << i)) {
-                BaseNode* child =
-                    oct_node_get_child(octree, node->location_code, i);
-                oct_visit_all(octree, child);
+    if (octree->mapping != NULL || octree->concurrent != NULL ||
+        !oct_octree_leave_succinct(octree)) {
+        return;
+    }
+
+    oct_octree_clear(octree);
+    octree->object_positions = object_positions;
+    octree->object_count = 0;
+    octree->slot_count = 0;
+    octree->free_slot_count = 0;
+    octree->object_code_count = 0;
+    octree->object_index_count = 0;
+
+    if (object_count == 0) {
+        oct_leaf_node_alloc(octree, 0b1, 0, 0);
+        oct_aggregate_compute_all(octree);
+        return;
+    }
+
+    OctSortItem* items = malloc(2 * object_count * sizeof *items);
+    if (items == NULL || !oct_octree_reserve_objects(octree, object_count)) {
+        free(items);
+        oct_octree_build_failed(octree);
+        return;
+    }
+
+    oct_location_codes_encode(octree, object_positions, object_count,
+                              &items[0].location_code, OCT_SORT_ITEM_STRIDE);
+    for (size_t i = 0; i < object_count; i++) {
+        items[i].object_index = i;
+    }
+    if (oct_octree_build_sorted(octree, items, object_count)) {
+        oct_aggregate_compute_all(octree);
+    }
+
+    free(items);
+}
+
+/**
+ * @brief The first levels of a parallel build, created serially from the
+ * partition sizes. A node with up to leaf_capacity objects becomes a leaf, and
+ * a branch at OCT_PARTITION_DEPTH is recorded so its subtree can be built in
+ * parallel. The objects of such a shallow leaf are still in scatter order, so
+ * they are radix sorted like those of every other leaf.
+ *
+ * @return false if a node could not be made.
+ */
+static bool
+oct_build_top_levels(Octree* octree, OctSortItem* items, OctSortItem* scratch,
+                     const size_t* partition_offsets, uint64_t location_code,
+                     int depth, BranchNode** partition_nodes)
+{
+    int shift = 3 * (OCT_PARTITION_DEPTH - depth);
+    size_t first = (location_code << shift) - (1ull << (3 * OCT_PARTITION_DEPTH));
+    size_t last = first + (1ull << shift);
+    size_t begin = partition_offsets[first];
+    size_t count = partition_offsets[last] - begin;
+
+    if (count <= octree->leaf_capacity) {
+        oct_radix_sort(items + begin, scratch + begin, count);
+        return oct_leaf_node_alloc(octree, location_code, begin,
+                                   (uint32_t)count) != NULL;
+    }
+
+    BranchNode* node = oct_branch_node_init(octree, location_code);
+    if (node == NULL) {
+        return false;
+    }
+
+    if (depth == OCT_PARTITION_DEPTH) {
+        partition_nodes[first] = node;
+        return true;
+    }
+
+    for (uint8_t child = 0; child < 8; child++) {
+        uint64_t child_code = (location_code << 3) | child;
+        size_t child_first =
+            (child_code << (shift - 3)) - (1ull << (3 * OCT_PARTITION_DEPTH));
+        size_t child_count =
+            partition_offsets[child_first + (1ull << (shift - 3))] -
+            partition_offsets[child_first];
+        if (child_count == 0) {
+            continue;
+        }
+
+        node->child_exists |= 1u << child;
+        if (!oct_build_top_levels(octree, items, scratch, partition_offsets,
+                                  child_code, depth + 1, partition_nodes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+oct_octree_build_parallel(Octree* octree, Position* object_positions,
+                          size_t object_count, int thread_count)
+{
+    if (octree->mapping != NULL || octree->concurrent != NULL ||
+        !oct_octree_leave_succinct(octree)) {
+        return;
+    }
+
+    if (thread_count <= 0) {
+        thread_count = oct_default_thread_count();
+    }
+    if (thread_count == 1 || object_count < OCT_PARALLEL_MIN_OBJECTS ||
+        octree->max_depth <= OCT_PARTITION_DEPTH) {
+        oct_octree_build(octree, object_positions, object_count);
+        return;
+    }
+
+    // The partitions bring their own slabs, so drop the old ones instead of
+    // letting them pile up behind the adopted ones.
+    oct_octree_clear(octree);
+    node_pool_destroy(&octree->leaf_pool);
+    node_pool_destroy(&octree->branch_pool);
+    octree->object_positions = object_positions;
+    octree->object_count = 0;
+    octree->slot_count = 0;
+    octree->free_slot_count = 0;
+    octree->object_code_count = 0;
+    octree->object_index_count = 0;
+
+    OctSortItem* items = malloc(2 * object_count * sizeof *items);
+    size_t* histograms =
+        calloc((size_t)thread_count * OCT_PARTITION_COUNT, sizeof *histograms);
+    size_t partition_offsets[OCT_PARTITION_COUNT + 1];
+    BranchNode* partition_nodes[OCT_PARTITION_COUNT] = {NULL};
+    OctBuildTarget* targets = calloc(OCT_PARTITION_COUNT, sizeof *targets);
+    if (items == NULL || histograms == NULL || targets == NULL ||
+        !oct_octree_reserve_objects(octree, object_count)) {
+        free(items);
+        free(histograms);
+        free(targets);
+        oct_octree_build_failed(octree);
+        return;
+    }
+    OctSortItem* scratch = items + object_count;
+    int partition_shift = 3 * (OCT_MAX_DEPTH - OCT_PARTITION_DEPTH);
+
+    // Encode the objects and counting sort them on the octant of the first
+    // OCT_PARTITION_DEPTH levels. Every thread counts and scatters its own
+    // chunk of the input.
+    #pragma omp parallel num_threads(thread_count)
+    {
+        int thread = oct_thread_num();
+        int threads = oct_thread_count();
+        size_t begin = object_count * thread / threads;
+        size_t end = object_count * (thread + 1) / threads;
+        size_t* histogram = histograms + (size_t)thread * OCT_PARTITION_COUNT;
+
+        oct_location_codes_encode(octree, object_positions + begin,
+                                  end - begin, &scratch[begin].location_code,
+                                  OCT_SORT_ITEM_STRIDE);
+        for (size_t i = begin; i < end; i++) {
+            uint64_t code = scratch[i].location_code;
+            scratch[i].object_index = i;
+            histogram[(code >> partition_shift) & (OCT_PARTITION_COUNT - 1)]++;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            size_t sum = 0;
+            for (size_t p = 0; p < OCT_PARTITION_COUNT; p++) {
+                partition_offsets[p] = sum;
+                for (int t = 0; t < threads; t++) {
+                    size_t count = histograms[(size_t)t * OCT_PARTITION_COUNT + p];
+                    histograms[(size_t)t * OCT_PARTITION_COUNT + p] = sum;
+                    sum += count;
+                }
             }
+            partition_offsets[OCT_PARTITION_COUNT] = sum;
+        }
+
+        for (size_t i = begin; i < end; i++) {
+            uint64_t code = scratch[i].location_code;
+            items[histogram[(code >> partition_shift) &
+                            (OCT_PARTITION_COUNT - 1)]++] = scratch[i];
+        }
+    }
+    free(histograms);
+
+    node_map_reserve(octree->nodes,
+                     2 * (object_count / octree->leaf_capacity + 1));
+    if (!oct_build_top_levels(octree, items, scratch, partition_offsets, 0b1,
+                              0, partition_nodes)) {
+        free(targets);
+        free(items);
+        oct_octree_build_failed(octree);
+        return;
+    }
+
+    // Sort and emit the subtree of every partition on its own thread, into
+    // the partition's own pools.
+    int partition;
+    #pragma omp parallel for schedule(dynamic) num_threads(thread_count)
+    for (partition = 0; partition < OCT_PARTITION_COUNT; partition++) {
+        if (partition_nodes[partition] == NULL) {
+            continue;
+        }
+
+        OctBuildTarget* target = &targets[partition];
+        target->leaf_pool = malloc(2 * sizeof(node_pool));
+        if (target->leaf_pool == NULL) {
+            target->failed = true;
+            continue;
+        }
+        target->branch_pool = target->leaf_pool + 1;
+        target->leaf_capacity = octree->leaf_capacity;
+        target->max_depth = octree->max_depth;
+        node_pool_init(target->leaf_pool, sizeof(LeafNode));
+        node_pool_init(target->branch_pool, sizeof(BranchNode));
+
+        size_t begin = partition_offsets[partition];
+        size_t count = partition_offsets[partition + 1] - begin;
+        oct_radix_sort(items + begin, scratch + begin, count);
+        oct_build_emit(target, items + begin, count, begin,
+                       OCT_PARTITION_DEPTH, partition_nodes[partition]);
+    }
+
+    size_t i;
+    #pragma omp parallel for num_threads(thread_count)
+    for (i = 0; i < object_count; i++) {
+        octree->object_indices[i] = items[i].object_index;
+        octree->object_codes[items[i].object_index] = items[i].location_code;
+    }
+
+    // Merge the partitions into the shared node index. Their pools are
+    // adopted either way, so a failed partition or merge can release
+    // everything at once.
+    bool merged = true;
+    for (int p = 0; p < OCT_PARTITION_COUNT; p++) {
+        OctBuildTarget* target = &targets[p];
+        if (target->failed) {
+            merged = false;
+        }
+        if (target->leaf_pool == NULL) {
+            continue;
+        }
+
+        for (size_t n = 0; n < target->emitted_count && merged; n++) {
+            BaseNode* node = target->emitted[n];
+            merged = node_map_put(octree->nodes, node->location_code, node,
+                                  NULL);
+        }
+        octree->leaf_count += target->leaf_count;
+        octree->inner_count += target->inner_count;
+
+        node_pool_adopt(&octree->leaf_pool, target->leaf_pool);
+        node_pool_adopt(&octree->branch_pool, target->branch_pool);
+        free(target->leaf_pool);
+        free(target->emitted);
+    }
+    if (merged) {
+        oct_aggregate_compute_all(octree);
+    } else {
+        oct_octree_build_failed(octree);
+    }
+
+    free(targets);
+    free(items);
+}
+
+BranchNode*
+oct_branch_node_init(Octree* octree, uint64_t location_code)
+{
+    BranchNode* node = node_pool_alloc(&octree->branch_pool);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->base.location_code = location_code;
+    node->base.type = INNER_NODE;
+    node->child_exists = 0b00;
+
+    if (!node_map_put(octree->nodes, location_code, node, NULL)) {
+        node_pool_release(&octree->branch_pool, node);
+        return NULL;
+    }
+    octree->inner_count++;
+
+    // If we just removed the root node set it to the new inner node
+    if (location_code == 0b1) {
+        octree->root_node = node;
+    }
+
+    return node;
+}
+
+void
+oct_branch_node_free(Octree* octree, uint64_t location_code) 
+{
+    BranchNode* node = node_map_remove(octree->nodes, location_code);
+    if (node == NULL) {
+        return;
+    }
+
+    node_pool_release(&octree->branch_pool, node);
+    oct_aggregate_forget(octree, location_code);
+    octree->inner_count--;
+}
+
+LeafNode*
+oct_leaf_node_init(Octree* octree, uint64_t parent_location,
+                   uint8_t child_location)
+{
+    uint64_t new_location = (parent_location << 3) | child_location;
+    LeafNode* node = oct_leaf_node_alloc(octree, new_location, 0, 0);
+    if (node == NULL) {
+        /* printf("Error creating node, malloc failed"); */
+        return NULL;
+    }
+
+    if (parent_location) {
+        BranchNode* parent_node =
+            (BranchNode*)oct_node_lookup(octree, parent_location);
+        parent_node->child_exists |= (1u << child_location);
+    }
+
+    return node;
+}
+
+void
+oct_leaf_node_free(Octree* octree, uint64_t location_code) 
+{
+    LeafNode* node = node_map_remove(octree->nodes, location_code);
+    if (node == NULL) {
+        return;
+    }
+
+    node_pool_release(&octree->leaf_pool, node);
+    oct_aggregate_forget(octree, location_code);
+    octree->leaf_count--;
+}
+
+LeafNode*
+oct_leaf_node_find(Octree* octree, BaseNode* node,
+                   Position object_position)
+{
+    // The child to take at every level is read from the location code of the
+    // position instead of comparing the position with the node center.
+    uint64_t code = oct_position_get_location_code(octree, object_position);
+    while (node != NULL && node->type == INNER_NODE) {
+        int depth = oct_location_code_depth(node->location_code);
+        uint8_t child_location =
+            (code >> (3 * (OCT_MAX_DEPTH - depth - 1))) & 0b111;
+        if (!(((BranchNode*)node)->child_exists & (1u << child_location))) {
+            return oct_leaf_node_init(octree, node->location_code,
+                                      child_location);
+        }
+
+        node = oct_node_get_child(octree, node->location_code,
+                                  child_location);
+    }
+
+    return node != NULL && node->type == LEAF_NODE ? (LeafNode*)node : NULL;
+}
+
+/**
+ * @brief Find the deepest node on the path to a full-depth location code. The
+ * node at low_depth on that path must exist.
+ */
+static BaseNode*
+oct_location_code_locate(Octree* octree, uint64_t code, int low_depth)
+{
+    // The nodes on the path to the point exist from the root down to some
+    // depth, so that depth can be found by bisection.
+    BaseNode* node =
+        oct_node_lookup(octree, code >> (3 * (OCT_MAX_DEPTH - low_depth)));
+    int low = low_depth;
+    int high = OCT_MAX_DEPTH;
+    while (low < high && node->type != LEAF_NODE) {
+        int middle = (low + high + 1) / 2;
+        BaseNode* candidate =
+            oct_node_lookup(octree, code >> (3 * (OCT_MAX_DEPTH - middle)));
+        if (candidate != NULL) {
+            node = candidate;
+            low = middle;
         } else {
-            /* printf("%p\n", node); */
+            high = middle - 1;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * @brief Compute the aggregate value of a node again from its objects or from
+ * the values of its children. A child without a value, like the ones a split
+ * just made, is computed first.
+ */
+static void*
+oct_aggregate_node(Octree* octree, BaseNode* node)
+{
+    void* value = oct_aggregate_value(octree, node->location_code);
+    if (value == NULL) {
+        return NULL;
+    }
+    if (node->type == LEAF_NODE) {
+        OctCursor cursor = oct_cursor_from_node(octree, node);
+        oct_aggregate_leaf(octree, &cursor, value);
+        return value;
+    }
+
+    const OctAggregate* aggregate = &octree->aggregate;
+    uint8_t child_exists = ((BranchNode*)node)->child_exists;
+    aggregate->init(value, aggregate->context);
+    for (uint8_t child = 0; child < 8; child++) {
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        uint64_t child_code = (node->location_code << 3) | child;
+        const void* child_value = node_map_get(octree->aggregates, child_code);
+        if (child_value == NULL) {
+            BaseNode* child_node = oct_node_lookup(octree, child_code);
+            child_value = child_node != NULL
+                ? oct_aggregate_node(octree, child_node)
+                : NULL;
+            if (child_value == NULL) {
+                return NULL;
+            }
+        }
+        aggregate->combine(value, child_value, aggregate->context);
+    }
+
+    return value;
+}
+
+/**
+ * @brief Compute the aggregate values on the path to a full-depth location
+ * code again, from the deepest node on it up to the root.
+ */
+static void
+oct_aggregate_update_path(Octree* octree, uint64_t code)
+{
+    if (octree->aggregates == NULL) {
+        return;
+    }
+
+    BaseNode* node = oct_location_code_locate(octree, code, 0);
+    while (node != NULL) {
+        if (oct_aggregate_node(octree, node) == NULL) {
+            oct_aggregate_drop(octree);
+            return;
         }
+        node = node->location_code != 0b1
+            ? oct_node_get_parent(octree, node)
+            : NULL;
+    }
+}
+
+BaseNode*
+oct_point_locate(Octree* octree, Position position)
+{
+    if (octree->succinct != NULL) {
+        return NULL;
+    }
+
+    uint64_t code = oct_position_get_location_code(octree, position);
+    return oct_location_code_locate(octree, code, 0);
+}
+
+BranchNode*
+oct_leaf_node_split(Octree* octree, LeafNode* node)
+{
+    uint64_t location_code = node->base.location_code;
+    int depth = (int)oct_node_get_tree_depth(octree, &node->base);
+    uint32_t object_count = node->object_count;
+    if (depth >= octree->max_depth || object_count == 0) {
+        return NULL;
+    }
+
+    // Group the objects by the octant they fall in, keeping the range. The
+    // leaf stays valid, its objects are only reordered.
+    uint64_t* objects = octree->object_indices + node->object_offset;
+    uint64_t* grouped = malloc(object_count * sizeof *grouped);
+    uint8_t* octants = malloc(object_count);
+    if (grouped == NULL || octants == NULL) {
+        free(grouped);
+        free(octants);
+        return NULL;
+    }
+
+    uint32_t offsets[9] = {0};
+    int shift = 3 * (OCT_MAX_DEPTH - depth - 1);
+    for (uint32_t i = 0; i < object_count; i++) {
+        uint64_t code = octree->object_codes[objects[i]];
+        octants[i] = (code >> shift) & 0b111;
+        offsets[octants[i] + 1]++;
+    }
+    for (int child = 0; child < 8; child++) {
+        offsets[child + 1] += offsets[child];
+    }
+    uint32_t fill[8];
+    memcpy(fill, offsets, sizeof fill);
+    for (uint32_t i = 0; i < object_count; i++) {
+        grouped[fill[octants[i]]++] = objects[i];
+    }
+    memcpy(objects, grouped, object_count * sizeof *objects);
+    free(grouped);
+    free(octants);
+
+    // Make the branch and its children before the leaf is touched, so a
+    // failure leaves the tree as it was.
+    BranchNode* inner_node = node_pool_alloc(&octree->branch_pool);
+    if (inner_node == NULL) {
+        return NULL;
+    }
+    inner_node->base.location_code = location_code;
+    inner_node->base.type = INNER_NODE;
+    inner_node->child_exists = 0b00;
+
+    for (uint8_t child = 0; child < 8; child++) {
+        uint32_t child_count = offsets[child + 1] - offsets[child];
+        if (child_count == 0) {
+            continue;
+        }
+
+        if (oct_leaf_node_alloc(octree, (location_code << 3) | child,
+                                node->object_offset + offsets[child],
+                                child_count) == NULL) {
+            for (uint8_t made = 0; made < child; made++) {
+                if (inner_node->child_exists & (1u << made)) {
+                    oct_leaf_node_free(octree, (location_code << 3) | made);
+                }
+            }
+            node_pool_release(&octree->branch_pool, inner_node);
+            return NULL;
+        }
+        inner_node->child_exists |= 1u << child;
+    }
+
+    // The children share the leaf's range, any room left at its end is lost.
+    octree->free_slot_count += node->object_capacity - object_count;
+    oct_node_replace(octree, &node->base, &inner_node->base);
+
+    OCT_COUNT(octree->counters.splits);
+    return inner_node;
+}
+
+/**
+ * @brief Make room for count more slots at the end of object_indices.
+ */
+static bool
+oct_octree_reserve_slots(Octree* octree, size_t count)
+{
+    size_t needed = octree->slot_count + count;
+    if (needed <= octree->slot_capacity) {
+        return true;
+    }
+
+    size_t capacity = octree->slot_capacity ? 2 * octree->slot_capacity : 64;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    uint64_t* indices =
+        realloc(octree->object_indices, capacity * sizeof *indices);
+    if (indices == NULL) {
+        return false;
+    }
+
+    octree->object_indices = indices;
+    octree->slot_capacity = capacity;
+    return true;
+}
+
+static void
+oct_octree_compact_node(Octree* octree, BaseNode* node, uint64_t* slots,
+                        size_t* slot_count)
+{
+    if (node->type == LEAF_NODE) {
+        LeafNode* leaf = (LeafNode*)node;
+        memcpy(slots + *slot_count, octree->object_indices + leaf->object_offset,
+               leaf->object_count * sizeof *slots);
+        leaf->object_offset = *slot_count;
+        leaf->object_capacity = leaf->object_count;
+        *slot_count += leaf->object_count;
+        return;
+    }
+
+    uint8_t child_exists = ((BranchNode*)node)->child_exists;
+    for (uint8_t child = 0; child < 8; child++) {
+        if (child_exists & (1u << child)) {
+            oct_octree_compact_node(
+                octree, oct_node_get_child(octree, node->location_code, child),
+                slots, slot_count);
+        }
+    }
+}
+
+/**
+ * @brief Pack the object ranges of all leaves in Morton order, dropping the
+ * slots that no leaf uses anymore.
+ */
+static bool
+oct_octree_compact(Octree* octree)
+{
+    size_t capacity = octree->slot_count - octree->free_slot_count;
+    uint64_t* slots = malloc((capacity + 1) * sizeof *slots);
+    if (slots == NULL) {
+        return false;
+    }
+
+    size_t slot_count = 0;
+    oct_octree_compact_node(octree, octree->root_node, slots, &slot_count);
+
+    free(octree->object_indices);
+    octree->object_indices = slots;
+    octree->slot_count = slot_count;
+    octree->slot_capacity = capacity + 1;
+    octree->free_slot_count = 0;
+    return true;
+}
+
+bool
+oct_octree_shrink_to_fit(Octree* octree)
+{
+    if (octree->concurrent != NULL) {
+        return false;
+    }
+    // A mapped or succinct tree is packed already.
+    if (oct_octree_read_only(octree)) {
+        return true;
+    }
+
+    if (octree->free_slot_count > 0 && !oct_octree_compact(octree)) {
+        return false;
+    }
+    if (octree->slot_count == 0) {
+        free(octree->object_indices);
+        octree->object_indices = NULL;
+        octree->slot_capacity = 0;
+    } else if (octree->slot_capacity > octree->slot_count) {
+        uint64_t* indices = realloc(octree->object_indices,
+                                    octree->slot_count * sizeof *indices);
+        if (indices == NULL) {
+            return false;
+        }
+        octree->object_indices = indices;
+        octree->slot_capacity = octree->slot_count;
+    }
+
+    // Codes past the last object in the tree only mark unused indices.
+    size_t code_count = octree->object_code_count;
+    while (code_count > 0 && octree->object_codes[code_count - 1] == 0) {
+        code_count--;
+    }
+    if (code_count == 0) {
+        free(octree->object_codes);
+        octree->object_codes = NULL;
+        octree->object_code_count = 0;
+    } else if (code_count < octree->object_code_count) {
+        uint64_t* codes =
+            realloc(octree->object_codes, code_count * sizeof *codes);
+        if (codes == NULL) {
+            return false;
+        }
+        octree->object_codes = codes;
+        octree->object_code_count = code_count;
+    }
+    if (octree->object_index_count > code_count) {
+        octree->object_index_count = code_count;
+    }
+
+    if (!node_map_shrink(octree->nodes) ||
+        (octree->aggregates != NULL && !node_map_shrink(octree->aggregates))) {
+        return false;
+    }
+    node_pool_trim(&octree->leaf_pool);
+    node_pool_trim(&octree->branch_pool);
+    node_pool_trim(&octree->aggregate_pool);
+    return true;
+}
+
+/**
+ * @brief Make room for object_capacity objects in the range of a leaf. A range
+ * at the end of object_indices grows in place, any other range is moved to
+ * the end.
+ */
+static bool
+oct_leaf_node_reserve(Octree* octree, LeafNode* leaf, uint32_t object_capacity)
+{
+    if (object_capacity <= leaf->object_capacity) {
+        return true;
+    }
+
+    if (octree->slot_count >= OCT_COMPACT_MIN_SLOTS &&
+        octree->free_slot_count > octree->slot_count / 2) {
+        oct_octree_compact(octree);
+    }
+
+    if (leaf->object_offset + leaf->object_capacity == octree->slot_count) {
+        size_t grow = object_capacity - leaf->object_capacity;
+        if (!oct_octree_reserve_slots(octree, grow)) {
+            return false;
+        }
+        octree->slot_count += grow;
+        leaf->object_capacity = object_capacity;
+        return true;
+    }
+
+    if (!oct_octree_reserve_slots(octree, object_capacity)) {
+        return false;
+    }
+    memmove(octree->object_indices + octree->slot_count,
+            octree->object_indices + leaf->object_offset,
+            leaf->object_count * sizeof *octree->object_indices);
+    octree->free_slot_count += leaf->object_capacity;
+    leaf->object_offset = octree->slot_count;
+    leaf->object_capacity = object_capacity;
+    octree->slot_count += object_capacity;
+    return true;
+}
+
+static bool
+oct_leaf_node_append(Octree* octree, LeafNode* leaf, uint64_t object_index)
+{
+    if (leaf->object_count == leaf->object_capacity) {
+        // Double the range, but a leaf that will be split once it holds
+        // leaf_capacity objects never needs more than that.
+        uint32_t capacity = leaf->object_count ? 2 * leaf->object_count : 1;
+        if (capacity > octree->leaf_capacity &&
+            leaf->object_count < octree->leaf_capacity) {
+            capacity = (uint32_t)octree->leaf_capacity;
+        }
+        if (!oct_leaf_node_reserve(octree, leaf, capacity)) {
+            return false;
+        }
+    }
+
+    octree->object_indices[leaf->object_offset + leaf->object_count++] =
+        object_index;
+    return true;
+}
+
+/**
+ * @brief Drop a leaf that holds no objects. The root stays, as an empty leaf.
+ */
+static void
+oct_leaf_node_drop_empty(Octree* octree, LeafNode* leaf)
+{
+    uint64_t location_code = leaf->base.location_code;
+    if (leaf->object_count > 0 || location_code == 0b1) {
+        return;
+    }
+
+    octree->free_slot_count += leaf->object_capacity;
+    oct_leaf_node_free(octree, location_code);
+    BranchNode* parent =
+        (BranchNode*)oct_node_lookup(octree, location_code >> 3);
+    parent->child_exists &= ~(1u << (location_code & 0b111));
+}
+
+/**
+ * @brief Count the objects below a node, stopping as soon as there are more
+ * than limit.
+ */
+static size_t
+oct_node_count_objects(Octree* octree, BaseNode* node, size_t limit)
+{
+    if (node->type == LEAF_NODE) {
+        return ((LeafNode*)node)->object_count;
+    }
+
+    size_t count = 0;
+    uint8_t child_exists = ((BranchNode*)node)->child_exists;
+    for (uint8_t child = 0; child < 8 && count <= limit; child++) {
+        if (child_exists & (1u << child)) {
+            count += oct_node_count_objects(
+                octree, oct_node_get_child(octree, node->location_code, child),
+                limit - count);
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Copy the objects below a node to slots and free every node below it.
+ */
+static void
+oct_node_gather_objects(Octree* octree, BaseNode* node, uint64_t* slots,
+                        size_t* count)
+{
+    uint8_t child_exists = ((BranchNode*)node)->child_exists;
+    for (uint8_t child = 0; child < 8; child++) {
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        BaseNode* child_node =
+            oct_node_get_child(octree, node->location_code, child);
+        if (child_node->type == LEAF_NODE) {
+            LeafNode* leaf = (LeafNode*)child_node;
+            memcpy(slots + *count, octree->object_indices + leaf->object_offset,
+                   leaf->object_count * sizeof *slots);
+            *count += leaf->object_count;
+            octree->free_slot_count += leaf->object_capacity;
+            oct_leaf_node_free(octree, child_node->location_code);
+        } else {
+            oct_node_gather_objects(octree, child_node, slots, count);
+            oct_branch_node_free(octree, child_node->location_code);
+        }
+    }
+}
+
+/**
+ * @brief Replace a branch and everything below it by a single leaf holding
+ * its object_count objects.
+ */
+static LeafNode*
+oct_branch_node_merge(Octree* octree, BranchNode* node, size_t object_count)
+{
+    // Everything that can fail comes first, so a failed merge leaves the
+    // branch and its subtree as they were.
+    LeafNode* leaf = node_pool_alloc(&octree->leaf_pool);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    if (!oct_octree_reserve_slots(octree, object_count)) {
+        node_pool_release(&octree->leaf_pool, leaf);
+        return NULL;
+    }
+
+    uint64_t object_offset = octree->slot_count;
+    size_t count = 0;
+    oct_node_gather_objects(octree, &node->base,
+                            octree->object_indices + object_offset, &count);
+    octree->slot_count += count;
+
+    leaf->base.location_code = node->base.location_code;
+    leaf->base.type = LEAF_NODE;
+    leaf->object_offset = object_offset;
+    leaf->object_count = (uint32_t)count;
+    leaf->object_capacity = (uint32_t)count;
+    oct_node_replace(octree, &node->base, &leaf->base);
+
+    OCT_COUNT(octree->counters.merges);
+    return leaf;
+}
+
+/**
+ * @brief Tidy up the path above a leaf objects were taken from. The leaf is
+ * dropped if it became empty, and its ancestors deeper than stop_depth are
+ * merged into a leaf while they hold at most half of leaf_capacity objects.
+ */
+static void
+oct_octree_collapse(Octree* octree, LeafNode* leaf, int stop_depth)
+{
+    size_t threshold = octree->leaf_capacity / 2;
+    if (threshold == 0) {
+        threshold = 1;
+    }
+
+    uint64_t location_code = leaf->base.location_code;
+    oct_leaf_node_drop_empty(octree, leaf);
+
+    for (location_code >>= 3;
+         location_code != 0 &&
+         oct_location_code_depth(location_code) > stop_depth;
+         location_code >>= 3) {
+        BaseNode* node = oct_node_lookup(octree, location_code);
+        size_t count = oct_node_count_objects(octree, node, threshold);
+        if (count > threshold) {
+            return;
+        }
+
+        LeafNode* merged =
+            oct_branch_node_merge(octree, (BranchNode*)node, count);
+        if (merged == NULL) {
+            return;
+        }
+        oct_leaf_node_drop_empty(octree, merged);
+    }
+}
+
+/**
+ * @brief Put an object in the leaf for its location code, searching down from
+ * the node at low_depth on its path and splitting full leaves on the way.
+ */
+static bool
+oct_octree_insert_code(Octree* octree, uint64_t object_index, uint64_t code,
+                       int low_depth)
+{
+    for (;;) {
+        BaseNode* node = oct_location_code_locate(octree, code, low_depth);
+        int depth = oct_location_code_depth(node->location_code);
+        if (node->type == INNER_NODE) {
+            uint8_t child = (code >> (3 * (OCT_MAX_DEPTH - depth - 1))) & 0b111;
+            LeafNode* leaf =
+                oct_leaf_node_init(octree, node->location_code, child);
+            return leaf != NULL &&
+                   oct_leaf_node_append(octree, leaf, object_index);
+        }
+
+        LeafNode* leaf = (LeafNode*)node;
+        if (leaf->object_count < octree->leaf_capacity ||
+            depth >= octree->max_depth) {
+            return oct_leaf_node_append(octree, leaf, object_index);
+        }
+
+        if (oct_leaf_node_split(octree, leaf) == NULL) {
+            return false;
+        }
+        low_depth = depth;
+    }
+}
+
+/**
+ * @brief Take an object out of the range of the leaf holding it.
+ */
+static bool
+oct_leaf_node_remove_object(Octree* octree, LeafNode* leaf,
+                            uint64_t object_index)
+{
+    uint64_t* objects = octree->object_indices + leaf->object_offset;
+    for (uint32_t i = 0; i < leaf->object_count; i++) {
+        if (objects[i] == object_index) {
+            objects[i] = objects[--leaf->object_count];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+oct_object_insert(Octree* octree, Position* object_positions,
+                  uint64_t object_index)
+{
+    if (oct_octree_read_only(octree)) {
+        return false;
+    }
+
+    if (object_index >= octree->object_code_count) {
+        size_t count = octree->object_code_count ? octree->object_code_count : 64;
+        while (count <= object_index) {
+            count *= 2;
+        }
+        uint64_t* codes = realloc(octree->object_codes, count * sizeof *codes);
+        if (codes == NULL) {
+            return false;
+        }
+
+        // A code of 0 marks an index that is not in the tree.
+        memset(codes + octree->object_code_count, 0,
+               (count - octree->object_code_count) * sizeof *codes);
+        octree->object_codes = codes;
+        octree->object_code_count = count;
+    }
+    if (octree->object_codes[object_index] != 0) {
+        return false;
+    }
+
+    octree->object_positions = object_positions;
+    uint64_t code = oct_position_get_location_code(
+        octree, object_positions[object_index]);
+    if (!oct_octree_insert_code(octree, object_index, code, 0)) {
+        return false;
+    }
+    if (object_index >= octree->object_index_count) {
+        octree->object_index_count = object_index + 1;
+    }
+
+    octree->object_codes[object_index] = code;
+    octree->object_count++;
+    oct_aggregate_update_path(octree, code);
+    return true;
+}
+
+bool
+oct_object_remove(Octree* octree, uint64_t object_index)
+{
+    if (oct_octree_read_only(octree) ||
+        object_index >= octree->object_code_count ||
+        octree->object_codes[object_index] == 0) {
+        return false;
+    }
+
+    uint64_t code = octree->object_codes[object_index];
+    LeafNode* leaf = (LeafNode*)oct_location_code_locate(octree, code, 0);
+    if (!oct_leaf_node_remove_object(octree, leaf, object_index)) {
+        return false;
+    }
+
+    octree->object_codes[object_index] = 0;
+    octree->object_count--;
+    oct_octree_collapse(octree, leaf, -1);
+    oct_aggregate_update_path(octree, code);
+    return true;
+}
+
+/**
+ * @brief Whether the node on the path of old_code one level below the deepest
+ * node holding both codes exists. The nodes on the path of an object exist
+ * down to its leaf, so this tells if the object leaves its leaf when its code
+ * changes from old_code to new_code.
+ */
+static bool
+oct_object_changes_leaf(Octree* octree, uint64_t old_code, uint64_t new_code)
+{
+    if (old_code == new_code) {
+        return false;
+    }
+
+    int depth = oct_location_code_common_depth(old_code, new_code) + 1;
+    return oct_node_lookup(octree, old_code >> (3 * (OCT_MAX_DEPTH - depth))) !=
+           NULL;
+}
+
+/**
+ * @brief Give an object a new location code, moving it to another leaf when
+ * needed.
+ */
+static bool
+oct_object_relocate(Octree* octree, uint64_t object_index, uint64_t new_code)
+{
+    // Nothing changes in the tree while the object stays in its leaf.
+    uint64_t old_code = octree->object_codes[object_index];
+    if (!oct_object_changes_leaf(octree, old_code, new_code)) {
+        octree->object_codes[object_index] = new_code;
+        return true;
+    }
+
+    // The nodes from the common ancestor up hold the object before and after
+    // the move, so the work stays below it.
+    int common_depth = oct_location_code_common_depth(old_code, new_code);
+    LeafNode* leaf = (LeafNode*)oct_location_code_locate(octree, old_code,
+                                                         common_depth + 1);
+    if (!oct_leaf_node_remove_object(octree, leaf, object_index)) {
+        return false;
+    }
+    oct_octree_collapse(octree, leaf, common_depth);
+
+    if (!oct_octree_insert_code(octree, object_index, new_code,
+                                common_depth)) {
+        octree->object_codes[object_index] = 0;
+        octree->object_count--;
+        return false;
+    }
+
+    octree->object_codes[object_index] = new_code;
+    return true;
+}
+
+bool
+oct_object_move(Octree* octree, uint64_t object_index, Position position)
+{
+    if (oct_octree_read_only(octree) ||
+        object_index >= octree->object_code_count ||
+        octree->object_codes[object_index] == 0) {
+        return false;
+    }
+
+    uint64_t old_code = octree->object_codes[object_index];
+    uint64_t new_code = oct_position_get_location_code(octree, position);
+    bool changes_leaf = octree->aggregates != NULL &&
+                        oct_object_changes_leaf(octree, old_code, new_code);
+    octree->object_positions[object_index] = position;
+    bool moved = oct_object_relocate(octree, object_index, new_code);
+
+    // The old path lost the object and the new one gained it. They are the
+    // same path when the object stayed in its leaf.
+    oct_aggregate_update_path(octree, old_code);
+    if (changes_leaf) {
+        oct_aggregate_update_path(octree, new_code);
+    }
+    return moved;
+}
+
+OctUpdateStrategy
+oct_octree_update(Octree* octree, Position* new_positions)
+{
+    if (oct_octree_read_only(octree)) {
+        return OCT_UPDATE_FAILED;
+    }
+
+    // new_codes holds the new code of the objects that leave their leaf and
+    // 0 for all others. Only indices that were put in the tree are read from
+    // new_positions.
+    size_t index_count = octree->object_index_count;
+    uint64_t* new_codes = malloc((index_count + 1) * sizeof *new_codes);
+    if (new_codes == NULL) {
+        return OCT_UPDATE_FAILED;
+    }
+
+    // An object that stays in its leaf can take its new code right away, the
+    // leaf holds it either way.
+    size_t changed_count = 0;
+    size_t i;
+    #pragma omp parallel if (index_count >= OCT_PARALLEL_MIN_OBJECTS)
+    {
+        int thread = oct_thread_num();
+        int threads = oct_thread_count();
+        size_t begin = index_count * thread / threads;
+        size_t end = index_count * (thread + 1) / threads;
+        oct_location_codes_encode(octree, new_positions + begin, end - begin,
+                                  new_codes + begin, 1);
+
+        #pragma omp barrier
+        #pragma omp for reduction(+ : changed_count)
+        for (i = 0; i < index_count; i++) {
+            uint64_t old_code = octree->object_codes[i];
+            uint64_t new_code = new_codes[i];
+            new_codes[i] = 0;
+            if (old_code == 0) {
+                continue;
+            }
+
+            if (oct_object_changes_leaf(octree, old_code, new_code)) {
+                new_codes[i] = new_code;
+                changed_count++;
+            } else {
+                octree->object_codes[i] = new_code;
+            }
+        }
+    }
+    octree->object_positions = new_positions;
+
+    if (changed_count > octree->object_count / OCT_UPDATE_REBUILD_DIVISOR) {
+        size_t count = octree->object_count;
+        OctSortItem* items = malloc(2 * count * sizeof *items);
+        uint64_t* indices = count > octree->slot_capacity
+            ? realloc(octree->object_indices, count * sizeof *indices)
+            : octree->object_indices;
+        if (indices != NULL) {
+            octree->object_indices = indices;
+            if (count > octree->slot_capacity) {
+                octree->slot_capacity = count;
+            }
+        }
+
+        // Without memory for a rebuild the objects are moved one by one.
+        if (items != NULL && indices != NULL) {
+            size_t item_count = 0;
+            for (i = 0; i < index_count; i++) {
+                if (octree->object_codes[i] == 0) {
+                    continue;
+                }
+                items[item_count].location_code =
+                    new_codes[i] ? new_codes[i] : octree->object_codes[i];
+                items[item_count].object_index = i;
+                item_count++;
+            }
+
+            oct_octree_clear(octree);
+            octree->slot_count = count;
+            octree->free_slot_count = 0;
+            bool built = oct_octree_build_sorted(octree, items, count);
+            if (built) {
+                oct_aggregate_compute_all(octree);
+            }
+
+            free(items);
+            free(new_codes);
+            return built ? OCT_UPDATE_REBUILD : OCT_UPDATE_FAILED;
+        }
+        free(items);
+    }
+
+    OctUpdateStrategy strategy = OCT_UPDATE_REINSERT;
+    for (i = 0; i < index_count; i++) {
+        if (new_codes[i] != 0 &&
+            !oct_object_relocate(octree, i, new_codes[i])) {
+            strategy = OCT_UPDATE_FAILED;
+        }
+    }
+
+    // Every position changed, so every value is computed again.
+    oct_aggregate_compute_all(octree);
+
+    free(new_codes);
+    return strategy;
+}
+
+static inline size_t
+oct_concurrent_hash(uint64_t location_code)
+{
+    location_code ^= location_code >> 33;
+    location_code *= 0xff51afd7ed558ccdull;
+    location_code ^= location_code >> 33;
+    return (size_t)location_code;
+}
+
+/**
+ * @brief Find a node in the concurrent index. A key whose node is still being
+ * stored is waited for.
+ */
+static BaseNode*
+oct_concurrent_get(OctConcurrent* concurrent, uint64_t location_code)
+{
+    size_t i = oct_concurrent_hash(location_code) & concurrent->index_mask;
+    for (;; i = (i + 1) & concurrent->index_mask) {
+        OctConcurrentEntry* entry = &concurrent->index[i];
+        uint64_t key = atomic_load(&entry->key);
+        if (key == 0) {
+            return NULL;
+        }
+        if (key == location_code) {
+            BaseNode* node;
+            while ((node = atomic_load(&entry->value)) == NULL) {
+                oct_cpu_relax();
+            }
+            return node;
+        }
+    }
+}
+
+/**
+ * @brief Stands in for a child whose leaf could not be taken from the
+ * budget, so threads waiting on its code give up instead of waiting forever.
+ */
+static BaseNode oct_concurrent_failed;
+
+/**
+ * @brief Claim a code for a node that is yet to be made. Returns the entry to
+ * publish the node in, or NULL if another thread claimed the code first. The
+ * node of that thread is then stored in node, once it is published.
+ */
+static OctConcurrentEntry*
+oct_concurrent_claim(OctConcurrent* concurrent, uint64_t location_code,
+                     BaseNode** node)
+{
+    size_t i = oct_concurrent_hash(location_code) & concurrent->index_mask;
+    for (;; i = (i + 1) & concurrent->index_mask) {
+        OctConcurrentEntry* entry = &concurrent->index[i];
+        uint_fast64_t key = 0;
+        if (atomic_compare_exchange_strong(&entry->key, &key,
+                                           location_code)) {
+            return entry;
+        }
+        if (key == location_code) {
+            while ((*node = atomic_load(&entry->value)) == NULL) {
+                oct_cpu_relax();
+            }
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Add a node under a code no node has yet. The index has room for
+ * every node the budgets allow, so this can not fail.
+ */
+static void
+oct_concurrent_put(OctConcurrent* concurrent, BaseNode* node)
+{
+    uint64_t location_code = node->location_code;
+    size_t i = oct_concurrent_hash(location_code) & concurrent->index_mask;
+    for (;; i = (i + 1) & concurrent->index_mask) {
+        OctConcurrentEntry* entry = &concurrent->index[i];
+        uint_fast64_t key = 0;
+        if (atomic_compare_exchange_strong(&entry->key, &key,
+                                           location_code)) {
+            atomic_store(&entry->value, node);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Swap the node under a code for its replacement.
+ */
+static void
+oct_concurrent_replace(OctConcurrent* concurrent, BaseNode* node)
+{
+    uint64_t location_code = node->location_code;
+    size_t i = oct_concurrent_hash(location_code) & concurrent->index_mask;
+    while (atomic_load(&concurrent->index[i].key) != location_code) {
+        i = (i + 1) & concurrent->index_mask;
+    }
+    atomic_store(&concurrent->index[i].value, node);
+}
+
+/**
+ * @brief Take a leaf with a range of object_capacity slots from the budget.
+ */
+static OctConcurrentLeaf*
+oct_concurrent_leaf_alloc(OctConcurrent* concurrent, uint64_t location_code,
+                          uint32_t object_capacity)
+{
+    size_t slot = atomic_fetch_add(&concurrent->slot_used, object_capacity);
+    if (slot + object_capacity > concurrent->slot_budget) {
+        return NULL;
+    }
+    size_t i = atomic_fetch_add(&concurrent->leaf_used, 1);
+    if (i >= concurrent->leaf_budget) {
+        return NULL;
+    }
+
+    OctConcurrentLeaf* leaf = &concurrent->leaves[i];
+    leaf->leaf.base.location_code = location_code;
+    leaf->leaf.base.type = LEAF_NODE;
+    leaf->leaf.object_offset = slot;
+    leaf->leaf.object_count = 0;
+    leaf->leaf.object_capacity = object_capacity;
+    atomic_init(&leaf->reserved, 0);
+    atomic_init(&leaf->written, 0);
+    return leaf;
+}
+
+/**
+ * @brief Give a leaf its first object_count objects before it is published.
+ */
+static void
+oct_concurrent_leaf_fill(OctConcurrent* concurrent, OctConcurrentLeaf* leaf,
+                         const uint64_t* objects, uint32_t object_count)
+{
+    if (object_count > 0) {
+        memcpy(concurrent->slots + leaf->leaf.object_offset, objects,
+               object_count * sizeof *objects);
+    }
+    atomic_store(&leaf->reserved, object_count);
+    atomic_store(&leaf->written, object_count);
+}
+
+static OctConcurrentBranch*
+oct_concurrent_branch_alloc(OctConcurrent* concurrent, uint64_t location_code)
+{
+    size_t i = atomic_fetch_add(&concurrent->branch_used, 1);
+    if (i >= concurrent->branch_budget) {
+        return NULL;
+    }
+
+    OctConcurrentBranch* branch = &concurrent->branches[i];
+    branch->base.location_code = location_code;
+    branch->base.type = INNER_NODE;
+    atomic_init(&branch->child_exists, 0);
+    return branch;
+}
+
+/**
+ * @brief Replace a full leaf the calling thread locked. Below max_depth its
+ * objects are split over new leaves under a new branch, at max_depth they
+ * move to a leaf with twice the room. The new nodes are complete before the
+ * index points to them. Threads still holding the old leaf see it locked and
+ * look the code up again.
+ */
+static bool
+oct_concurrent_split(Octree* octree, OctConcurrent* concurrent,
+                     OctConcurrentLeaf* leaf)
+{
+    uint32_t count = leaf->leaf.object_capacity;
+    while (atomic_load(&leaf->written) != count) {
+        oct_cpu_relax();
+    }
+
+    uint64_t location_code = leaf->leaf.base.location_code;
+    const uint64_t* objects = concurrent->slots + leaf->leaf.object_offset;
+    int depth = oct_location_code_depth(location_code);
+    if (depth >= octree->max_depth) {
+        OctConcurrentLeaf* grown =
+            oct_concurrent_leaf_alloc(concurrent, location_code, 2 * count);
+        if (grown == NULL) {
+            return false;
+        }
+        oct_concurrent_leaf_fill(concurrent, grown, objects, count);
+        oct_concurrent_replace(concurrent, &grown->leaf.base);
+        return true;
+    }
+
+    // Sort the objects by child with a counting pass, in a scratch range
+    // at the end of the slots.
+    int shift = 3 * (OCT_MAX_DEPTH - depth - 1);
+    uint32_t child_counts[8] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t code = atomic_load(&concurrent->codes[objects[i]]);
+        child_counts[(code >> shift) & 0b111]++;
+    }
+
+    OctConcurrentBranch* branch =
+        oct_concurrent_branch_alloc(concurrent, location_code);
+    OctConcurrentLeaf* children[8] = {NULL};
+    for (uint8_t child = 0; child < 8 && branch != NULL; child++) {
+        if (child_counts[child] == 0) {
+            continue;
+        }
+        children[child] = oct_concurrent_leaf_alloc(
+            concurrent, (location_code << 3) | child,
+            (uint32_t)octree->leaf_capacity);
+        if (children[child] == NULL) {
+            return false;
+        }
+    }
+    if (branch == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t code = atomic_load(&concurrent->codes[objects[i]]);
+        OctConcurrentLeaf* child = children[(code >> shift) & 0b111];
+        concurrent->slots[child->leaf.object_offset +
+                          atomic_load(&child->written)] = objects[i];
+        atomic_fetch_add(&child->written, 1);
+    }
+
+    uint8_t child_exists = 0;
+    for (uint8_t child = 0; child < 8; child++) {
+        if (children[child] != NULL) {
+            atomic_store(&children[child]->reserved, child_counts[child]);
+            oct_concurrent_put(concurrent, &children[child]->leaf.base);
+            child_exists |= 1u << child;
+        }
+    }
+    atomic_store(&branch->child_exists, child_exists);
+    oct_concurrent_replace(concurrent, &branch->base);
+#ifndef OCT_NO_STATS
+    atomic_fetch_add_explicit(&concurrent->splits, 1, memory_order_relaxed);
+#endif
+    return true;
+}
+
+/**
+ * @brief Wait until a locked leaf was replaced or unlocked again and return
+ * the node now under its code.
+ */
+static BaseNode*
+oct_concurrent_wait(OctConcurrent* concurrent, OctConcurrentLeaf* leaf)
+{
+    for (;;) {
+        BaseNode* node =
+            oct_concurrent_get(concurrent, leaf->leaf.base.location_code);
+        if (node != &leaf->leaf.base ||
+            !(atomic_load(&leaf->reserved) & OCT_CONCURRENT_LOCKED)) {
+            return node;
+        }
+        oct_cpu_relax();
+    }
+}
+
+/**
+ * @brief Put an object in the leaf for its code. A missing child is claimed
+ * by its code in the index, and a full leaf by locking it, so only one
+ * thread creates or replaces any node.
+ */
+static bool
+oct_concurrent_insert_code(Octree* octree, OctConcurrent* concurrent,
+                           uint64_t object_index, uint64_t code)
+{
+    BaseNode* node = oct_concurrent_get(concurrent, 0b1);
+    for (;;) {
+        if (node->type == INNER_NODE) {
+            OctConcurrentBranch* branch = (OctConcurrentBranch*)node;
+            int depth = oct_location_code_depth(node->location_code);
+            uint8_t child = (code >> (3 * (OCT_MAX_DEPTH - depth - 1))) & 0b111;
+            uint64_t child_code = (node->location_code << 3) | child;
+            if (atomic_load(&branch->child_exists) & (1u << child)) {
+                node = oct_concurrent_get(concurrent, child_code);
+                continue;
+            }
+
+            // The code is claimed in the index before the leaf is taken, so
+            // a thread that loses the race wastes nothing, and the bit is set
+            // only once the leaf is published, so a set bit always finds its
+            // node. Checking the budget first keeps a full budget from
+            // filling the index with failed codes.
+            if (atomic_load(&concurrent->leaf_used) >=
+                    concurrent->leaf_budget ||
+                atomic_load(&concurrent->slot_used) + octree->leaf_capacity >
+                    concurrent->slot_budget) {
+                return false;
+            }
+            BaseNode* claimed;
+            OctConcurrentEntry* entry =
+                oct_concurrent_claim(concurrent, child_code, &claimed);
+            if (entry == NULL) {
+                if (claimed == &oct_concurrent_failed) {
+                    return false;
+                }
+                node = claimed;
+                continue;
+            }
+
+            OctConcurrentLeaf* leaf = oct_concurrent_leaf_alloc(
+                concurrent, child_code, (uint32_t)octree->leaf_capacity);
+            if (leaf == NULL) {
+                atomic_store(&entry->value, &oct_concurrent_failed);
+                return false;
+            }
+            atomic_store(&entry->value, &leaf->leaf.base);
+            atomic_fetch_or(&branch->child_exists, 1u << child);
+            node = &leaf->leaf.base;
+            continue;
+        }
+
+        OctConcurrentLeaf* leaf = (OctConcurrentLeaf*)node;
+        uint32_t capacity = leaf->leaf.object_capacity;
+        unsigned reserved = atomic_load(&leaf->reserved);
+        while (!(reserved & OCT_CONCURRENT_LOCKED) && reserved < capacity) {
+            if (atomic_compare_exchange_weak(&leaf->reserved, &reserved,
+                                             reserved + 1)) {
+                concurrent->slots[leaf->leaf.object_offset + reserved] =
+                    object_index;
+                atomic_fetch_add(&leaf->written, 1);
+                return true;
+            }
+        }
+
+        if (!(reserved & OCT_CONCURRENT_LOCKED) &&
+            atomic_compare_exchange_strong(&leaf->reserved, &reserved,
+                                           reserved | OCT_CONCURRENT_LOCKED) &&
+            !oct_concurrent_split(octree, concurrent, leaf)) {
+            atomic_store(&leaf->reserved, capacity);
+            return false;
+        }
+        node = oct_concurrent_wait(concurrent, leaf);
+    }
+}
+
+bool
+oct_octree_begin_concurrent(Octree* octree, Position* object_positions,
+                            size_t object_capacity)
+{
+    if (oct_octree_read_only(octree) || octree->concurrent != NULL) {
+        return false;
+    }
+
+    OctConcurrent* concurrent = calloc(1, sizeof *concurrent);
+    if (concurrent == NULL) {
+        return false;
+    }
+
+    // Every split and every claimed child takes nodes and slots from fixed
+    // budgets, so no thread ever has to grow a shared array.
+    size_t node_count = octree->leaf_count + octree->inner_count;
+    size_t code_count = object_capacity > octree->object_code_count
+        ? object_capacity
+        : octree->object_code_count;
+    size_t growth = object_capacity / octree->leaf_capacity + 1 +
+                    OCT_CONCURRENT_MIN_NODES;
+    concurrent->leaf_budget = node_count + OCT_CONCURRENT_LEAF_GROWTH * growth;
+    concurrent->branch_budget =
+        node_count + OCT_CONCURRENT_BRANCH_GROWTH * growth;
+    concurrent->slot_budget =
+        octree->slot_count + octree->leaf_count * octree->leaf_capacity +
+        OCT_CONCURRENT_LEAF_GROWTH * growth * octree->leaf_capacity;
+    size_t index_capacity = 1;
+    while (index_capacity < 2 * (concurrent->leaf_budget +
+                                 concurrent->branch_budget)) {
+        index_capacity *= 2;
+    }
+    concurrent->index_mask = index_capacity - 1;
+    concurrent->index = calloc(index_capacity, sizeof *concurrent->index);
+    concurrent->leaves =
+        malloc(concurrent->leaf_budget * sizeof *concurrent->leaves);
+    concurrent->branches =
+        malloc(concurrent->branch_budget * sizeof *concurrent->branches);
+    concurrent->slots =
+        malloc(concurrent->slot_budget * sizeof *concurrent->slots);
+    concurrent->codes = malloc(code_count * sizeof *concurrent->codes);
+    concurrent->code_count = code_count;
+    uint64_t* object_codes =
+        realloc(octree->object_codes, code_count * sizeof *object_codes);
+    if (object_codes != NULL) {
+        octree->object_codes = object_codes;
+    }
+    if (concurrent->index == NULL || concurrent->leaves == NULL ||
+        concurrent->branches == NULL || concurrent->slots == NULL ||
+        concurrent->codes == NULL || object_codes == NULL) {
+        oct_concurrent_free(concurrent);
+        return false;
+    }
+
+    memset(octree->object_codes + octree->object_code_count, 0,
+           (code_count - octree->object_code_count) * sizeof *object_codes);
+    octree->object_code_count = code_count;
+    for (size_t i = 0; i < code_count; i++) {
+        atomic_init(&concurrent->codes[i], octree->object_codes[i]);
+    }
+    atomic_init(&concurrent->object_count, octree->object_count);
+    atomic_init(&concurrent->splits, 0);
+
+    // The nodes so far move into the index. Leaves get at least
+    // leaf_capacity slots so they fill up like new ones.
+    size_t position = 0;
+    uint64_t location_code;
+    void* value;
+    while (node_map_next(octree->nodes, &position, &location_code, &value)) {
+        BaseNode* node = value;
+        if (node->type == INNER_NODE) {
+            OctConcurrentBranch* branch =
+                oct_concurrent_branch_alloc(concurrent, location_code);
+            atomic_store(&branch->child_exists,
+                         ((BranchNode*)node)->child_exists);
+            oct_concurrent_put(concurrent, &branch->base);
+            continue;
+        }
+
+        LeafNode* leaf = (LeafNode*)node;
+        uint32_t capacity = leaf->object_count > octree->leaf_capacity
+            ? leaf->object_count
+            : (uint32_t)octree->leaf_capacity;
+        OctConcurrentLeaf* copy =
+            oct_concurrent_leaf_alloc(concurrent, location_code, capacity);
+        oct_concurrent_leaf_fill(concurrent, copy,
+                                 octree->object_indices + leaf->object_offset,
+                                 leaf->object_count);
+        oct_concurrent_put(concurrent, &copy->leaf.base);
+    }
+
+    oct_octree_clear(octree);
+    octree->object_positions = object_positions;
+    octree->concurrent = concurrent;
+    return true;
+}
+
+bool
+oct_object_insert_concurrent(Octree* octree, uint64_t object_index)
+{
+    OctConcurrent* concurrent = octree->concurrent;
+    if (concurrent == NULL || object_index >= concurrent->code_count) {
+        return false;
+    }
+
+    // Claiming the code turns away a second insert of the same object.
+    uint64_t code = oct_position_get_location_code(
+        octree, octree->object_positions[object_index]);
+    uint_fast64_t empty = 0;
+    if (!atomic_compare_exchange_strong(&concurrent->codes[object_index],
+                                        &empty, code)) {
+        return false;
+    }
+
+    if (!oct_concurrent_insert_code(octree, concurrent, object_index, code)) {
+        atomic_store(&concurrent->codes[object_index], 0);
+        return false;
+    }
+    atomic_fetch_add(&concurrent->object_count, 1);
+    return true;
+}
+
+bool
+oct_octree_end_concurrent(Octree* octree)
+{
+    OctConcurrent* concurrent = octree->concurrent;
+    if (concurrent == NULL) {
+        return false;
+    }
+
+    // The nodes the index points to make up the tree. Replaced leaves and
+    // codes whose leaf could not be made are left behind.
+    size_t node_count = 0;
+    for (size_t i = 0; i <= concurrent->index_mask; i++) {
+        node_count += atomic_load(&concurrent->index[i].key) != 0;
+    }
+    if (!node_map_reserve(octree->nodes, node_count)) {
+        return false;
+    }
+
+    size_t used_slots = 0;
+    for (size_t i = 0; i <= concurrent->index_mask; i++) {
+        BaseNode* node = atomic_load(&concurrent->index[i].value);
+        if (node == NULL || node == &oct_concurrent_failed) {
+            continue;
+        }
+
+        if (node->type == INNER_NODE) {
+            OctConcurrentBranch* branch = (OctConcurrentBranch*)node;
+            BranchNode* copy =
+                oct_branch_node_init(octree, branch->base.location_code);
+            if (copy == NULL) {
+                oct_octree_clear(octree);
+                return false;
+            }
+            copy->child_exists = atomic_load(&branch->child_exists);
+            continue;
+        }
+
+        OctConcurrentLeaf* leaf = (OctConcurrentLeaf*)node;
+        LeafNode* copy = oct_leaf_node_alloc(
+            octree, leaf->leaf.base.location_code, leaf->leaf.object_offset,
+            atomic_load(&leaf->written));
+        if (copy == NULL) {
+            oct_octree_clear(octree);
+            return false;
+        }
+        copy->object_capacity = leaf->leaf.object_capacity;
+        used_slots += copy->object_capacity;
+    }
+
+    size_t slot_count = atomic_load(&concurrent->slot_used);
+    if (slot_count > concurrent->slot_budget) {
+        slot_count = concurrent->slot_budget;
+    }
+    free(octree->object_indices);
+    octree->object_indices = concurrent->slots;
+    concurrent->slots = NULL;
+    octree->slot_count = slot_count;
+    octree->slot_capacity = concurrent->slot_budget;
+    octree->free_slot_count = slot_count - used_slots;
+    for (size_t i = 0; i < concurrent->code_count; i++) {
+        octree->object_codes[i] = atomic_load(&concurrent->codes[i]);
+        if (octree->object_codes[i] != 0 && i >= octree->object_index_count) {
+            octree->object_index_count = i + 1;
+        }
+    }
+    octree->object_count = atomic_load(&concurrent->object_count);
+    octree->counters.splits += atomic_load(&concurrent->splits);
+    octree->concurrent = NULL;
+    oct_concurrent_free(concurrent);
+
+    if (octree->free_slot_count > octree->slot_count / 2) {
+        oct_octree_compact(octree);
+    }
+    oct_aggregate_compute_all(octree);
+    return true;
+}
+
+bool
+oct_octree_set_aggregate(Octree* octree, const OctAggregate* aggregate)
+{
+    oct_aggregate_drop(octree);
+    if (aggregate == NULL) {
+        return true;
+    }
+
+    // The pool's slabs start max_align_t aligned, so values of a size rounded
+    // up to that alignment are all aligned for any type.
+    size_t align = _Alignof(max_align_t);
+    size_t value_size = (aggregate->value_size + align - 1) / align * align;
+    octree->aggregate = *aggregate;
+    node_pool_init(&octree->aggregate_pool, value_size);
+    octree->aggregates = node_map_alloc(OCT_DEFAULT_NODE_CAPACITY);
+    if (octree->aggregates == NULL) {
+        return false;
+    }
+
+    return oct_aggregate_compute_all(octree);
+}
+
+const void*
+oct_node_get_aggregate(Octree* octree, uint64_t location_code)
+{
+    if (octree->aggregates == NULL || location_code == 0) {
+        return NULL;
+    }
+
+    return node_map_get(octree->aggregates, location_code);
+}
+
+Position
+oct_node_get_position(Octree* octree, BaseNode* node)
+{
+    int depth = oct_location_code_depth(node->location_code);
+    uint64_t path = node->location_code ^ (1ull << (3 * depth));
+    double cell = 2.0 * octree->size / (double)(1ull << depth);
+
+    Position position;
+    position.x = (float)(octree->position.x - (double)octree->size +
+                         (oct_morton_compact(path) + 0.5) * cell);
+    position.y = (float)(octree->position.y - (double)octree->size +
+                         (oct_morton_compact(path >> 1) + 0.5) * cell);
+    position.z = (float)(octree->position.z - (double)octree->size +
+                         (oct_morton_compact(path >> 2) + 0.5) * cell);
+    return position;
+}
+
+size_t
+oct_node_get_tree_depth(Octree* octree, const BaseNode* node)
+{
+#if defined(__GNUC__)
+    return (63 - __builtin_clzll(node->location_code)) / 3;
+#elif defined(_MSC_VER)
+    long msb;
+    _BitScanReverse(&msb, node->location_code);
+    return msb / 3;
+#else
+    size_t depth;
+    for (uint32_t lc = node->location_code, depth = 0; lc != 1;
+         lc >>= 3, depth++)
+        ;
+    return depth;
+#endif
+}
+
+BaseNode*
+oct_node_get_parent(Octree* octree, BaseNode* node)
+{
+    uint64_t location_code_parent = node->location_code >> 3;
+    return oct_node_lookup(octree, location_code_parent);
+}
+
+BaseNode*
+oct_node_get_child(Octree* octree, uint64_t location_code,
+                   uint8_t child_location)
+{
+    uint64_t child_location_code = (location_code << 3) | child_location;
+    return oct_node_lookup(octree, child_location_code);
+}
+
+BaseNode*
+oct_node_lookup(Octree* octree, uint64_t location_code)
+{
+    if (octree->succinct != NULL) {
+        return NULL;
+    }
+    if (octree->mapping == NULL) {
+        return node_map_get(octree->nodes, location_code);
+    }
+
+    // The codes of a mapped tree are sorted within each level.
+    int depth = oct_location_code_depth(location_code);
+    size_t low = octree->mapped_levels[depth];
+    size_t high = octree->mapped_levels[depth + 1];
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (octree->mapped_codes[middle] < location_code) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < octree->mapped_levels[depth + 1] &&
+        octree->mapped_codes[low] == location_code) {
+        return (BaseNode*)&octree->mapped_nodes[low];
+    }
+    return NULL;
+}
+
+size_t 
+oct_octree_get_size(Octree* octree)
+{
+    return octree->size;
+}
+
+size_t 
+oct_octree_get_leaf_count(Octree* octree)
+{
+    return octree->leaf_count;
+}
+
+size_t 
+oct_octree_get_inner_count(Octree* octree)
+{
+    return octree->inner_count;
+}
+
+#define OCT_FILE_VERSION 1
+#define OCT_FILE_BYTE_ORDER 0x01020304u
+#define OCT_FILE_ALIGNMENT 64
+
+static const char oct_file_magic[8] = {'O', 'C', 'T', 'R', 'E', 'E', 0, 0};
+
+/**
+ * @brief The start of a saved octree. The sections it points to start at
+ * byte offsets from the start of the file, aligned to OCT_FILE_ALIGNMENT.
+ * Node i of the file has code i of the codes section and record i of the
+ * nodes section, and the nodes at depth d are those from level_offsets[d] up
+ * to level_offsets[d + 1].
+ */
+typedef struct _OctFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t record_size;
+    int32_t max_depth;
+    Position position;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t leaf_capacity;
+    uint64_t object_count;
+    uint64_t position_count;
+    uint64_t leaf_count;
+    uint64_t inner_count;
+    uint64_t positions_offset;
+    uint64_t indices_offset;
+    uint64_t codes_offset;
+    uint64_t nodes_offset;
+    uint64_t level_offsets[OCT_MAX_DEPTH + 2];
+} OctFileHeader;
+
+static uint64_t
+oct_file_align(uint64_t offset)
+{
+    return (offset + OCT_FILE_ALIGNMENT - 1) / OCT_FILE_ALIGNMENT *
+           OCT_FILE_ALIGNMENT;
+}
+
+/**
+ * @brief Write bytes at offset, padding the file with zeros up to there.
+ */
+static bool
+oct_file_write(FILE* file, uint64_t* written, uint64_t offset,
+               const void* bytes, size_t byte_count)
+{
+    static const char zeros[OCT_FILE_ALIGNMENT] = {0};
+    while (*written < offset) {
+        size_t padding = offset - *written < sizeof zeros
+            ? (size_t)(offset - *written)
+            : sizeof zeros;
+        if (fwrite(zeros, 1, padding, file) != padding) {
+            return false;
+        }
+        *written += padding;
+    }
+
+    if (byte_count > 0 && fwrite(bytes, 1, byte_count, file) != byte_count) {
+        return false;
+    }
+    *written += byte_count;
+    return true;
+}
+
+static void
+oct_file_header_init(OctFileHeader* header, Position position, size_t size,
+                     size_t leaf_capacity, int max_depth)
+{
+    memset(header, 0, sizeof *header);
+    memcpy(header->magic, oct_file_magic, sizeof header->magic);
+    header->version = OCT_FILE_VERSION;
+    header->byte_order = OCT_FILE_BYTE_ORDER;
+    header->record_size = sizeof(LeafNode);
+    header->max_depth = max_depth;
+    header->position = position;
+    header->size = size;
+    header->leaf_capacity = leaf_capacity;
+}
+
+/**
+ * @brief Place the sections after the header once their sizes are known.
+ */
+static void
+oct_file_header_layout(OctFileHeader* header)
+{
+    uint64_t node_count = header->leaf_count + header->inner_count;
+    header->positions_offset = oct_file_align(sizeof *header);
+    header->indices_offset = oct_file_align(
+        header->positions_offset + header->position_count * sizeof(Position));
+    header->codes_offset = oct_file_align(
+        header->indices_offset + header->object_count * sizeof(uint64_t));
+    header->nodes_offset = oct_file_align(
+        header->codes_offset + node_count * sizeof(uint64_t));
+}
+
+bool
+oct_octree_save(Octree* octree, const char* path)
+{
+    // Between oct_octree_begin_concurrent and oct_octree_end_concurrent the
+    // nodes live in the concurrent index, not in the tree.
+    if (octree->succinct != NULL || octree->concurrent != NULL) {
+        return false;
+    }
+
+    size_t node_count = octree->leaf_count + octree->inner_count;
+    OctSortItem* items = malloc(2 * node_count * sizeof *items);
+    BaseNode** nodes = malloc(node_count * sizeof *nodes);
+    if (items == NULL || nodes == NULL) {
+        free(items);
+        free(nodes);
+        return false;
+    }
+
+    // Sorting the codes as numbers puts the nodes in order of depth, since
+    // the sentinel bit of a deeper node is higher.
+    size_t count = 0;
+    if (octree->mapping != NULL) {
+        for (; count < node_count; count++) {
+            nodes[count] = (BaseNode*)&octree->mapped_nodes[count];
+        }
+    } else {
+        size_t iterator = 0;
+        uint64_t location_code;
+        void* node;
+        while (count < node_count &&
+               node_map_next(octree->nodes, &iterator, &location_code, &node)) {
+            nodes[count++] = node;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        items[i].location_code = nodes[i]->location_code;
+        items[i].object_index = i;
+    }
+    oct_radix_sort(items, items + count, count);
+
+    OctFileHeader header;
+    oct_file_header_init(&header, octree->position, octree->size,
+                         octree->leaf_capacity, octree->max_depth);
+    header.position_count =
+        octree->object_positions != NULL ? octree->object_index_count : 0;
+    header.leaf_count = octree->leaf_count;
+    header.inner_count = octree->inner_count;
+
+    int depth = 0;
+    for (size_t i = 0; i < count; i++) {
+        int node_depth = oct_location_code_depth(items[i].location_code);
+        while (depth < node_depth) {
+            header.level_offsets[++depth] = i;
+        }
+
+        BaseNode* node = nodes[items[i].object_index];
+        if (node->type == LEAF_NODE) {
+            header.object_count += ((LeafNode*)node)->object_count;
+        }
+    }
+    while (depth <= OCT_MAX_DEPTH) {
+        header.level_offsets[++depth] = count;
+    }
+
+    oct_file_header_layout(&header);
+
+    FILE* file = fopen(path, "wb");
+    bool saved = file != NULL && count == node_count;
+    uint64_t written = 0;
+    saved = saved && oct_file_write(file, &written, 0, &header, sizeof header);
+    saved = saved &&
+            oct_file_write(file, &written, header.positions_offset,
+                           octree->object_positions,
+                           header.position_count * sizeof(Position));
+
+    // The ranges of the leaves are packed in the order of the nodes.
+    saved = saved &&
+            oct_file_write(file, &written, header.indices_offset, NULL, 0);
+    for (size_t i = 0; i < count && saved; i++) {
+        LeafNode* leaf = (LeafNode*)nodes[items[i].object_index];
+        if (leaf->base.type == LEAF_NODE) {
+            saved = oct_file_write(
+                file, &written, written,
+                octree->object_indices + leaf->object_offset,
+                leaf->object_count * sizeof(uint64_t));
+        }
+    }
+
+    saved = saved &&
+            oct_file_write(file, &written, header.codes_offset, NULL, 0);
+    for (size_t i = 0; i < count && saved; i++) {
+        saved = oct_file_write(file, &written, written,
+                               &items[i].location_code,
+                               sizeof items[i].location_code);
+    }
+
+    saved = saved &&
+            oct_file_write(file, &written, header.nodes_offset, NULL, 0);
+    uint64_t object_offset = 0;
+    for (size_t i = 0; i < count && saved; i++) {
+        BaseNode* node = nodes[items[i].object_index];
+        LeafNode record;
+        memset(&record, 0, sizeof record);
+        if (node->type == LEAF_NODE) {
+            LeafNode* leaf = (LeafNode*)node;
+            record.object_offset = object_offset;
+            record.object_count = leaf->object_count;
+            record.object_capacity = leaf->object_count;
+            object_offset += leaf->object_count;
+        } else {
+            ((BranchNode*)&record)->child_exists =
+                ((BranchNode*)node)->child_exists;
+        }
+        record.base.location_code = node->location_code;
+        record.base.type = node->type;
+
+        saved = oct_file_write(file, &written, written, &record, sizeof record);
+    }
+
+    if (file != NULL && fclose(file) != 0) {
+        saved = false;
+    }
+    free(items);
+    free(nodes);
+
+    return saved;
+}
+
+/**
+ * @brief Check that a section of count elements of element_size bytes lies
+ * within the mapping.
+ */
+static bool
+oct_file_section_valid(size_t mapping_size, uint64_t offset, uint64_t count,
+                       size_t element_size)
+{
+    return offset % sizeof(uint64_t) == 0 && offset <= mapping_size &&
+           count <= (mapping_size - offset) / element_size;
+}
+
+/**
+ * @brief Whether code is one of the count sorted codes.
+ */
+static bool
+oct_file_has_code(const uint64_t* codes, uint64_t count, uint64_t code)
+{
+    uint64_t low = 0;
+    uint64_t high = count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (codes[middle] < code) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < count && codes[low] == code;
+}
+
+/**
+ * @brief Check the sections a mapped tree reads without bounds checks: the
+ * codes are sorted and on the level they are listed in, every record matches
+ * its code, the children of every branch exist, and the range of every leaf
+ * lies in the indices section and holds indices of saved positions.
+ */
+static bool
+oct_file_nodes_valid(const OctFileHeader* header, const char* mapping)
+{
+    const uint64_t* codes = (const uint64_t*)(mapping + header->codes_offset);
+    const LeafNode* records =
+        (const LeafNode*)(mapping + header->nodes_offset);
+    const uint64_t* indices =
+        (const uint64_t*)(mapping + header->indices_offset);
+    uint64_t node_count = header->leaf_count + header->inner_count;
+
+    uint64_t leaf_count = 0;
+    int depth = 0;
+    for (uint64_t i = 0; i < node_count; i++) {
+        uint64_t code = codes[i];
+        while (i >= header->level_offsets[depth + 1]) {
+            depth++;
+        }
+        if (code == 0 || (i > 0 && code <= codes[i - 1]) ||
+            oct_location_code_depth(code) != depth ||
+            records[i].base.location_code != code) {
+            return false;
+        }
+
+        if (records[i].base.type == INNER_NODE) {
+            uint8_t child_exists =
+                ((const BranchNode*)&records[i])->child_exists;
+            for (uint8_t child = 0; child < 8; child++) {
+                if ((child_exists & (1u << child)) &&
+                    (depth >= OCT_MAX_DEPTH ||
+                     !oct_file_has_code(codes, node_count,
+                                        code << 3 | child))) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (records[i].base.type != LEAF_NODE) {
+            return false;
+        }
+
+        leaf_count++;
+        uint64_t offset = records[i].object_offset;
+        uint64_t count = records[i].object_count;
+        if (offset > header->object_count ||
+            count > header->object_count - offset) {
+            return false;
+        }
+        for (uint64_t j = offset; j < offset + count; j++) {
+            if (indices[j] >= header->position_count) {
+                return false;
+            }
+        }
+    }
+
+    return leaf_count == header->leaf_count;
+}
+
+Octree*
+oct_octree_map(const char* path)
+{
+    size_t mapping_size = 0;
+    char* mapping = oct_file_map(path, &mapping_size);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    const OctFileHeader* header = (const OctFileHeader*)mapping;
+    uint64_t node_count = header->leaf_count + header->inner_count;
+    bool valid = mapping_size >= sizeof *header &&
+                 memcmp(header->magic, oct_file_magic, sizeof header->magic) ==
+                     0 &&
+                 header->version == OCT_FILE_VERSION &&
+                 header->byte_order == OCT_FILE_BYTE_ORDER &&
+                 header->record_size == sizeof(LeafNode) &&
+                 header->max_depth >= 0 &&
+                 header->max_depth <= OCT_MAX_DEPTH &&
+                 header->leaf_capacity > 0 && node_count > 0;
+    valid = valid &&
+            oct_file_section_valid(mapping_size, header->positions_offset,
+                                   header->position_count, sizeof(Position)) &&
+            oct_file_section_valid(mapping_size, header->indices_offset,
+                                   header->object_count, sizeof(uint64_t)) &&
+            oct_file_section_valid(mapping_size, header->codes_offset,
+                                   node_count, sizeof(uint64_t)) &&
+            oct_file_section_valid(mapping_size, header->nodes_offset,
+                                   node_count, sizeof(LeafNode));
+    valid = valid && header->level_offsets[0] == 0 &&
+            header->level_offsets[OCT_MAX_DEPTH + 1] == node_count;
+    for (int depth = 0; depth <= OCT_MAX_DEPTH && valid; depth++) {
+        valid = header->level_offsets[depth] <=
+                header->level_offsets[depth + 1];
+    }
+    valid = valid &&
+            ((const uint64_t*)(mapping + header->codes_offset))[0] == 0b1 &&
+            oct_file_nodes_valid(header, mapping);
+
+    Octree* octree = valid ? malloc(sizeof *octree) : NULL;
+    if (octree == NULL) {
+        oct_file_unmap(mapping, mapping_size);
+        return NULL;
+    }
+
+    octree->position = header->position;
+    octree->size = (size_t)header->size;
+    octree->leaf_capacity = (size_t)header->leaf_capacity;
+    octree->max_depth = header->max_depth;
+    octree->leaf_count = (size_t)header->leaf_count;
+    octree->inner_count = (size_t)header->inner_count;
+    octree->object_positions = (Position*)(mapping + header->positions_offset);
+    octree->object_count = (size_t)header->object_count;
+    octree->object_indices = (uint64_t*)(mapping + header->indices_offset);
+    octree->slot_count = octree->object_count;
+    octree->slot_capacity = octree->object_count;
+    octree->free_slot_count = 0;
+    octree->object_codes = NULL;
+    octree->object_code_count = (size_t)header->position_count;
+    octree->object_index_count = (size_t)header->position_count;
+    octree->nodes = NULL;
+    node_pool_init(&octree->leaf_pool, sizeof(LeafNode));
+    node_pool_init(&octree->branch_pool, sizeof(BranchNode));
+    octree->mapping = mapping;
+    octree->mapping_size = mapping_size;
+    octree->mapped_codes = (const uint64_t*)(mapping + header->codes_offset);
+    octree->mapped_nodes = (const LeafNode*)(mapping + header->nodes_offset);
+    octree->mapped_levels = header->level_offsets;
+    octree->succinct = NULL;
+    octree->concurrent = NULL;
+    octree->aggregate = (OctAggregate){0};
+    octree->aggregates = NULL;
+    octree->counters = (OctCounters){0};
+    node_pool_init(&octree->aggregate_pool, sizeof(void*));
+    octree->root_node = (void*)&octree->mapped_nodes[0];
+
+    return octree;
+}
+
+/**
+ * @brief Reads one run of sorted items back from its temp file through a
+ * buffer.
+ */
+typedef struct _OctRunReader
+{
+    FILE* file;
+    OctSortItem* buffer;
+    size_t capacity;
+    size_t count;
+    size_t position;
+} OctRunReader;
+
+static bool
+oct_run_reader_next(OctRunReader* reader, OctSortItem* item)
+{
+    if (reader->position == reader->count) {
+        reader->count =
+            fread(reader->buffer, sizeof *reader->buffer, reader->capacity,
+                  reader->file);
+        reader->position = 0;
+        if (reader->count == 0) {
+            return false;
+        }
+    }
+
+    *item = reader->buffer[reader->position++];
+    return true;
+}
+
+/**
+ * @brief A k-way merge of sorted runs. The heap holds the runs ordered on
+ * their current item. Equal codes are ordered on the object index, so the
+ * merge keeps the order of a stable sort.
+ */
+typedef struct _OctRunMerge
+{
+    OctSortItem* buffers;
+    OctRunReader* readers;
+    OctSortItem* heads;
+    size_t* heap;
+    size_t heap_size;
+} OctRunMerge;
+
+static bool
+oct_run_merge_less(const OctRunMerge* merge, size_t a, size_t b)
+{
+    const OctSortItem* x = &merge->heads[a];
+    const OctSortItem* y = &merge->heads[b];
+    return x->location_code < y->location_code ||
+           (x->location_code == y->location_code &&
+            x->object_index < y->object_index);
+}
+
+static void
+oct_run_merge_sift_down(OctRunMerge* merge, size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < merge->heap_size &&
+            oct_run_merge_less(merge, merge->heap[left],
+                               merge->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < merge->heap_size &&
+            oct_run_merge_less(merge, merge->heap[right],
+                               merge->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+
+        size_t swap = merge->heap[i];
+        merge->heap[i] = merge->heap[smallest];
+        merge->heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/**
+ * @brief Start merging run_count runs, giving each a buffer of
+ * buffer_capacity items.
+ */
+static bool
+oct_run_merge_init(OctRunMerge* merge, FILE** runs, size_t run_count,
+                   size_t buffer_capacity)
+{
+    merge->readers = calloc(run_count + 1, sizeof *merge->readers);
+    merge->heads = malloc((run_count + 1) * sizeof *merge->heads);
+    merge->heap = malloc((run_count + 1) * sizeof *merge->heap);
+    merge->buffers =
+        malloc((run_count * buffer_capacity + 1) * sizeof *merge->buffers);
+    merge->heap_size = 0;
+    if (merge->readers == NULL || merge->heads == NULL ||
+        merge->heap == NULL || merge->buffers == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < run_count; i++) {
+        OctRunReader* reader = &merge->readers[i];
+        reader->file = runs[i];
+        reader->buffer = merge->buffers + i * buffer_capacity;
+        reader->capacity = buffer_capacity;
+        rewind(reader->file);
+        if (oct_run_reader_next(reader, &merge->heads[i])) {
+            merge->heap[merge->heap_size++] = i;
+        }
+    }
+    for (size_t i = merge->heap_size / 2; i-- > 0;) {
+        oct_run_merge_sift_down(merge, i);
+    }
+
+    return true;
+}
+
+static void
+oct_run_merge_destroy(OctRunMerge* merge)
+{
+    free(merge->buffers);
+    free(merge->readers);
+    free(merge->heads);
+    free(merge->heap);
+}
+
+static bool
+oct_run_merge_next(OctRunMerge* merge, OctSortItem* item)
+{
+    if (merge->heap_size == 0) {
+        return false;
+    }
+
+    size_t run = merge->heap[0];
+    *item = merge->heads[run];
+    if (!oct_run_reader_next(&merge->readers[run], &merge->heads[run])) {
+        merge->heap[0] = merge->heap[--merge->heap_size];
+    }
+    oct_run_merge_sift_down(merge, 0);
+
+    return true;
+}
+
+/**
+ * @brief State of the single pass emit of a streaming build. It is the emit of
+ * oct_build_emit over a window of leaf_capacity + 1 items of the merged
+ * stream. Leaves are written as soon as their objects are known, branches
+ * once the walk leaves them and their child bits are complete. Within a
+ * level the nodes come out sorted on their code, so every level goes to its
+ * own temp file that can be appended to the output as is.
+ */
+typedef struct _OctStreamEmit
+{
+    OctRunMerge* merge;
+    OctSortItem* window;
+    size_t window_capacity;
+    size_t window_start;
+    size_t window_count;
+    bool exhausted;
+    FILE* output;
+    uint64_t* written;
+    FILE* levels[OCT_MAX_DEPTH + 1];
+    uint64_t level_counts[OCT_MAX_DEPTH + 1];
+    LeafNode path[OCT_MAX_DEPTH + 1];
+    int path_depth;
+    uint64_t object_offset;
+    uint64_t leaf_count;
+    uint64_t inner_count;
+    bool failed;
+} OctStreamEmit;
+
+static OctSortItem*
+oct_stream_window_get(OctStreamEmit* emit, size_t i)
+{
+    while (emit->window_count <= i && !emit->exhausted) {
+        size_t slot =
+            (emit->window_start + emit->window_count) % emit->window_capacity;
+        if (oct_run_merge_next(emit->merge, &emit->window[slot])) {
+            emit->window_count++;
+        } else {
+            emit->exhausted = true;
+        }
+    }
+
+    if (i >= emit->window_count) {
+        return NULL;
+    }
+    return &emit->window[(emit->window_start + i) % emit->window_capacity];
+}
+
+static void
+oct_stream_window_pop(OctStreamEmit* emit)
+{
+    emit->window_start = (emit->window_start + 1) % emit->window_capacity;
+    emit->window_count--;
+}
+
+static void
+oct_stream_write_node(OctStreamEmit* emit, int depth, const LeafNode* record)
+{
+    if (fwrite(record, sizeof *record, 1, emit->levels[depth]) != 1) {
+        emit->failed = true;
+    }
+    emit->level_counts[depth]++;
+}
+
+/**
+ * @brief Write the branches on the path below depth, which have all of their
+ * children by now.
+ */
+static void
+oct_stream_pop_path(OctStreamEmit* emit, int depth)
+{
+    for (; emit->path_depth > depth; emit->path_depth--) {
+        oct_stream_write_node(emit, emit->path_depth,
+                              &emit->path[emit->path_depth]);
+    }
+}
+
+static void
+oct_stream_emit(OctStreamEmit* emit, size_t leaf_capacity, int max_depth)
+{
+    int prev_depth = -1;
+    emit->path_depth = -1;
+
+    OctSortItem* first = oct_stream_window_get(emit, 0);
+    if (first == NULL) {
+        LeafNode root;
+        memset(&root, 0, sizeof root);
+        root.base.location_code = 0b1;
+        root.base.type = LEAF_NODE;
+        oct_stream_write_node(emit, 0, &root);
+        emit->leaf_count++;
+        return;
+    }
+
+    while (first != NULL && !emit->failed) {
+        uint64_t code = first->location_code;
+        OctSortItem* split = oct_stream_window_get(emit, leaf_capacity);
+        int split_depth = split != NULL
+            ? oct_location_code_common_depth(code, split->location_code)
+            : -1;
+        int depth = (prev_depth > split_depth ? prev_depth : split_depth) + 1;
+        if (depth > max_depth) {
+            depth = max_depth;
+        }
+
+        oct_stream_pop_path(emit, prev_depth);
+        for (int d = prev_depth + 1; d < depth; d++) {
+            LeafNode* branch = &emit->path[d];
+            memset(branch, 0, sizeof *branch);
+            branch->base.location_code = code >> (3 * (OCT_MAX_DEPTH - d));
+            branch->base.type = INNER_NODE;
+            if (d > 0) {
+                ((BranchNode*)&emit->path[d - 1])->child_exists |=
+                    1u << (branch->base.location_code & 0b111);
+            }
+            emit->inner_count++;
+        }
+        emit->path_depth = depth - 1;
+
+        // Only a leaf at max_depth can hold more objects than the window, so
+        // its objects are taken from the stream one at a time.
+        LeafNode leaf;
+        memset(&leaf, 0, sizeof leaf);
+        leaf.base.location_code = code >> (3 * (OCT_MAX_DEPTH - depth));
+        leaf.base.type = LEAF_NODE;
+        leaf.object_offset = emit->object_offset;
+        while (first != NULL &&
+               oct_location_code_common_depth(code, first->location_code) >=
+                   depth) {
+            if (!oct_file_write(emit->output, emit->written, *emit->written,
+                                &first->object_index,
+                                sizeof first->object_index)) {
+                emit->failed = true;
+            }
+            leaf.object_count++;
+            oct_stream_window_pop(emit);
+            first = oct_stream_window_get(emit, 0);
+        }
+        leaf.object_capacity = leaf.object_count;
+        emit->object_offset += leaf.object_count;
+
+        if (depth > 0) {
+            ((BranchNode*)&emit->path[depth - 1])->child_exists |=
+                1u << (leaf.base.location_code & 0b111);
+        }
+        oct_stream_write_node(emit, depth, &leaf);
+        emit->leaf_count++;
+
+        prev_depth = first != NULL
+            ? oct_location_code_common_depth(code, first->location_code)
+            : -1;
+    }
+
+    oct_stream_pop_path(emit, -1);
+}
+
+/**
+ * @brief Sort a run of items, write it to a new temp file and add that file to
+ * the runs. items needs room for twice count items.
+ */
+static bool
+oct_stream_spill_run(OctSortItem* items, size_t count, FILE*** runs,
+                     size_t* run_count, size_t* runs_capacity)
+{
+    if (*run_count == *runs_capacity) {
+        size_t capacity = *runs_capacity ? 2 * *runs_capacity : 16;
+        FILE** grown = realloc(*runs, capacity * sizeof *grown);
+        if (grown == NULL) {
+            return false;
+        }
+        *runs = grown;
+        *runs_capacity = capacity;
+    }
+
+    FILE* run = tmpfile();
+    if (run == NULL) {
+        return false;
+    }
+
+    oct_radix_sort(items, items + count, count);
+    if (fwrite(items, sizeof *items, count, run) != count) {
+        fclose(run);
+        return false;
+    }
+
+    (*runs)[(*run_count)++] = run;
+    return true;
+}
+
+/**
+ * @brief Merge runs until no more than fan_in are left.
+ */
+static bool
+oct_stream_reduce_runs(FILE** runs, size_t* run_count, size_t fan_in,
+                       size_t buffer_capacity)
+{
+    while (*run_count > fan_in) {
+        size_t merged_count = 0;
+        for (size_t first = 0; first < *run_count; first += fan_in) {
+            size_t group = *run_count - first < fan_in ? *run_count - first
+                                                      : fan_in;
+            FILE* merged = tmpfile();
+            OctRunMerge merge;
+            memset(&merge, 0, sizeof merge);
+            bool merged_ok = merged != NULL &&
+                             oct_run_merge_init(&merge, runs + first, group,
+                                                buffer_capacity);
+            OctSortItem item;
+            while (merged_ok && oct_run_merge_next(&merge, &item)) {
+                merged_ok = fwrite(&item, sizeof item, 1, merged) == 1;
+            }
+            oct_run_merge_destroy(&merge);
+
+            for (size_t i = first; i < first + group; i++) {
+                fclose(runs[i]);
+            }
+            if (!merged_ok) {
+                if (merged != NULL) {
+                    fclose(merged);
+                }
+                for (size_t i = first + group; i < *run_count; i++) {
+                    fclose(runs[i]);
+                }
+                *run_count = merged_count;
+                return false;
+            }
+            runs[merged_count++] = merged;
+        }
+        *run_count = merged_count;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Append the codes, then the records, of all levels to the output.
+ */
+static bool
+oct_stream_write_nodes(OctStreamEmit* emit, const OctFileHeader* header,
+                       uint64_t* written)
+{
+    LeafNode records[256];
+    bool written_ok =
+        oct_file_write(emit->output, written, header->codes_offset, NULL, 0);
+    for (int pass = 0; pass < 2 && written_ok; pass++) {
+        if (pass == 1) {
+            written_ok = oct_file_write(emit->output, written,
+                                        header->nodes_offset, NULL, 0);
+        }
+
+        for (int depth = 0; depth <= OCT_MAX_DEPTH && written_ok; depth++) {
+            if (emit->levels[depth] == NULL) {
+                continue;
+            }
+
+            rewind(emit->levels[depth]);
+            size_t count;
+            while (written_ok &&
+                   (count = fread(records, sizeof *records,
+                                  sizeof records / sizeof *records,
+                                  emit->levels[depth])) > 0) {
+                for (size_t i = 0; i < count && written_ok; i++) {
+                    written_ok = pass == 0
+                        ? oct_file_write(emit->output, written, *written,
+                                         &records[i].base.location_code,
+                                         sizeof(uint64_t))
+                        : oct_file_write(emit->output, written, *written,
+                                         &records[i], sizeof records[i]);
+                }
+            }
+        }
+    }
+
+    return written_ok;
+}
+
+bool
+oct_octree_build_stream(const char* path, Position position, size_t size,
+                        size_t leaf_capacity, int max_depth,
+                        OctPositionReader reader, void* context,
+                        size_t memory_budget)
+{
+    // The same bounds as oct_octree_init_sized, so the file maps to a tree
+    // with the capacity it records.
+    leaf_capacity = leaf_capacity > 0 ? leaf_capacity : 1;
+    if (leaf_capacity > UINT32_MAX) {
+        leaf_capacity = UINT32_MAX;
+    }
+    if (max_depth < 0 || max_depth > OCT_MAX_DEPTH) {
+        max_depth = OCT_MAX_DEPTH;
+    }
+    if (memory_budget < OCT_STREAM_MIN_BUDGET) {
+        memory_budget = OCT_STREAM_MIN_BUDGET;
+    }
+
+    // The location codes only depend on the bounds, so a tree without nodes
+    // can encode the positions.
+    Octree bounds;
+    memset(&bounds, 0, sizeof bounds);
+    bounds.position = position;
+    bounds.size = size;
+
+    OctFileHeader header;
+    oct_file_header_init(&header, position, size, leaf_capacity, max_depth);
+    oct_file_header_layout(&header);
+
+    // A run is sorted in memory with scratch space of the same size, next to
+    // a chunk of positions read from the reader.
+    size_t chunk_capacity = memory_budget / 8 / sizeof(Position);
+    if (chunk_capacity > OCT_STREAM_CHUNK) {
+        chunk_capacity = OCT_STREAM_CHUNK;
+    }
+    size_t run_capacity = (memory_budget - chunk_capacity * sizeof(Position)) /
+                          (2 * sizeof(OctSortItem));
+    Position* chunk = malloc(chunk_capacity * sizeof *chunk);
+    OctSortItem* items = malloc(2 * run_capacity * sizeof *items);
+    FILE** runs = NULL;
+    size_t run_count = 0;
+    size_t runs_capacity = 0;
+    FILE* output = fopen(path, "wb");
+    uint64_t written = 0;
+    bool built = chunk != NULL && items != NULL && output != NULL &&
+                 oct_file_write(output, &written, header.positions_offset,
+                                NULL, 0);
+
+    // Copy the positions to the output and spill sorted runs of their codes.
+    size_t run_size = 0;
+    uint64_t object_count = 0;
+    while (built) {
+        size_t count = reader(context, chunk, chunk_capacity);
+        if (count > chunk_capacity) {
+            count = chunk_capacity;
+        }
+        built = oct_file_write(output, &written, written, chunk,
+                               count * sizeof *chunk);
+
+        for (size_t i = 0; i < count && built;) {
+            size_t step = count - i < run_capacity - run_size
+                ? count - i
+                : run_capacity - run_size;
+            oct_location_codes_encode(&bounds, chunk + i, step,
+                                      &items[run_size].location_code,
+                                      OCT_SORT_ITEM_STRIDE);
+            for (size_t j = 0; j < step; j++) {
+                items[run_size++].object_index = object_count++;
+            }
+            i += step;
+
+            if (run_size == run_capacity) {
+                built = oct_stream_spill_run(items, run_size, &runs,
+                                             &run_count, &runs_capacity);
+                run_size = 0;
+            }
+        }
+
+        if (count == 0) {
+            break;
+        }
+    }
+    if (built && run_size > 0) {
+        built = oct_stream_spill_run(items, run_size, &runs, &run_count,
+                                     &runs_capacity);
+    }
+    free(chunk);
+    free(items);
+
+    header.position_count = object_count;
+    header.object_count = object_count;
+    oct_file_header_layout(&header);
+
+    // Merge the runs, in several passes if the budget does not leave a
+    // reasonable buffer for every run at once.
+    size_t fan_in = memory_budget / OCT_STREAM_MIN_RUN_BUFFER;
+    if (fan_in > OCT_STREAM_MAX_FAN_IN) {
+        fan_in = OCT_STREAM_MAX_FAN_IN;
+    }
+    size_t buffer_capacity =
+        memory_budget / (fan_in + 1) / sizeof(OctSortItem);
+    built = built &&
+            oct_stream_reduce_runs(runs, &run_count, fan_in, buffer_capacity);
+
+    OctStreamEmit emit;
+    memset(&emit, 0, sizeof emit);
+    OctRunMerge merge;
+    memset(&merge, 0, sizeof merge);
+    emit.merge = &merge;
+    emit.output = output;
+    emit.written = &written;
+    // The window never holds more codes than there are objects.
+    emit.window_capacity =
+        (leaf_capacity < object_count ? leaf_capacity : object_count) + 1;
+    emit.window = malloc(emit.window_capacity * sizeof *emit.window);
+    built = built && emit.window != NULL &&
+            oct_run_merge_init(&merge, runs, run_count, buffer_capacity);
+    for (int depth = 0; depth <= max_depth && built; depth++) {
+        emit.levels[depth] = tmpfile();
+        built = emit.levels[depth] != NULL;
+    }
+
+    built = built &&
+            oct_file_write(output, &written, header.indices_offset, NULL, 0);
+    if (built) {
+        oct_stream_emit(&emit, leaf_capacity, max_depth);
+        built = !emit.failed && emit.object_offset == object_count;
+    }
+
+    header.leaf_count = emit.leaf_count;
+    header.inner_count = emit.inner_count;
+    oct_file_header_layout(&header);
+    for (int depth = 0; depth <= OCT_MAX_DEPTH; depth++) {
+        header.level_offsets[depth + 1] =
+            header.level_offsets[depth] + emit.level_counts[depth];
+    }
+    built = built && oct_stream_write_nodes(&emit, &header, &written);
+    built = built && fseek(output, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof header, 1, output) == 1;
+
+    oct_run_merge_destroy(&merge);
+    free(emit.window);
+    for (int depth = 0; depth <= OCT_MAX_DEPTH; depth++) {
+        if (emit.levels[depth] != NULL) {
+            fclose(emit.levels[depth]);
+        }
+    }
+    for (size_t i = 0; i < run_count; i++) {
+        fclose(runs[i]);
+    }
+    free(runs);
+    if (output != NULL && fclose(output) != 0) {
+        built = false;
+    }
+    if (!built && output != NULL) {
+        remove(path);
+    }
+
+    return built;
+}
+
+bool
+oct_octree_make_succinct(Octree* octree)
+{
+    if (octree->succinct != NULL) {
+        return true;
+    }
+    if (octree->concurrent != NULL) {
+        return false;
+    }
+
+    size_t node_count = octree->leaf_count + octree->inner_count;
+    succinct_tree* tree = succinct_tree_alloc(node_count, octree->leaf_count);
+    BaseNode** queue = malloc(node_count * sizeof *queue);
+    uint64_t* indices = malloc(octree->object_count * sizeof *indices + 1);
+    if (tree == NULL || queue == NULL || indices == NULL) {
+        succinct_tree_free(tree);
+        free(queue);
+        free(indices);
+        return false;
+    }
+
+    // Queueing the children in the order of their bits numbers the nodes in
+    // level order, and the leaves and their objects in the same order.
+    size_t tail = 1;
+    size_t leaf_count = 0;
+    uint64_t offset = 0;
+    queue[0] = octree->root_node;
+    for (size_t i = 0; i < tail; i++) {
+        BaseNode* node = queue[i];
+        if (node->type == LEAF_NODE) {
+            LeafNode* leaf = (LeafNode*)node;
+            tree->leaf_offsets[leaf_count++] = offset;
+            memcpy(indices + offset,
+                   octree->object_indices + leaf->object_offset,
+                   leaf->object_count * sizeof *indices);
+            offset += leaf->object_count;
+            continue;
+        }
+
+        uint8_t child_exists = ((BranchNode*)node)->child_exists;
+        tree->child_exists[i] = child_exists;
+        for (uint8_t child = 0; child < 8; child++) {
+            if (child_exists & (1u << child)) {
+                queue[tail++] =
+                    oct_node_get_child(octree, node->location_code, child);
+            }
+        }
+    }
+    tree->leaf_offsets[leaf_count] = offset;
+    succinct_tree_finish(tree);
+    free(queue);
+
+    if (octree->mapping == NULL) {
+        free(octree->object_indices);
+        node_map_free(octree->nodes);
+        octree->nodes = NULL;
+        node_pool_destroy(&octree->leaf_pool);
+        node_pool_destroy(&octree->branch_pool);
     }
+    octree->object_indices = indices;
+    octree->slot_count = offset;
+    octree->slot_capacity = offset;
+    octree->free_slot_count = 0;
+    octree->root_node = NULL;
+    octree->succinct = tree;
+    return true;
 }
@@ -7,12 +7,46 @@
 #define OCTREE_API
 #endif
 
+#include "node_map.h"
+#include "node_pool.h"
+#include "succinct_tree.h"
 #include "unordered_map.h"
 #include <stdint.h>
 
 #define INNER_NODE 0
 #define LEAF_NODE 1
 
+/**
+ * The deepest level a node can have. A location code spends three bits per
+ * level plus one sentinel bit, so 21 levels fill all 64 bits.
+ */
+#define OCT_MAX_DEPTH 21
+
+/**
+ * oct_octree_update rebuilds the tree when more than one in this many objects
+ * left their leaf.
+ */
+#define OCT_UPDATE_REBUILD_DIVISOR 8
+
+/**
+ * The amount of reader threads that can be registered with one set of
+ * snapshots at the same time.
+ */
+#define OCT_SNAPSHOT_MAX_READERS 64
+
+/**
+ * oct_octree_get_stats sorts leaves into this many bins by how full they
+ * are, in eighths of leaf_capacity with full leaves in the last bin, and
+ * node map entries into this many bins by their probe length.
+ */
+#define OCT_STATS_OCCUPANCY_BINS 9
+#define OCT_STATS_PROBE_BINS 16
+
+/**
+ * Building with OCT_NO_STATS defined leaves out the counting of splits,
+ * merges and query work. oct_octree_get_stats then reports those as 0.
+ */
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -28,6 +62,138 @@ extern "C"
         float z;
     } Position;
 
+    /**
+     * @brief A plane a * x + b * y + c * z + d = 0. The normal (a, b, c)
+     * points to the inside: a point is inside when the left hand side is 0 or
+     * larger. The normal does not have to be normalized.
+     *
+     */
+    typedef struct _Plane
+    {
+        float a;
+        float b;
+        float c;
+        float d;
+    } Plane;
+
+    /**
+     * @brief A ray starting at origin. The direction does not have to be
+     * normalized.
+     *
+     */
+    typedef struct _Ray
+    {
+        Position origin;
+        Position direction;
+    } Ray;
+
+    /**
+     * @brief The object a ray hit and the distance from the ray origin to
+     * where it entered the object. The object index is ULLONG_MAX and the
+     * distance INFINITY if nothing was hit.
+     *
+     */
+    typedef struct _RayHit
+    {
+        uint64_t object_index;
+        float distance;
+    } RayHit;
+
+    /**
+     * @brief How oct_octree_update brought the tree up to date.
+     *
+     * OCT_UPDATE_REINSERT: only the objects that left their leaf were moved.
+     * OCT_UPDATE_REBUILD: so many objects left their leaf that the tree was
+     * built again from scratch.
+     * OCT_UPDATE_FAILED: allocation failed. The tree is left as it was,
+     * without the objects that could not be moved, or empty if a rebuild ran
+     * out of memory.
+     */
+    typedef enum _OctUpdateStrategy
+    {
+        OCT_UPDATE_REINSERT,
+        OCT_UPDATE_REBUILD,
+        OCT_UPDATE_FAILED
+    } OctUpdateStrategy;
+
+    /**
+     * @brief A value kept for every node that sums up the objects below it,
+     * such as their count, total mass, center of mass or bounding box.
+     *
+     * The value of a leaf starts from init and takes in its objects one by
+     * one with add_object. The value of a branch starts from init and takes
+     * in the values of its children with combine. Nodes of the same level
+     * are computed on several threads at once, so the callbacks may only
+     * write to the value they are given. Values are aligned like
+     * max_align_t, so any type can be kept in them.
+     */
+    typedef struct _OctAggregate
+    {
+        size_t value_size;
+        void (*init)(void* value, void* context);
+        void (*add_object)(void* value, uint64_t object_index,
+                           Position position, void* context);
+        void (*combine)(void* value, const void* child_value, void* context);
+        void* context;
+    } OctAggregate;
+
+    /**
+     * @brief Running counts of the work done on a tree since it was made or
+     * the counts were reset.
+     *
+     * splits counts the leaves split by inserts and merges the branches
+     * folded back into a leaf by removals. queries counts the calls of the
+     * oct_query_ functions, one per ray for a ray packet. nodes_visited and
+     * lookups count the nodes those queries reached and the node lookups
+     * that took; a succinct tree needs no lookups. Steps of cursor walks made
+     * outside a query, such as computing aggregates, are not counted. Queries
+     * add to the counts atomically, so every query counts when several
+     * threads share a tree.
+     */
+    typedef struct _OctCounters
+    {
+        uint64_t splits;
+        uint64_t merges;
+        uint64_t queries;
+        uint64_t nodes_visited;
+        uint64_t lookups;
+    } OctCounters;
+
+    /**
+     * @brief The shape, memory use and work of a tree, as reported by
+     * oct_octree_get_stats.
+     *
+     * node_counts and leaf_counts hold the amount of nodes and leaves on
+     * every level. occupancy_counts bins the leaves by their object count:
+     * bin i holds leaves with i to i + 1 eighths of leaf_capacity, the last
+     * bin full leaves and the overfull ones at max_depth. load_factor and
+     * probe_counts describe the node map; they are 0 for a succinct or
+     * mapped tree, which has none. bytes and allocations cover the memory
+     * the tree holds, including a file it is mapped from.
+     */
+    typedef struct _OctStats
+    {
+        size_t node_counts[OCT_MAX_DEPTH + 1];
+        size_t leaf_counts[OCT_MAX_DEPTH + 1];
+        int depth;
+        size_t occupancy_counts[OCT_STATS_OCCUPANCY_BINS];
+        double mean_occupancy;
+        size_t max_leaf_objects;
+        double load_factor;
+        size_t probe_counts[OCT_STATS_PROBE_BINS];
+        size_t max_probe_length;
+        size_t allocations;
+        size_t bytes;
+        double bytes_per_object;
+        OctCounters counters;
+    } OctStats;
+
+    /**
+     * @brief The node index and node budgets of a tree taking concurrent
+     * inserts. Private to the implementation.
+     */
+    typedef struct _OctConcurrent OctConcurrent;
+
     /**
      * @brief Thr basic container for the octree which holds the metadata.
      *
@@ -36,11 +202,36 @@ extern "C"
     {
         Position position;
         size_t size;
+        size_t leaf_capacity;
+        int max_depth;
         size_t inner_count;
         size_t leaf_count;
         void* root_node;
         Position* object_positions;
-        unordered_map* nodes;
+        size_t object_count;
+        uint64_t* object_indices;
+        size_t slot_count;
+        size_t slot_capacity;
+        size_t free_slot_count;
+        uint64_t* object_codes;
+        size_t object_code_count;
+        // One past the highest object index that was put in the tree, the
+        // length the positions array has to have.
+        size_t object_index_count;
+        node_map* nodes;
+        node_pool leaf_pool;
+        node_pool branch_pool;
+        void* mapping;
+        size_t mapping_size;
+        const uint64_t* mapped_codes;
+        const struct _LeafNode* mapped_nodes;
+        const uint64_t* mapped_levels;
+        succinct_tree* succinct;
+        OctConcurrent* concurrent;
+        OctAggregate aggregate;
+        node_map* aggregates;
+        node_pool aggregate_pool;
+        OctCounters counters;
     } Octree;
 
     /**
@@ -64,14 +255,19 @@ extern "C"
     } BaseNode;
 
     /**
-     * @brief The leaf node. This holds the object index of the object.
-     *        The object index can be used by the usser to find the right
-     *        object in hissss array.
+     * @brief The leaf node. This holds a range of up to leaf_capacity objects:
+     *        octree->object_indices[object_offset] up to object_offset +
+     *        object_count. Those object indices can be used by the usser to
+     *        find the right object in hissss array. Only a leaf at max_depth
+     *        can hold more than leaf_capacity objects. The range has room for
+     *        object_capacity objects, so inserts do not have to move it.
      */
     typedef struct _LeafNode
     {
         BaseNode base;
-        uint64_t object_index;
+        uint64_t object_offset;
+        uint32_t object_count;
+        uint32_t object_capacity;
     } LeafNode;
 
     /**
@@ -86,20 +282,150 @@ extern "C"
         uint8_t child_exists;
     } BranchNode;
 
+    /**
+     * @brief A node reached by walking down the tree. Stepping into a child
+     * derives the center, half size and depth of the child from its parent,
+     * so every step takes constant time instead of decoding the location
+     * code again. In the succinct form there are no node structs: node is
+     * NULL and index is the level order index of the node.
+     */
+    typedef struct _OctCursor
+    {
+        BaseNode* node;
+        size_t index;
+        uint64_t location_code;
+        Position center;
+        float half_size;
+        int depth;
+    } OctCursor;
+
+    /**
+     * @brief Versions of an octree that readers can query while a writer
+     * builds the next one. The fields are atomics private to the
+     * implementation.
+     */
+    typedef struct _OctSnapshots OctSnapshots;
+
     size_t hash_func(void* key);
     bool equals_func(void* key1, void* key2);
 
     /**
-     * @brief Allocate an octree with a root node.
+     * @brief What a visit callback wants the walk to do next.
+     *
+     * OCT_VISIT_CONTINUE: go on as normal.
+     * OCT_VISIT_SKIP: from pre_visit, do not visit the nodes below this one.
+     * Its post_visit is still called.
+     * OCT_VISIT_STOP: end the walk without calling any more callbacks.
+     */
+    typedef enum _OctVisitResult
+    {
+        OCT_VISIT_CONTINUE,
+        OCT_VISIT_SKIP,
+        OCT_VISIT_STOP
+    } OctVisitResult;
+
+    /**
+     * @brief The order in which oct_octree_visit reaches the nodes.
+     */
+    typedef enum _OctVisitOrder
+    {
+        OCT_VISIT_DEPTH_FIRST,
+        OCT_VISIT_BREADTH_FIRST
+    } OctVisitOrder;
+
+    /**
+     * @brief Called by oct_octree_visit for a node.
+     *
+     * @param octree
+     * @param cursor The node with its center, size and depth
+     * @param context The context passed to oct_octree_visit
+     * @return OctVisitResult result
+     */
+    typedef OctVisitResult (*OctVisitCallback)(Octree* octree,
+                                               const OctCursor* cursor,
+                                               void* context);
+
+    /**
+     * @brief Allocate an octree with a root node. Only a small node map is
+     * allocated up front; it grows with the tree.
      *
      * @param position The center of the octree
      * @param size The length from the center to one of the sides of the octree
+     * @param leaf_capacity The number of objects a leaf holds before it is
+     * split, at least 1 and at most UINT32_MAX
+     * @param max_depth The depth below which no node is split, at most
+     * OCT_MAX_DEPTH. Leaves at this depth hold all of their objects no matter
+     * the capacity.
      * @return OctreeContainer* octree This contains metadata for the octree
      */
-    OCTREE_API Octree* oct_octree_init(Position position, size_t size);
+    OCTREE_API Octree* oct_octree_init(Position position, size_t size,
+                                       size_t leaf_capacity, int max_depth);
+
+    /**
+     * @brief Allocate an octree like oct_octree_init, with its node map, node
+     * pools and object arrays sized for expected_objects objects, so
+     * inserting or building that many does not grow them much. Taking
+     * oct_octree_estimate_bytes of the reservation, no more than
+     * memory_budget bytes are reserved: with a smaller budget the tree is
+     * sized for as many objects as fit. The tree can still grow past the
+     * budget later on.
+     *
+     * @param position The center of the octree
+     * @param size The length from the center to one of the sides of the octree
+     * @param leaf_capacity The number of objects a leaf holds before it is
+     * split, at least 1 and at most UINT32_MAX
+     * @param max_depth The depth below which no node is split, at most
+     * OCT_MAX_DEPTH
+     * @param expected_objects The amount of objects to size for
+     * @param memory_budget The most bytes to reserve, 0 for no limit
+     * @return Octree* octree NULL if allocation failed or the budget is too
+     * small for an empty tree
+     */
+    OCTREE_API Octree* oct_octree_init_sized(Position position, size_t size,
+                                             size_t leaf_capacity,
+                                             int max_depth,
+                                             size_t expected_objects,
+                                             size_t memory_budget);
+
+    /**
+     * @brief The bytes a tree sized for object_count objects reserves. A tree
+     * built from that many objects takes about as much: it expects up to
+     * four leaves per leaf_capacity objects, which holds for spread out
+     * objects. Objects piled on few points need fewer leaves but more
+     * branches.
+     *
+     * @param leaf_capacity
+     * @param object_count
+     * @return size_t bytes
+     */
+    OCTREE_API size_t oct_octree_estimate_bytes(size_t leaf_capacity,
+                                                size_t object_count);
+
+    /**
+     * @brief Give back the memory the tree does not use: the object ranges
+     * are packed, and the object arrays, node map and node pools are cut to
+     * what the tree holds. The next inserts grow them again.
+     *
+     * @param octree
+     * @return bool success false if allocation failed or the tree takes
+     * concurrent inserts. A mapped or succinct tree is packed already.
+     */
+    OCTREE_API bool oct_octree_shrink_to_fit(Octree* octree);
 
     /**
-     * @brief Dessstroy the octree and deallocate all the nodes.
+     * @brief Get the bytes the tree holds: its nodes, node map, object arrays
+     * and a file it is mapped from. Divided by the object count this is the
+     * cost of one object. Unlike oct_octree_get_stats it does not walk the
+     * tree.
+     *
+     * @param octree
+     * @return size_t bytes
+     */
+    OCTREE_API size_t oct_octree_get_bytes(Octree* octree);
+
+    /**
+     * @brief Dessstroy the octree and deallocate all the nodes. The nodes live
+     *        in per-octree pools, so this costs one free per pool slab.
      *        NOTE: you do have to destroy object positions yourself!
      *
      * @param octree The octree that has to be freed
@@ -107,7 +433,18 @@ extern "C"
     OCTREE_API void oct_octree_free(Octree* octree);
 
     /**
-     * @brief Split the octree until all the objects are in their own node.
+     * @brief Split the octree until no leaf holds more than leaf_capacity
+     * objects or the leaves reach max_depth. Any nodes from a previous build
+     * are thrown away.
+     *
+     * The tree is built in bulk: every object gets the location code of its
+     * cell at OCT_MAX_DEPTH, the codes are radix sorted and the nodes are
+     * emitted in a single pass over the sorted codes. The sorted object
+     * indices are kept in object_indices, so every leaf and every subtree
+     * holds a contiguous range of them.
+     *
+     * If memory runs out the tree is left empty: a single root leaf without
+     * objects.
      *
      * @param octree
      * @param object_positions An array of positions (x, y, z) float
@@ -117,6 +454,273 @@ extern "C"
                                      Position* object_positions,
                                      size_t object_count);
 
+    /**
+     * @brief Build the octree like oct_octree_build, using several threads.
+     *
+     * The objects are split by their octant two levels below the root. The
+     * first two levels are created up front, and the subtree of every octant
+     * is sorted and built on its own thread into its own storage before it is
+     * merged into the shared node index. Small inputs, or a build without
+     * OpenMP, fall back to the serial build. The resulting tree is the same
+     * as the one oct_octree_build creates.
+     *
+     * @param octree
+     * @param object_positions An array of positions (x, y, z) float
+     * @param object_count Number of objects
+     * @param thread_count Number of threads, 0 to use the OpenMP default
+     */
+    OCTREE_API void oct_octree_build_parallel(Octree* octree,
+                                              Position* object_positions,
+                                              size_t object_count,
+                                              int thread_count);
+
+    /**
+     * @brief Add one object to the tree without rebuilding it. The object is
+     * put in the leaf that holds its position, and that leaf is split when it
+     * is full.
+     *
+     * @param octree
+     * @param object_positions The array that holds the position of the
+     * object. It replaces the array the tree was built from, so that array
+     * may have been reallocated to make room for the object.
+     * @param object_index Index of the object in object_positions
+     * @return bool inserted false if the object is already in the tree or
+     * allocation failed
+     */
+    OCTREE_API bool oct_object_insert(Octree* octree,
+                                      Position* object_positions,
+                                      uint64_t object_index);
+
+    /**
+     * @brief Take one object out of the tree. Empty leaves are freed, and a
+     * subtree is merged back into a single leaf once it holds no more than
+     * half of leaf_capacity objects. Merging lazily like this keeps objects
+     * that hover around the capacity from splitting and merging the same
+     * node over and over.
+     *
+     * @param octree
+     * @param object_index
+     * @return bool removed false if the object is not in the tree
+     */
+    OCTREE_API bool oct_object_remove(Octree* octree, uint64_t object_index);
+
+    /**
+     * @brief Give an object a new position and move it to the leaf that holds
+     * that position. object_positions[object_index] is set to position.
+     *
+     * Only the nodes between the old leaf, the new leaf and the deepest node
+     * holding both are touched. A move that stays within its leaf only
+     * updates the position.
+     *
+     * @param octree
+     * @param object_index
+     * @param position
+     * @return bool moved false if the object is not in the tree, or if
+     * allocation failed, in which case the object was taken out of the tree
+     */
+    OCTREE_API bool oct_object_move(Octree* octree, uint64_t object_index,
+                                    Position position);
+
+    /**
+     * @brief Give every object in the tree a new position at once, for
+     * example after a simulation step.
+     *
+     * The location codes of the new positions are computed in bulk. An
+     * object whose code still falls in its leaf only gets its code updated,
+     * so a step where objects move a little touches few nodes. When more than
+     * one in OCT_UPDATE_REBUILD_DIVISOR objects left its leaf, the tree is
+     * rebuilt from the new codes instead, which is cheaper than moving that
+     * many objects one by one.
+     *
+     * @param octree
+     * @param new_positions The new position of every object, indexed like the
+     * array the tree was built from. It replaces that array.
+     * @return OctUpdateStrategy strategy The way the tree was updated
+     */
+    OCTREE_API OctUpdateStrategy oct_octree_update(Octree* octree,
+                                                   Position* new_positions);
+
+    /**
+     * @brief Write the octree to a file that oct_octree_map can open.
+     *
+     * The file holds the object positions, the object indices of every leaf,
+     * the location codes of all nodes sorted by depth and then by code, and
+     * one fixed size node record per code. The records have the layout of
+     * LeafNode and BranchNode, so a mapped tree hands them out as nodes as
+     * they are. The file is only readable on machines with the same byte
+     * order and struct layout.
+     *
+     * @param octree
+     * @param path
+     * @return bool saved false if the file could not be written, or the tree
+     * is succinct or taking concurrent inserts
+     */
+    OCTREE_API bool oct_octree_save(Octree* octree, const char* path);
+
+    /**
+     * @brief Open a file written by oct_octree_save as a read-only octree.
+     *
+     * The file is memory mapped and nothing is copied out of it: nodes,
+     * object indices and object positions all point into the mapping, and a
+     * node lookup is a binary search over the sorted codes of one level.
+     * Pages are only read from disk once a query touches them. The queries
+     * and node lookups work as on a built tree. Builds, updates and object
+     * inserts, removes and moves leave a mapped tree untouched. Free it with
+     * oct_octree_free, which unmaps the file.
+     *
+     * @param path
+     * @return Octree* octree NULL if the file could not be mapped or is not
+     * an octree file
+     */
+    OCTREE_API Octree* oct_octree_map(const char* path);
+
+    /**
+     * @brief Called by oct_octree_build_stream for the next positions.
+     *
+     * @param context The context passed to oct_octree_build_stream
+     * @param positions Receives the next positions
+     * @param capacity Number of positions that fit in positions
+     * @return size_t count Number of positions written, 0 once all positions
+     * have been read
+     */
+    typedef size_t (*OctPositionReader)(void* context, Position* positions,
+                                        size_t capacity);
+
+    /**
+     * @brief Build an octree file for oct_octree_map from positions that do
+     * not have to fit in memory. The objects are numbered in the order the
+     * reader hands them out.
+     *
+     * The positions are copied to the file as they are read, and their
+     * location codes are sorted in runs that fill the memory budget and
+     * spilled to temp files. The runs are merged, in several passes if there
+     * are too many to merge at once, and the nodes are emitted in a single
+     * pass over the merged codes straight to the file. The tree is the same
+     * oct_octree_build makes from the same positions.
+     *
+     * @param path The file to write
+     * @param position The center of the octree
+     * @param size The length from the center to one of the sides
+     * @param leaf_capacity As for oct_octree_init
+     * @param max_depth As for oct_octree_init
+     * @param reader Hands out the positions
+     * @param context Passed to reader
+     * @param memory_budget Bytes to use for sorting and merging, at least
+     * 64 KB. A window of leaf_capacity + 1 codes, at most one more than
+     * there are objects, comes on top of this.
+     * @return bool built false if reading, writing or allocation failed
+     */
+    OCTREE_API bool oct_octree_build_stream(const char* path,
+                                            Position position, size_t size,
+                                            size_t leaf_capacity,
+                                            int max_depth,
+                                            OctPositionReader reader,
+                                            void* context,
+                                            size_t memory_budget);
+
+    /**
+     * @brief Switch a built or mapped tree to its compact read-only form.
+     *
+     * The nodes are replaced by their child masks in level order, one byte
+     * per node, and a rank directory with two counters per 64 nodes. The
+     * queries find a child by counting the child bits before its parent
+     * instead of looking it up in the node map, so a traversal reads the
+     * masks level by level from a few cache lines. The object indices are
+     * packed in the order of the leaves.
+     *
+     * Queries work as before. There are no node structs any more, so the
+     * root node, oct_node_lookup and oct_point_locate give NULL, and object
+     * inserts, removes, moves, updates and oct_octree_save fail. The next
+     * build of a tree that is not mapped goes back to the normal form.
+     *
+     * @param octree
+     * @return bool compact false if allocation failed or the tree is taking
+     * concurrent inserts, the tree is then left as it was
+     */
+    OCTREE_API bool oct_octree_make_succinct(Octree* octree);
+
+    /**
+     * @brief Let several threads insert objects into the tree at the same
+     * time, with oct_object_insert_concurrent, until
+     * oct_octree_end_concurrent.
+     *
+     * The nodes move into a lock-free index with fixed capacity. A thread
+     * claims a missing child by setting its bit in the child mask of the
+     * branch with an atomic or, and a slot in a leaf by a compare and swap
+     * on its object count. The thread that fills a leaf locks it and
+     * replaces it in the index by a branch with the split objects, or at
+     * max_depth by a leaf with twice the room. Nodes, index entries and
+     * object slots come from budgets sized for object_capacity objects, so
+     * no shared array is ever grown. In between, the tree can not be queried
+     * or changed in any other way.
+     *
+     * @param octree
+     * @param object_positions The positions of the objects, indexed by
+     * object index. It replaces the array the tree was built from. The
+     * position of an object must be written before it is inserted.
+     * @param object_capacity One more than the largest object index that
+     * will be inserted
+     * @return bool started false if the tree is read-only, already taking
+     * concurrent inserts, or allocation failed
+     */
+    OCTREE_API bool oct_octree_begin_concurrent(Octree* octree,
+                                                Position* object_positions,
+                                                size_t object_capacity);
+
+    /**
+     * @brief Insert an object while other threads do the same. Thread safe
+     * between oct_octree_begin_concurrent and oct_octree_end_concurrent.
+     *
+     * @param octree
+     * @param object_index
+     * @return bool inserted false if the index is out of range, the object
+     * is already in the tree, or the node budgets ran out
+     */
+    OCTREE_API bool oct_object_insert_concurrent(Octree* octree,
+                                                 uint64_t object_index);
+
+    /**
+     * @brief Stop taking concurrent inserts and turn the index back into the
+     * normal node map. All inserting threads must be done. The ranges left
+     * behind by replaced leaves are packed away when they are more than
+     * half of the slots, and the aggregate values are computed.
+     *
+     * @param octree
+     * @return bool ended false if the tree was not taking concurrent inserts
+     * or allocation failed, in which case it still is
+     */
+    OCTREE_API bool oct_octree_end_concurrent(Octree* octree);
+
+    /**
+     * @brief Keep an aggregate value for every node of the tree.
+     *
+     * The values are computed right away, bottom-up and one level at a time
+     * with the nodes of a level spread over the threads. Builds compute them
+     * again. An object insert, remove or move only computes the nodes on the
+     * paths of the objects again, from the leaf up to the root, and
+     * oct_octree_update computes all of them. A mapped or succinct tree
+     * keeps the values it had when it was made read-only.
+     *
+     * @param octree
+     * @param aggregate The callbacks and value size, copied into the tree.
+     * NULL drops the values.
+     * @return bool computed false if allocation failed, the tree then has no
+     * aggregate
+     */
+    OCTREE_API bool oct_octree_set_aggregate(Octree* octree,
+                                             const OctAggregate* aggregate);
+
+    /**
+     * @brief Get the aggregate value of a node.
+     *
+     * @param octree
+     * @param location_code
+     * @return const void* value NULL if the tree has no aggregate or there is
+     * no node with that code
+     */
+    OCTREE_API const void* oct_node_get_aggregate(Octree* octree,
+                                                  uint64_t location_code);
+
     /**
      * @brief Init an inner node.
      *
@@ -129,7 +733,7 @@ extern "C"
                                                 uint64_t location_code);
 
     /**
-     * @brief Remove inner node
+     * @brief Remove inner node and give its memory back to the octree's pool.
      * 
      * @param octree The octree the node is part of
      * @param location_code The location_code of the node to be removed 
@@ -137,21 +741,19 @@ extern "C"
     OCTREE_API void oct_branch_node_free(Octree* octree, uint64_t location_code);
 
     /**
-     * @brief Init a leaf node.
+     * @brief Init a leaf node without objects.
      *
      * @param octree
      * @param parent_location
      * @param child_location
-     * @param object_index
      * @return LeafNode* new_node The newly allocated note
      */
     OCTREE_API LeafNode* oct_leaf_node_init(Octree* octree,
                                             uint64_t parent_location,
-                                            uint8_t child_location,
-                                            uint64_t object_index);
+                                            uint8_t child_location);
 
     /**
-     * @brief Remove leaf node
+     * @brief Remove leaf node and give its memory back to the octree's pool.
      * 
      * @param octree The octree the node is part of
      * @param location_code The location_code of the node to be removed 
@@ -171,24 +773,73 @@ extern "C"
                                                   BaseNode* node,
                                                   Position object_position);
 
+    /**
+     * @brief Find the deepest node that contains a position without changing
+     * the tree. This is the leaf holding the position, or the inner node
+     * whose child for the position does not exist.
+     *
+     * The location code of the position is computed once and the depth of
+     * the node is found by bisection with one lookup per step, so this takes
+     * O(log depth) lookups. Safe to call from several threads at once while
+     * the tree is not modified.
+     *
+     * @param octree
+     * @param position
+     * @return BaseNode* node
+     */
+    OCTREE_API BaseNode* oct_point_locate(Octree* octree, Position position);
+
     /**
      * @brief Split a leaf node, change it to an inner node, then create a
-     * child node to hold the object index.
+     * child leaf for every octant that holds some of its objects. The
+     * objects are regrouped by octant inside the leaf's range, so each
+     * child gets a part of that range.
      *
      * @param octree
      * @param node
-     * @return LeafNode* child_node The new child node that holds the
-     * object index
+     * @return BranchNode* inner_node The node that replaced the leaf, NULL if
+     * the leaf is empty, at max_depth or allocation failed. The leaf is then
+     * left in the tree.
+     */
+    OCTREE_API BranchNode* oct_leaf_node_split(Octree* octree,
+                                               LeafNode* node);
+
+    /**
+     * @brief Calculate the location code of the cell at OCT_MAX_DEPTH that
+     * holds a position. The code of the node at depth d that holds the
+     * position is this code shifted right by 3 * (OCT_MAX_DEPTH - d).
+     * Positions outside of the octree are clamped to the nearest cell.
+     *
+     * @param octree
+     * @param position
+     * @return uint64_t location_code
+     */
+    OCTREE_API uint64_t oct_position_get_location_code(Octree* octree,
+                                                       Position position);
+
+    /**
+     * @brief Calculate the location codes of an array of positions, giving
+     * the same codes as oct_position_get_location_code. On x86 CPUs with
+     * AVX2 and BMI2, checked at runtime, four positions are quantized at
+     * once and the bits of the axes are interleaved with PDEP.
+     *
+     * @param octree
+     * @param positions
+     * @param count Number of positions
+     * @param out_codes Receives count location codes
      */
-    OCTREE_API LeafNode* oct_leaf_node_split(Octree* octree,
-                                                  LeafNode* node);
+    OCTREE_API void oct_positions_get_location_codes(Octree* octree,
+                                                     const Position* positions,
+                                                     size_t count,
+                                                     uint64_t* out_codes);
 
     /**
-     * @brief Calculate the position of the node.
+     * @brief Calculate the center of the node. The cell of the node on every
+     * axis is read from the location code, so this takes constant time.
      *
      * @param octree
      * @param node
-     * @return Position positiom Vector 3 of position (x, y, z)
+     * @return Position position The center of the node
      */
     OCTREE_API Position oct_node_get_position(Octree* octree,
                                               BaseNode* node);
@@ -262,13 +913,318 @@ extern "C"
     OCTREE_API size_t oct_octree_get_inner_count(Octree* octree);
 
     /**
-     * @brief visit all octree nodes
+     * @brief Gather the shape, memory use and work counters of the tree. The
+     * nodes are walked, so this costs about as much as a query that visits
+     * all of them; it does not count towards the query counters.
+     *
+     * @param octree
+     * @param stats Receives the statistics
+     */
+    OCTREE_API void oct_octree_get_stats(Octree* octree, OctStats* stats);
+
+    /**
+     * @brief Set the work counters of the tree back to 0, for instance to
+     * measure one frame.
+     *
+     * @param octree
+     */
+    OCTREE_API void oct_octree_reset_counters(Octree* octree);
+
+    /**
+     * @brief Start a walk at the root of the tree.
+     *
+     * @param octree
+     * @return OctCursor cursor
+     */
+    OCTREE_API OctCursor oct_cursor_root(Octree* octree);
+
+    /**
+     * @brief Start a walk at a node of a tree that is not succinct.
      *
      * @param octree
      * @param node
+     * @return OctCursor cursor
+     */
+    OCTREE_API OctCursor oct_cursor_from_node(Octree* octree, BaseNode* node);
+
+    /**
+     * @brief Get the child mask of the node under the cursor.
+     *
+     * @param octree
+     * @param cursor
+     * @return uint8_t child_exists One bit per existing child, 0 for a leaf
+     */
+    OCTREE_API uint8_t oct_cursor_child_exists(Octree* octree,
+                                               const OctCursor* cursor);
+
+    /**
+     * @brief Step into a child of the node under the cursor.
+     *
+     * @param octree
+     * @param cursor
+     * @param child_location Index of the child, see BaseNode
+     * @param child Receives the cursor of the child
+     * @return bool exists false if the node has no such child, child is then
+     * left untouched
+     */
+    OCTREE_API bool oct_cursor_child(Octree* octree, const OctCursor* cursor,
+                                     uint8_t child_location, OctCursor* child);
+
+    /**
+     * @brief Get the objects of the leaf under the cursor.
+     *
+     * @param octree
+     * @param cursor
+     * @param count Receives the number of objects
+     * @return const uint64_t* indices The object indices of the leaf, NULL
+     * with a count of 0 if the node is not a leaf
+     */
+    OCTREE_API const uint64_t* oct_cursor_objects(Octree* octree,
+                                                  const OctCursor* cursor,
+                                                  size_t* count);
+
+    /**
+     * @brief Find all objects inside a view frustum.
+     *
+     * The nodes are tested against all planes at once with SSE. A node
+     * that is completely inside the frustum has all of its objects reported
+     * without testing its children. Objects outside of the bounds of the
+     * octree can be missed.
+     *
+     * @param octree
+     * @param planes The six planes of the frustum, normals pointing inwards
+     * @param out_indices Receives the indices of the objects inside
+     * @param capacity Number of indices out_indices can hold
+     * @return size_t count Number of objects inside the frustum. If this is
+     * larger than capacity only the first capacity indices were written.
+     */
+    OCTREE_API size_t oct_query_frustum(Octree* octree, const Plane planes[6],
+                                        uint64_t* out_indices,
+                                        size_t capacity);
+
+    /**
+     * @brief Find the first object hit by a ray. Objects are treated as
+     * spheres with the given radius.
+     *
+     * The children of a node are visited front to back, in an order picked
+     * from the signs of the ray direction, and nodes the ray enters beyond the
+     * closest hit so far are skipped.
+     *
+     * @param octree
+     * @param ray
+     * @param radius Radius of the objects, 0 for points
+     * @param max_distance Ignore hits further away than this
+     * @param hit Receives the hit object and its distance
+     * @return bool hit_found
+     */
+    OCTREE_API bool oct_query_ray(Octree* octree, Ray ray, float radius,
+                                  float max_distance, RayHit* hit);
+
+    /**
+     * @brief Find the first object hit by each ray of a batch. The rays are
+     * traversed together in packets of 64 that share one walk down the tree,
+     * so they should be coherent (similar origins and directions) for the
+     * packet to pay off.
+     *
+     * @param octree
+     * @param rays
+     * @param ray_count
+     * @param radius Radius of the objects, 0 for points
+     * @param max_distance Ignore hits further away than this
+     * @param hits Receives one hit per ray
+     * @return size_t hit_count Number of rays that hit an object
+     */
+    OCTREE_API size_t oct_query_ray_packet(Octree* octree, const Ray* rays,
+                                           size_t ray_count, float radius,
+                                           float max_distance, RayHit* hits);
+
+    /**
+     * @brief Find the k objects closest to a position.
+     *
+     * Nodes are searched best first from a queue ordered on their distance
+     * to the position, and the search stops once the closest remaining node
+     * is further away than the k-th closest object found so far.
+     *
+     * @param octree
+     * @param position
+     * @param k Number of objects to find
+     * @param out_indices Receives up to k object indices, closest first
+     * @param out_dist2 Receives the squared distance of each object found
+     * @return size_t found Number of objects written, less than k if the
+     * octree holds fewer objects
+     */
+    OCTREE_API size_t oct_query_knn(Octree* octree, Position position,
+                                    size_t k, uint64_t* out_indices,
+                                    float* out_dist2);
+
+    /**
+     * @brief Find all objects inside an axis aligned box, bounds included.
+     * A node that lies completely inside the box has all of its objects
+     * reported without visiting its leaves.
+     *
+     * @param octree
+     * @param min The corner of the box with the lowest coordinates
+     * @param max The corner of the box with the highest coordinates
+     * @param out_indices Receives the indices of the objects inside
+     * @param capacity Number of indices out_indices can hold
+     * @return size_t count Number of objects inside the box. If this is
+     * larger than capacity only the first capacity indices were written.
+     */
+    OCTREE_API size_t oct_query_aabb(Octree* octree, Position min,
+                                     Position max, uint64_t* out_indices,
+                                     size_t capacity);
+
+    /**
+     * @brief Find all objects inside a sphere, surface included. A node that
+     * lies completely inside the sphere has all of its objects reported
+     * without visiting its leaves.
+     *
+     * @param octree
+     * @param center
+     * @param radius
+     * @param out_indices Receives the indices of the objects inside
+     * @param capacity Number of indices out_indices can hold
+     * @return size_t count Number of objects inside the sphere. If this is
+     * larger than capacity only the first capacity indices were written.
+     */
+    OCTREE_API size_t oct_query_sphere(Octree* octree, Position center,
+                                       float radius, uint64_t* out_indices,
+                                       size_t capacity);
+
+    /**
+     * @brief Walk the tree calling pre_visit on every node before its
+     * children and post_visit once everything below it was visited.
+     *
+     * The walk keeps its own stack or queue of cursors and steps into the
+     * children of a node without going back to the root. Depth first visits
+     * the children of a node in the order of their location, which is Morton
+     * order, and needs no memory. Breadth first visits level by level and
+     * calls post_visit for all nodes after the walk, deepest level first.
+     *
+     * @param octree
+     * @param order OCT_VISIT_DEPTH_FIRST or OCT_VISIT_BREADTH_FIRST
+     * @param pre_visit Called when a node is reached, may be NULL.
+     * OCT_VISIT_SKIP leaves out the nodes below it.
+     * @param post_visit Called when a node is done, may be NULL
+     * @param context Passed to the callbacks
+     * @return bool completed false if a callback returned OCT_VISIT_STOP or
+     * the breadth first queue could not grow
+     */
+    OCTREE_API bool oct_octree_visit(Octree* octree, OctVisitOrder order,
+                                     OctVisitCallback pre_visit,
+                                     OctVisitCallback post_visit,
+                                     void* context);
+
+    /**
+     * @brief Approximate the gravitational acceleration of every object in
+     * the tree with the Barnes-Hut method.
+     *
+     * The mass and center of mass of every node are computed bottom-up first.
+     * Each object then walks the tree and takes a node that does not hold it
+     * as a single body when the cell width is less than theta times the
+     * distance to its center of mass. Otherwise it opens the node, down to
+     * the objects of the leaves. Objects are spread over the threads leaf by
+     * leaf, so the objects of one thread walk similar paths. The gravitational
+     * constant is 1 and there is no softening: objects at the same position
+     * do not pull on each other.
+     *
+     * @param octree
+     * @param masses Mass of every object, indexed like the positions
+     * @param theta Opening angle, 0 gives the exact sum. Around 0.5 is common.
+     * @param out_acc Receives the acceleration of every object in the tree.
+     * Entries of indices that are not in the tree are left as they are.
+     * @return bool computed false if allocation failed
+     */
+    OCTREE_API bool oct_nbody_accelerations(Octree* octree,
+                                            const float* masses, float theta,
+                                            Position* out_acc);
+
+    /**
+     * @brief Start keeping versions of an octree, with octree as the current
+     * one.
+     *
+     * Readers pin the current version and query it without any lock, while
+     * one writer thread builds the next version and publishes it. Replaced
+     * versions are reclaimed by epoch: a pin announces the epoch it started
+     * in, and a replaced version is only freed or reused once no reader
+     * pinned before it was replaced. A version keeps pointing at the
+     * positions it was built from, so the writer must not change those
+     * while the version can still be pinned.
+     *
+     * @param octree The first version, the snapshots take ownership of it
+     * @return OctSnapshots* snapshots NULL if the allocation failed
+     */
+    OCTREE_API OctSnapshots* oct_snapshots_init(Octree* octree);
+
+    /**
+     * @brief Free the snapshots and every version they hold. No reader may
+     * have a snapshot pinned.
+     *
+     * @param snapshots
+     */
+    OCTREE_API void oct_snapshots_free(OctSnapshots* snapshots);
+
+    /**
+     * @brief Claim a reader slot for the calling thread. Thread safe.
+     *
+     * @param snapshots
+     * @return int reader The slot to pin with, -1 if all
+     * OCT_SNAPSHOT_MAX_READERS slots are taken
+     */
+    OCTREE_API int oct_snapshots_register_reader(OctSnapshots* snapshots);
+
+    /**
+     * @brief Give a reader slot back. Unpins the snapshot it held.
+     *
+     * @param snapshots
+     * @param reader
+     */
+    OCTREE_API void oct_snapshots_unregister_reader(OctSnapshots* snapshots,
+                                                    int reader);
+
+    /**
+     * @brief Pin the current version. It stays valid and unchanged until
+     * oct_snapshot_unpin, whatever the writer publishes meanwhile. Only the
+     * queries, cursors, visits and lookups may be used on it. A reader
+     * holds one pin at a time.
+     *
+     * @param snapshots
+     * @param reader A slot from oct_snapshots_register_reader
+     * @return Octree* octree The pinned version
+     */
+    OCTREE_API Octree* oct_snapshot_pin(OctSnapshots* snapshots, int reader);
+
+    /**
+     * @brief Let go of the pinned version.
+     *
+     * @param snapshots
+     * @param reader
+     */
+    OCTREE_API void oct_snapshot_unpin(OctSnapshots* snapshots, int reader);
+
+    /**
+     * @brief Get a tree for the writer to build the next version in. This is
+     * a replaced version no reader holds any more, so building alternates
+     * between two trees and reuses their memory, or a new empty tree with the
+     * bounds and settings of the current version. Only one thread may write.
+     *
+     * @param snapshots
+     * @return Octree* octree NULL if the allocation failed
+     */
+    OCTREE_API Octree* oct_snapshots_next(OctSnapshots* snapshots);
+
+    /**
+     * @brief Make octree the current version. Readers that pin from now on
+     * get it; the replaced version is reclaimed once its readers unpinned.
+     * The writer must not change octree after publishing it.
+     *
+     * @param snapshots
+     * @param octree A tree from oct_snapshots_next
+     * @return bool published false if allocation failed, the current
+     * version then stays
      */
-    OCTREE_API void oct_visit_all(Octree* octree,
-                                  BaseNode* node);
+    OCTREE_API bool oct_snapshots_publish(OctSnapshots* snapshots,
+                                          Octree* octree);
 
 #ifdef __cplusplus
 }
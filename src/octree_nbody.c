@@ -0,0 +1,250 @@
+#include "octree.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// A walk holds at most the node it is in and seven siblings still to visit
+// on every level.
+#define OCT_NBODY_STACK (8 * (OCT_MAX_DEPTH + 1))
+#define OCT_NBODY_MIN_NODES 1024
+#define OCT_NBODY_PARALLEL_MIN 256
+
+/**
+ * @brief The monopole of a node. The nodes are stored in level order, so the
+ * children of a node lie next to each other after it.
+ */
+typedef struct _OctNBodyNode
+{
+    double mass;
+    double x;
+    double y;
+    double z;
+    double width2;
+    uint64_t location_code;
+    const uint64_t* objects;
+    size_t object_count;
+    size_t first_child;
+    uint32_t child_count;
+    int depth;
+} OctNBodyNode;
+
+/**
+ * @brief List the nodes in level order with cursors, which works on every
+ * form of the tree.
+ */
+static OctNBodyNode*
+oct_nbody_list_nodes(Octree* octree, size_t* node_count)
+{
+    size_t capacity = OCT_NBODY_MIN_NODES;
+    OctCursor* cursors = malloc(capacity * sizeof *cursors);
+    OctNBodyNode* nodes = malloc(capacity * sizeof *nodes);
+    if (cursors == NULL || nodes == NULL) {
+        free(cursors);
+        free(nodes);
+        return NULL;
+    }
+
+    size_t count = 1;
+    cursors[0] = oct_cursor_root(octree);
+    for (size_t i = 0; i < count; i++) {
+        OctCursor cursor = cursors[i];
+        uint8_t child_exists = oct_cursor_child_exists(octree, &cursor);
+        OctNBodyNode* node = &nodes[i];
+        node->location_code = cursor.location_code;
+        node->depth = cursor.depth;
+        node->width2 = 4.0 * cursor.half_size * cursor.half_size;
+        node->objects =
+            oct_cursor_objects(octree, &cursor, &node->object_count);
+        node->first_child = count;
+        node->child_count = 0;
+
+        for (uint8_t child = 0; child < 8; child++) {
+            if (!(child_exists & (1u << child))) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                OctCursor* grown_cursors =
+                    realloc(cursors, capacity * sizeof *grown_cursors);
+                cursors = grown_cursors != NULL ? grown_cursors : cursors;
+                OctNBodyNode* grown_nodes =
+                    realloc(nodes, capacity * sizeof *grown_nodes);
+                nodes = grown_nodes != NULL ? grown_nodes : nodes;
+                if (grown_cursors == NULL || grown_nodes == NULL) {
+                    free(cursors);
+                    free(nodes);
+                    return NULL;
+                }
+                node = &nodes[i];
+            }
+            oct_cursor_child(octree, &cursor, child, &cursors[count++]);
+            node->child_count++;
+        }
+    }
+
+    free(cursors);
+    *node_count = count;
+    return nodes;
+}
+
+/**
+ * @brief Sum up the mass and center of mass of every node, from the deepest
+ * level up so the children of a node are done before it. The nodes of one
+ * level are summed in parallel.
+ */
+static void
+oct_nbody_sum_masses(Octree* octree, const float* masses,
+                     OctNBodyNode* nodes, size_t node_count)
+{
+    size_t end = node_count;
+    while (end > 0) {
+        size_t begin = end - 1;
+        while (begin > 0 && nodes[begin - 1].depth == nodes[end - 1].depth) {
+            begin--;
+        }
+
+        // The center of mass stays a mass weighted sum until the end, so
+        // the children can be added up as they are.
+        size_t i;
+        #pragma omp parallel for schedule(dynamic, 64) \
+            if (end - begin >= OCT_NBODY_PARALLEL_MIN)
+        for (i = begin; i < end; i++) {
+            OctNBodyNode* node = &nodes[i];
+            double mass = 0, x = 0, y = 0, z = 0;
+            for (size_t j = 0; j < node->object_count; j++) {
+                uint64_t object = node->objects[j];
+                Position position = octree->object_positions[object];
+                mass += masses[object];
+                x += (double)masses[object] * position.x;
+                y += (double)masses[object] * position.y;
+                z += (double)masses[object] * position.z;
+            }
+            for (uint32_t j = 0; j < node->child_count; j++) {
+                const OctNBodyNode* child = &nodes[node->first_child + j];
+                mass += child->mass;
+                x += child->x;
+                y += child->y;
+                z += child->z;
+            }
+            node->mass = mass;
+            node->x = x;
+            node->y = y;
+            node->z = z;
+        }
+        end = begin;
+    }
+
+    size_t i;
+    #pragma omp parallel for if (node_count >= OCT_NBODY_PARALLEL_MIN)
+    for (i = 0; i < node_count; i++) {
+        if (nodes[i].mass != 0) {
+            nodes[i].x /= nodes[i].mass;
+            nodes[i].y /= nodes[i].mass;
+            nodes[i].z /= nodes[i].mass;
+        }
+    }
+}
+
+/**
+ * @brief Add the pull of a body at (x, y, z) to an acceleration.
+ */
+static inline void
+oct_nbody_pull(double acc[3], Position position, double mass, double x,
+               double y, double z)
+{
+    double dx = x - position.x;
+    double dy = y - position.y;
+    double dz = z - position.z;
+    double distance2 = dx * dx + dy * dy + dz * dz;
+    if (distance2 == 0) {
+        return;
+    }
+
+    double scale = mass / (distance2 * sqrt(distance2));
+    acc[0] += dx * scale;
+    acc[1] += dy * scale;
+    acc[2] += dz * scale;
+}
+
+/**
+ * @brief Walk the tree for one object. A node is opened when it holds the
+ * object, which its location code tells, or when it is too close for its
+ * width.
+ */
+static Position
+oct_nbody_acceleration(Octree* octree, const float* masses,
+                       const OctNBodyNode* nodes, double theta2,
+                       uint64_t object_index)
+{
+    Position position = octree->object_positions[object_index];
+    uint64_t code = oct_position_get_location_code(octree, position);
+    double acc[3] = {0, 0, 0};
+
+    size_t stack[OCT_NBODY_STACK];
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const OctNBodyNode* node = &nodes[stack[--top]];
+        if (node->mass == 0) {
+            continue;
+        }
+
+        bool holds_object = code >> (3 * (OCT_MAX_DEPTH - node->depth)) ==
+                            node->location_code;
+        if (!holds_object) {
+            double dx = node->x - position.x;
+            double dy = node->y - position.y;
+            double dz = node->z - position.z;
+            if (node->width2 < theta2 * (dx * dx + dy * dy + dz * dz)) {
+                oct_nbody_pull(acc, position, node->mass, node->x, node->y,
+                               node->z);
+                continue;
+            }
+        }
+
+        for (size_t j = 0; j < node->object_count; j++) {
+            uint64_t other = node->objects[j];
+            if (other != object_index) {
+                Position other_position = octree->object_positions[other];
+                oct_nbody_pull(acc, position, masses[other], other_position.x,
+                               other_position.y, other_position.z);
+            }
+        }
+        for (uint32_t j = node->child_count; j > 0; j--) {
+            stack[top++] = node->first_child + j - 1;
+        }
+    }
+
+    Position acceleration = {(float)acc[0], (float)acc[1], (float)acc[2]};
+    return acceleration;
+}
+
+bool
+oct_nbody_accelerations(Octree* octree, const float* masses, float theta,
+                        Position* out_acc)
+{
+    size_t node_count = 0;
+    OctNBodyNode* nodes = oct_nbody_list_nodes(octree, &node_count);
+    if (nodes == NULL) {
+        return false;
+    }
+    oct_nbody_sum_masses(octree, masses, nodes, node_count);
+
+    // The objects of a leaf are near each other and open mostly the same
+    // nodes, so the work is handed out leaf by leaf.
+    double theta2 = (double)theta * theta;
+    size_t i;
+    #pragma omp parallel for schedule(dynamic, 16) \
+        if (node_count >= OCT_NBODY_PARALLEL_MIN)
+    for (i = 0; i < node_count; i++) {
+        const OctNBodyNode* leaf = &nodes[i];
+        for (size_t j = 0; j < leaf->object_count; j++) {
+            uint64_t object = leaf->objects[j];
+            out_acc[object] =
+                oct_nbody_acceleration(octree, masses, nodes, theta2, object);
+        }
+    }
+
+    free(nodes);
+    return true;
+}
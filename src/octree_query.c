@@ -0,0 +1,1328 @@
+#include "octree.h"
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OCT_SIMD_SSE
+#endif
+
+#define OCT_FRUSTUM_PLANES 8
+#define OCT_RAY_PACKET_SIZE 64
+#define OCT_KNN_LOCAL_QUEUE 256
+
+// A depth first walk holds at most the node it is in and seven siblings still
+// to visit on every level.
+#define OCT_VISIT_STACK (8 * (OCT_MAX_DEPTH + 1))
+#define OCT_VISIT_MIN_QUEUE 64
+
+#define OCT_OUTSIDE 0
+#define OCT_INTERSECTS 1
+#define OCT_INSIDE 2
+
+/**
+ * @brief Collects the object indices of a query. Indices past the capacity
+ * are counted but not written, so the caller can size the next call.
+ */
+typedef struct _OctQueryResult
+{
+    uint64_t* indices;
+    size_t capacity;
+    size_t count;
+} OctQueryResult;
+
+/**
+ * @brief The frustum planes in structure of arrays layout, padded to eight
+ * planes with planes that contain everything so two SSE passes test a box
+ * against all of them.
+ */
+typedef struct _OctFrustum
+{
+    float a[OCT_FRUSTUM_PLANES];
+    float b[OCT_FRUSTUM_PLANES];
+    float c[OCT_FRUSTUM_PLANES];
+    float d[OCT_FRUSTUM_PLANES];
+    float extent[OCT_FRUSTUM_PLANES];
+} OctFrustum;
+
+#ifndef OCT_NO_STATS
+/**
+ * @brief The work of the queries running on this thread. It is added to the
+ * counters of the tree once a query is done, so threads querying the same
+ * tree only meet there once per query.
+ */
+static _Thread_local OctCounters oct_query_counts;
+
+#define OCT_QUERY_COUNT(counter) (oct_query_counts.counter++)
+#else
+#define OCT_QUERY_COUNT(counter) ((void)0)
+#endif
+
+static inline void
+oct_counter_add(uint64_t* counter, uint64_t amount)
+{
+#if defined(_MSC_VER)
+    _InterlockedExchangeAdd64((volatile __int64*)counter, (__int64)amount);
+#else
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline uint64_t
+oct_counter_load(const uint64_t* counter)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)*(const volatile __int64*)counter;
+#else
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * @brief Start counting the work of a query from zero, dropping any cursor
+ * steps taken on this thread outside a query, such as computing aggregates
+ * or an n-body pass.
+ */
+static inline void
+oct_query_begin(void)
+{
+#ifndef OCT_NO_STATS
+    oct_query_counts.nodes_visited = 0;
+    oct_query_counts.lookups = 0;
+#endif
+}
+
+/**
+ * @brief Add the work of query_count finished queries to the tree. Each of
+ * them started at the root, which is visited without a step.
+ */
+static inline void
+oct_query_finish(Octree* octree, size_t query_count)
+{
+#ifndef OCT_NO_STATS
+    oct_counter_add(&octree->counters.queries, query_count);
+    oct_counter_add(&octree->counters.nodes_visited,
+                    oct_query_counts.nodes_visited + query_count);
+    oct_counter_add(&octree->counters.lookups, oct_query_counts.lookups);
+    oct_query_counts.nodes_visited = 0;
+    oct_query_counts.lookups = 0;
+#else
+    (void)octree;
+    (void)query_count;
+#endif
+}
+
+static inline void
+oct_query_result_add(OctQueryResult* result, uint64_t object_index)
+{
+    if (result->count < result->capacity) {
+        result->indices[result->count] = object_index;
+    }
+    result->count++;
+}
+
+static inline Position
+oct_query_child_center(Position center, float quarter, uint8_t child)
+{
+    center.x += child & 0b001 ? quarter : -quarter;
+    center.y += child & 0b010 ? quarter : -quarter;
+    center.z += child & 0b100 ? quarter : -quarter;
+    return center;
+}
+
+OctCursor
+oct_cursor_root(Octree* octree)
+{
+    OctCursor cursor;
+    cursor.node = octree->root_node;
+    cursor.index = 0;
+    cursor.location_code = 0b1;
+    cursor.center = octree->position;
+    cursor.half_size = (float)octree->size;
+    cursor.depth = 0;
+    return cursor;
+}
+
+OctCursor
+oct_cursor_from_node(Octree* octree, BaseNode* node)
+{
+    OctCursor cursor;
+    cursor.node = node;
+    cursor.index = 0;
+    cursor.location_code = node->location_code;
+    cursor.center = oct_node_get_position(octree, node);
+    cursor.depth = (int)oct_node_get_tree_depth(octree, node);
+    cursor.half_size =
+        (float)((double)octree->size / (double)(1ull << cursor.depth));
+    return cursor;
+}
+
+uint8_t
+oct_cursor_child_exists(Octree* octree, const OctCursor* cursor)
+{
+    if (octree->succinct != NULL) {
+        return octree->succinct->child_exists[cursor->index];
+    }
+    if (cursor->node->type == LEAF_NODE) {
+        return 0;
+    }
+    return ((const BranchNode*)cursor->node)->child_exists;
+}
+
+/**
+ * @brief Step into a child that is known to exist.
+ */
+static inline void
+oct_cursor_step(Octree* octree, const OctCursor* cursor,
+                uint8_t child_location, OctCursor* child)
+{
+    OCT_QUERY_COUNT(nodes_visited);
+    if (octree->succinct != NULL) {
+        child->node = NULL;
+        child->index = succinct_tree_child(octree->succinct, cursor->index,
+                                           child_location);
+    } else {
+        OCT_QUERY_COUNT(lookups);
+        child->node = oct_node_get_child(octree, cursor->location_code,
+                                         child_location);
+        child->index = 0;
+    }
+    child->location_code = cursor->location_code << 3 | child_location;
+    child->half_size = cursor->half_size * 0.5f;
+    child->center = oct_query_child_center(cursor->center, child->half_size,
+                                           child_location);
+    child->depth = cursor->depth + 1;
+}
+
+bool
+oct_cursor_child(Octree* octree, const OctCursor* cursor,
+                 uint8_t child_location, OctCursor* child)
+{
+    if (child_location >= 8 ||
+        !(oct_cursor_child_exists(octree, cursor) & (1u << child_location))) {
+        return false;
+    }
+
+    oct_cursor_step(octree, cursor, child_location, child);
+    return true;
+}
+
+const uint64_t*
+oct_cursor_objects(Octree* octree, const OctCursor* cursor, size_t* count)
+{
+    if (oct_cursor_child_exists(octree, cursor) != 0) {
+        *count = 0;
+        return NULL;
+    }
+
+    if (octree->succinct != NULL) {
+        const succinct_tree* tree = octree->succinct;
+        size_t leaf = succinct_tree_leaf(tree, cursor->index);
+        uint64_t offset = tree->leaf_offsets[leaf];
+        *count = (size_t)(tree->leaf_offsets[leaf + 1] - offset);
+        return octree->object_indices + offset;
+    }
+
+    const LeafNode* leaf = (const LeafNode*)cursor->node;
+    *count = leaf->object_count;
+    return octree->object_indices + leaf->object_offset;
+}
+
+/**
+ * @brief Report every object below node without testing anything.
+ */
+static void
+oct_query_collect(Octree* octree, const OctCursor* cursor,
+                  OctQueryResult* result)
+{
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    if (child_exists == 0) {
+        size_t count;
+        const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+        for (size_t i = 0; i < count; i++) {
+            oct_query_result_add(result, objects[i]);
+        }
+        return;
+    }
+
+    for (uint8_t child = 0; child < 8; child++) {
+        if (child_exists & (1u << child)) {
+            OctCursor child_cursor;
+            oct_cursor_step(octree, cursor, child, &child_cursor);
+            oct_query_collect(octree, &child_cursor, result);
+        }
+    }
+}
+
+/**
+ * @brief Classify a cube against all frustum planes at once. A point is a cube
+ * with a half size of 0, which is inside or outside but never intersecting.
+ */
+static inline int
+oct_frustum_classify(const OctFrustum* frustum, Position center, float half)
+{
+#if defined(OCT_SIMD_SSE)
+    __m128 x = _mm_set1_ps(center.x);
+    __m128 y = _mm_set1_ps(center.y);
+    __m128 z = _mm_set1_ps(center.z);
+    __m128 h = _mm_set1_ps(half);
+
+    int outside = 0;
+    int inside = 0;
+    for (int i = 0; i < OCT_FRUSTUM_PLANES; i += 4) {
+        __m128 distance = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(frustum->a + i), x),
+                       _mm_mul_ps(_mm_load_ps(frustum->b + i), y)),
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(frustum->c + i), z),
+                       _mm_load_ps(frustum->d + i)));
+        __m128 radius = _mm_mul_ps(_mm_load_ps(frustum->extent + i), h);
+
+        outside |= _mm_movemask_ps(
+            _mm_cmplt_ps(distance, _mm_sub_ps(_mm_setzero_ps(), radius)));
+        inside |= _mm_movemask_ps(_mm_cmpge_ps(distance, radius)) << i;
+    }
+
+    if (outside) {
+        return OCT_OUTSIDE;
+    }
+    return inside == 0xff ? OCT_INSIDE : OCT_INTERSECTS;
+#else
+    int result = OCT_INSIDE;
+    for (int i = 0; i < OCT_FRUSTUM_PLANES; i++) {
+        float distance = frustum->a[i] * center.x + frustum->b[i] * center.y +
+                         frustum->c[i] * center.z + frustum->d[i];
+        float radius = frustum->extent[i] * half;
+        if (distance < -radius) {
+            return OCT_OUTSIDE;
+        }
+        if (distance < radius) {
+            result = OCT_INTERSECTS;
+        }
+    }
+    return result;
+#endif
+}
+
+static void
+oct_frustum_visit(Octree* octree, const OctFrustum* frustum,
+                  const OctCursor* cursor, OctQueryResult* result)
+{
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    if (child_exists == 0) {
+        size_t count;
+        const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+        for (size_t i = 0; i < count; i++) {
+            Position position = octree->object_positions[objects[i]];
+            if (oct_frustum_classify(frustum, position, 0.0f) == OCT_INSIDE) {
+                oct_query_result_add(result, objects[i]);
+            }
+        }
+        return;
+    }
+
+    float child_half = cursor->half_size * 0.5f;
+    for (uint8_t child = 0; child < 8; child++) {
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        Position child_center =
+            oct_query_child_center(cursor->center, child_half, child);
+        int classification =
+            oct_frustum_classify(frustum, child_center, child_half);
+        if (classification == OCT_OUTSIDE) {
+            continue;
+        }
+
+        OctCursor child_cursor;
+        oct_cursor_step(octree, cursor, child, &child_cursor);
+        if (classification == OCT_INSIDE) {
+            oct_query_collect(octree, &child_cursor, result);
+        } else {
+            oct_frustum_visit(octree, frustum, &child_cursor, result);
+        }
+    }
+}
+
+size_t
+oct_query_frustum(Octree* octree, const Plane planes[6],
+                  uint64_t* out_indices, size_t capacity)
+{
+#if defined(_MSC_VER)
+    __declspec(align(16)) OctFrustum frustum;
+#else
+    OctFrustum frustum __attribute__((aligned(16)));
+#endif
+    for (int i = 0; i < OCT_FRUSTUM_PLANES; i++) {
+        Plane plane = i < 6 ? planes[i] : (Plane){0.0f, 0.0f, 0.0f, 1.0f};
+        frustum.a[i] = plane.a;
+        frustum.b[i] = plane.b;
+        frustum.c[i] = plane.c;
+        frustum.d[i] = plane.d;
+        frustum.extent[i] = fabsf(plane.a) + fabsf(plane.b) + fabsf(plane.c);
+    }
+
+    OctQueryResult result = {out_indices, capacity, 0};
+    oct_query_begin();
+    OctCursor root = oct_cursor_root(octree);
+    int classification =
+        oct_frustum_classify(&frustum, root.center, root.half_size);
+    if (classification == OCT_INSIDE) {
+        oct_query_collect(octree, &root, &result);
+    } else if (classification == OCT_INTERSECTS) {
+        oct_frustum_visit(octree, &frustum, &root, &result);
+    }
+
+    oct_query_finish(octree, 1);
+    return result.count;
+}
+
+/**
+ * @brief A ray prepared for traversal: unit direction, its reciprocal and the
+ * octant order in which children are visited front to back.
+ */
+typedef struct _OctRay
+{
+    Position origin;
+    Position direction;
+    Position inverse;
+    uint8_t order_mask;
+} OctRay;
+
+static OctRay
+oct_ray_prepare(Ray ray)
+{
+    OctRay prepared;
+    Position d = ray.direction;
+    float length = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    if (length > 0.0f) {
+        d.x /= length;
+        d.y /= length;
+        d.z /= length;
+    }
+
+    prepared.origin = ray.origin;
+    prepared.direction = d;
+    prepared.inverse.x = 1.0f / d.x;
+    prepared.inverse.y = 1.0f / d.y;
+    prepared.inverse.z = 1.0f / d.z;
+    prepared.order_mask = (d.x < 0.0f ? 0b001 : 0) |
+                          (d.y < 0.0f ? 0b010 : 0) |
+                          (d.z < 0.0f ? 0b100 : 0);
+    return prepared;
+}
+
+/**
+ * @brief Slab test of a ray against a cube. Returns the distance at which
+ * the ray enters the cube, or INFINITY if it misses it before max_distance.
+ */
+static inline float
+oct_ray_enter_cube(const OctRay* ray, Position center, float half,
+                   float max_distance)
+{
+    float t1 = (center.x - half - ray->origin.x) * ray->inverse.x;
+    float t2 = (center.x + half - ray->origin.x) * ray->inverse.x;
+    float enter = fminf(t1, t2);
+    float leave = fmaxf(t1, t2);
+
+    t1 = (center.y - half - ray->origin.y) * ray->inverse.y;
+    t2 = (center.y + half - ray->origin.y) * ray->inverse.y;
+    enter = fmaxf(enter, fminf(t1, t2));
+    leave = fminf(leave, fmaxf(t1, t2));
+
+    t1 = (center.z - half - ray->origin.z) * ray->inverse.z;
+    t2 = (center.z + half - ray->origin.z) * ray->inverse.z;
+    enter = fmaxf(enter, fminf(t1, t2));
+    leave = fminf(leave, fmaxf(t1, t2));
+
+    enter = fmaxf(enter, 0.0f);
+    if (enter > leave || enter > max_distance) {
+        return INFINITY;
+    }
+    return enter;
+}
+
+/**
+ * @brief Distance at which the ray enters the sphere around an object, 0 if
+ * it starts inside, INFINITY if it misses.
+ */
+static inline float
+oct_ray_enter_sphere(const OctRay* ray, Position position, float radius)
+{
+    float mx = ray->origin.x - position.x;
+    float my = ray->origin.y - position.y;
+    float mz = ray->origin.z - position.z;
+    float b = mx * ray->direction.x + my * ray->direction.y +
+              mz * ray->direction.z;
+    float c = mx * mx + my * my + mz * mz - radius * radius;
+    if (c > 0.0f && b > 0.0f) {
+        return INFINITY;
+    }
+
+    float discriminant = b * b - c;
+    if (discriminant < 0.0f) {
+        return INFINITY;
+    }
+
+    return fmaxf(-b - sqrtf(discriminant), 0.0f);
+}
+
+static inline void
+oct_ray_test_leaf(Octree* octree, const OctRay* ray, const uint64_t* objects,
+                  size_t count, float radius, RayHit* hit)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint64_t object_index = objects[i];
+        float distance = oct_ray_enter_sphere(
+            ray, octree->object_positions[object_index], radius);
+        // A miss is infinitely far, which ties with an unbounded ray.
+        if (!isfinite(distance)) {
+            continue;
+        }
+        if (distance < hit->distance ||
+            (distance == hit->distance && object_index < hit->object_index)) {
+            hit->distance = distance;
+            hit->object_index = object_index;
+        }
+    }
+}
+
+/**
+ * @brief Visit the children front to back. The cubes are grown by the object
+ * radius, so a later child can still hold a closer hit; it is only skipped once
+ * the ray enters it beyond the closest hit found so far.
+ */
+static void
+oct_ray_visit(Octree* octree, const OctRay* ray, const OctCursor* cursor,
+              float radius, RayHit* hit)
+{
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    if (child_exists == 0) {
+        size_t count;
+        const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+        oct_ray_test_leaf(octree, ray, objects, count, radius, hit);
+        return;
+    }
+
+    float child_half = cursor->half_size * 0.5f;
+    for (uint8_t i = 0; i < 8; i++) {
+        uint8_t child = i ^ ray->order_mask;
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        Position child_center =
+            oct_query_child_center(cursor->center, child_half, child);
+        float enter = oct_ray_enter_cube(ray, child_center,
+                                         child_half + radius, hit->distance);
+        if (enter == INFINITY) {
+            continue;
+        }
+
+        OctCursor child_cursor;
+        oct_cursor_step(octree, cursor, child, &child_cursor);
+        oct_ray_visit(octree, ray, &child_cursor, radius, hit);
+    }
+}
+
+bool
+oct_query_ray(Octree* octree, Ray ray, float radius, float max_distance,
+              RayHit* hit)
+{
+    OctRay prepared = oct_ray_prepare(ray);
+    hit->object_index = ULLONG_MAX;
+    hit->distance = max_distance;
+
+    oct_query_begin();
+    OctCursor root = oct_cursor_root(octree);
+    if (oct_ray_enter_cube(&prepared, root.center, root.half_size + radius,
+                           max_distance) != INFINITY) {
+        oct_ray_visit(octree, &prepared, &root, radius, hit);
+    }
+
+    oct_query_finish(octree, 1);
+    if (hit->object_index == ULLONG_MAX) {
+        hit->distance = INFINITY;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief A packet of rays that walk the tree together. Each level only passes
+ * on the rays that enter the child before their own closest hit.
+ */
+typedef struct _OctRayPacket
+{
+    OctRay rays[OCT_RAY_PACKET_SIZE];
+    RayHit* hits;
+    float radius;
+    uint8_t order_mask;
+} OctRayPacket;
+
+static void
+oct_ray_packet_visit(Octree* octree, OctRayPacket* packet,
+                     const OctCursor* cursor, const uint8_t* active,
+                     size_t active_count)
+{
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    if (child_exists == 0) {
+        size_t count;
+        const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+        for (size_t i = 0; i < active_count; i++) {
+            oct_ray_test_leaf(octree, &packet->rays[active[i]], objects,
+                              count, packet->radius,
+                              &packet->hits[active[i]]);
+        }
+        return;
+    }
+
+    float child_half = cursor->half_size * 0.5f;
+    float grown_half = child_half + packet->radius;
+    uint8_t child_active[OCT_RAY_PACKET_SIZE];
+    for (uint8_t i = 0; i < 8; i++) {
+        uint8_t child = i ^ packet->order_mask;
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        Position child_center =
+            oct_query_child_center(cursor->center, child_half, child);
+        size_t child_count = 0;
+        for (size_t j = 0; j < active_count; j++) {
+            uint8_t ray = active[j];
+            if (oct_ray_enter_cube(&packet->rays[ray], child_center,
+                                   grown_half, packet->hits[ray].distance) !=
+                INFINITY) {
+                child_active[child_count++] = ray;
+            }
+        }
+
+        if (child_count > 0) {
+            OctCursor child_cursor;
+            oct_cursor_step(octree, cursor, child, &child_cursor);
+            oct_ray_packet_visit(octree, packet, &child_cursor, child_active,
+                                 child_count);
+        }
+    }
+}
+
+size_t
+oct_query_ray_packet(Octree* octree, const Ray* rays, size_t ray_count,
+                     float radius, float max_distance, RayHit* hits)
+{
+    OctRayPacket packet;
+    packet.radius = radius;
+
+    size_t hit_count = 0;
+    oct_query_begin();
+    OctCursor root = oct_cursor_root(octree);
+    for (size_t first = 0; first < ray_count; first += OCT_RAY_PACKET_SIZE) {
+        size_t count = ray_count - first < OCT_RAY_PACKET_SIZE
+            ? ray_count - first
+            : OCT_RAY_PACKET_SIZE;
+        packet.hits = hits + first;
+
+        uint8_t active[OCT_RAY_PACKET_SIZE];
+        size_t active_count = 0;
+        for (size_t i = 0; i < count; i++) {
+            packet.rays[i] = oct_ray_prepare(rays[first + i]);
+            packet.hits[i].object_index = ULLONG_MAX;
+            packet.hits[i].distance = max_distance;
+            if (oct_ray_enter_cube(&packet.rays[i], root.center,
+                                   root.half_size + radius,
+                                   max_distance) != INFINITY) {
+                active[active_count++] = (uint8_t)i;
+            }
+        }
+
+        // Coherent rays share their octant order; the first ray decides it.
+        packet.order_mask = packet.rays[0].order_mask;
+        if (active_count > 0) {
+            oct_ray_packet_visit(octree, &packet, &root, active,
+                                 active_count);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (packet.hits[i].object_index == ULLONG_MAX) {
+                packet.hits[i].distance = INFINITY;
+            } else {
+                hit_count++;
+            }
+        }
+    }
+
+    oct_query_finish(octree, ray_count);
+    return hit_count;
+}
+
+/**
+ * @brief A node waiting in the best-first queue of a nearest neighbour search,
+ * keyed on the squared distance from the query point to its cube.
+ */
+typedef struct _OctKnnEntry
+{
+    float distance2;
+    OctCursor cursor;
+} OctKnnEntry;
+
+typedef struct _OctKnnQueue
+{
+    OctKnnEntry* entries;
+    size_t count;
+    size_t capacity;
+    OctKnnEntry local[OCT_KNN_LOCAL_QUEUE];
+} OctKnnQueue;
+
+static inline float
+oct_cube_distance2(Position point, Position center, float half)
+{
+    float dx = fmaxf(fabsf(point.x - center.x) - half, 0.0f);
+    float dy = fmaxf(fabsf(point.y - center.y) - half, 0.0f);
+    float dz = fmaxf(fabsf(point.z - center.z) - half, 0.0f);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static inline float
+oct_point_distance2(Position a, Position b)
+{
+    float dx = a.x - b.x;
+    float dy = a.y - b.y;
+    float dz = a.z - b.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static bool
+oct_knn_queue_push(OctKnnQueue* queue, OctKnnEntry entry)
+{
+    if (queue->count == queue->capacity) {
+        size_t capacity = 2 * queue->capacity;
+        OctKnnEntry* entries;
+        if (queue->entries == queue->local) {
+            entries = malloc(capacity * sizeof *entries);
+            if (entries != NULL) {
+                memcpy(entries, queue->local, sizeof queue->local);
+            }
+        } else {
+            entries = realloc(queue->entries, capacity * sizeof *entries);
+        }
+        if (entries == NULL) {
+            return false;
+        }
+        queue->entries = entries;
+        queue->capacity = capacity;
+    }
+
+    size_t i = queue->count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (queue->entries[parent].distance2 <= entry.distance2) {
+            break;
+        }
+        queue->entries[i] = queue->entries[parent];
+        i = parent;
+    }
+    queue->entries[i] = entry;
+    return true;
+}
+
+static OctKnnEntry
+oct_knn_queue_pop(OctKnnQueue* queue)
+{
+    OctKnnEntry top = queue->entries[0];
+    OctKnnEntry last = queue->entries[--queue->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->count) {
+            break;
+        }
+        if (child + 1 < queue->count &&
+            queue->entries[child + 1].distance2 <
+                queue->entries[child].distance2) {
+            child++;
+        }
+        if (last.distance2 <= queue->entries[child].distance2) {
+            break;
+        }
+        queue->entries[i] = queue->entries[child];
+        i = child;
+    }
+    queue->entries[i] = last;
+    return top;
+}
+
+/**
+ * @brief Order of the bounded result heap: further away first, and the
+ * higher index first between objects at the same distance.
+ */
+static inline bool
+oct_knn_further(float distance_a, uint64_t index_a, float distance_b,
+                uint64_t index_b)
+{
+    return distance_a > distance_b ||
+           (distance_a == distance_b && index_a > index_b);
+}
+
+static void
+oct_knn_sift_down(uint64_t* indices, float* distances, size_t count,
+                  size_t i)
+{
+    uint64_t index = indices[i];
+    float distance = distances[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count &&
+            oct_knn_further(distances[child + 1], indices[child + 1],
+                            distances[child], indices[child])) {
+            child++;
+        }
+        if (!oct_knn_further(distances[child], indices[child], distance,
+                             index)) {
+            break;
+        }
+        indices[i] = indices[child];
+        distances[i] = distances[child];
+        i = child;
+    }
+    indices[i] = index;
+    distances[i] = distance;
+}
+
+/**
+ * @brief Offer an object to the k best so far, kept as a max-heap in the
+ * output arrays.
+ */
+static void
+oct_knn_offer(uint64_t* indices, float* distances, size_t* count, size_t k,
+              uint64_t object_index, float distance2)
+{
+    if (*count < k) {
+        size_t i = (*count)++;
+        while (i > 0) {
+            size_t parent = (i - 1) / 2;
+            if (!oct_knn_further(distance2, object_index, distances[parent],
+                                 indices[parent])) {
+                break;
+            }
+            indices[i] = indices[parent];
+            distances[i] = distances[parent];
+            i = parent;
+        }
+        indices[i] = object_index;
+        distances[i] = distance2;
+    } else if (oct_knn_further(distances[0], indices[0], distance2,
+                               object_index)) {
+        indices[0] = object_index;
+        distances[0] = distance2;
+        oct_knn_sift_down(indices, distances, k, 0);
+    }
+}
+
+size_t
+oct_query_knn(Octree* octree, Position position, size_t k,
+              uint64_t* out_indices, float* out_dist2)
+{
+    if (k == 0) {
+        return 0;
+    }
+
+    OctKnnQueue queue;
+    queue.entries = queue.local;
+    queue.count = 0;
+    queue.capacity = OCT_KNN_LOCAL_QUEUE;
+
+    oct_query_begin();
+    OctKnnEntry root;
+    root.cursor = oct_cursor_root(octree);
+    root.distance2 = oct_cube_distance2(position, root.cursor.center,
+                                        root.cursor.half_size);
+    oct_knn_queue_push(&queue, root);
+
+    // Nodes come off the queue closest first, so the search is done once the
+    // closest remaining node is further away than the k-th object found.
+    size_t found = 0;
+    while (queue.count > 0) {
+        OctKnnEntry entry = oct_knn_queue_pop(&queue);
+        if (found == k && entry.distance2 > out_dist2[0]) {
+            break;
+        }
+
+        uint8_t child_exists = oct_cursor_child_exists(octree, &entry.cursor);
+        if (child_exists == 0) {
+            size_t count;
+            const uint64_t* objects =
+                oct_cursor_objects(octree, &entry.cursor, &count);
+            for (size_t i = 0; i < count; i++) {
+                oct_knn_offer(out_indices, out_dist2, &found, k, objects[i],
+                              oct_point_distance2(
+                                  position,
+                                  octree->object_positions[objects[i]]));
+            }
+            continue;
+        }
+
+        float child_half = entry.cursor.half_size * 0.5f;
+        for (uint8_t child = 0; child < 8; child++) {
+            if (!(child_exists & (1u << child))) {
+                continue;
+            }
+
+            OctKnnEntry child_entry;
+            child_entry.distance2 = oct_cube_distance2(
+                position,
+                oct_query_child_center(entry.cursor.center, child_half, child),
+                child_half);
+            if (found == k && child_entry.distance2 > out_dist2[0]) {
+                continue;
+            }
+
+            oct_cursor_step(octree, &entry.cursor, child, &child_entry.cursor);
+            if (!oct_knn_queue_push(&queue, child_entry)) {
+                break;
+            }
+        }
+    }
+
+    if (queue.entries != queue.local) {
+        free(queue.entries);
+    }
+
+    // Heap sort the results into ascending order.
+    for (size_t end = found; end > 1; end--) {
+        uint64_t index = out_indices[0];
+        float distance = out_dist2[0];
+        out_indices[0] = out_indices[end - 1];
+        out_dist2[0] = out_dist2[end - 1];
+        out_indices[end - 1] = index;
+        out_dist2[end - 1] = distance;
+        oct_knn_sift_down(out_indices, out_dist2, end - 1, 0);
+    }
+
+    oct_query_finish(octree, 1);
+    return found;
+}
+
+#define OCT_REGION_BOX 0
+#define OCT_REGION_SPHERE 1
+
+/**
+ * @brief The region of a range query: an axis aligned box or a sphere.
+ */
+typedef struct _OctRegion
+{
+    int kind;
+    Position min;
+    Position max;
+    Position center;
+    float radius2;
+} OctRegion;
+
+static inline int
+oct_region_classify_cube(const OctRegion* region, Position center, float half)
+{
+    if (region->kind == OCT_REGION_BOX) {
+        Position low = {center.x - half, center.y - half, center.z - half};
+        Position high = {center.x + half, center.y + half, center.z + half};
+        if (high.x < region->min.x || low.x > region->max.x ||
+            high.y < region->min.y || low.y > region->max.y ||
+            high.z < region->min.z || low.z > region->max.z) {
+            return OCT_OUTSIDE;
+        }
+        if (low.x >= region->min.x && high.x <= region->max.x &&
+            low.y >= region->min.y && high.y <= region->max.y &&
+            low.z >= region->min.z && high.z <= region->max.z) {
+            return OCT_INSIDE;
+        }
+        return OCT_INTERSECTS;
+    }
+
+    if (oct_cube_distance2(region->center, center, half) > region->radius2) {
+        return OCT_OUTSIDE;
+    }
+
+    // The cube is inside when its corner furthest from the center is.
+    float dx = fabsf(center.x - region->center.x) + half;
+    float dy = fabsf(center.y - region->center.y) + half;
+    float dz = fabsf(center.z - region->center.z) + half;
+    return dx * dx + dy * dy + dz * dz <= region->radius2 ? OCT_INSIDE
+                                                          : OCT_INTERSECTS;
+}
+
+static inline bool
+oct_region_contains(const OctRegion* region, Position position)
+{
+    if (region->kind == OCT_REGION_BOX) {
+        return position.x >= region->min.x && position.x <= region->max.x &&
+               position.y >= region->min.y && position.y <= region->max.y &&
+               position.z >= region->min.z && position.z <= region->max.z;
+    }
+
+    return oct_point_distance2(position, region->center) <= region->radius2;
+}
+
+static void
+oct_region_visit(Octree* octree, const OctRegion* region,
+                 const OctCursor* cursor, OctQueryResult* result)
+{
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    if (child_exists == 0) {
+        size_t count;
+        const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+        for (size_t i = 0; i < count; i++) {
+            if (oct_region_contains(region,
+                                    octree->object_positions[objects[i]])) {
+                oct_query_result_add(result, objects[i]);
+            }
+        }
+        return;
+    }
+
+    float child_half = cursor->half_size * 0.5f;
+    for (uint8_t child = 0; child < 8; child++) {
+        if (!(child_exists & (1u << child))) {
+            continue;
+        }
+
+        Position child_center =
+            oct_query_child_center(cursor->center, child_half, child);
+        int classification =
+            oct_region_classify_cube(region, child_center, child_half);
+        if (classification == OCT_OUTSIDE) {
+            continue;
+        }
+
+        OctCursor child_cursor;
+        oct_cursor_step(octree, cursor, child, &child_cursor);
+        if (classification == OCT_INSIDE) {
+            oct_query_collect(octree, &child_cursor, result);
+        } else {
+            oct_region_visit(octree, region, &child_cursor, result);
+        }
+    }
+}
+
+static size_t
+oct_query_region(Octree* octree, const OctRegion* region,
+                 uint64_t* out_indices, size_t capacity)
+{
+    OctQueryResult result = {out_indices, capacity, 0};
+    oct_query_begin();
+    OctCursor root = oct_cursor_root(octree);
+    int classification =
+        oct_region_classify_cube(region, root.center, root.half_size);
+    if (classification == OCT_INSIDE) {
+        oct_query_collect(octree, &root, &result);
+    } else if (classification == OCT_INTERSECTS) {
+        oct_region_visit(octree, region, &root, &result);
+    }
+
+    oct_query_finish(octree, 1);
+    return result.count;
+}
+
+size_t
+oct_query_aabb(Octree* octree, Position min, Position max,
+               uint64_t* out_indices, size_t capacity)
+{
+    OctRegion region = {0};
+    region.kind = OCT_REGION_BOX;
+    region.min = min;
+    region.max = max;
+    return oct_query_region(octree, &region, out_indices, capacity);
+}
+
+size_t
+oct_query_sphere(Octree* octree, Position center, float radius,
+                 uint64_t* out_indices, size_t capacity)
+{
+    OctRegion region = {0};
+    region.kind = OCT_REGION_SPHERE;
+    region.center = center;
+    region.radius2 = radius * radius;
+    return oct_query_region(octree, &region, out_indices, capacity);
+}
+
+/**
+ * @brief A node on the stack of a depth first walk. It stays on the stack
+ * after its children are pushed, until they are all done.
+ */
+typedef struct _OctVisitEntry
+{
+    OctCursor cursor;
+    bool expanded;
+} OctVisitEntry;
+
+static bool
+oct_visit_depth_first(Octree* octree, OctVisitCallback pre_visit,
+                      OctVisitCallback post_visit, void* context)
+{
+    OctVisitEntry stack[OCT_VISIT_STACK];
+    size_t top = 0;
+    stack[top].cursor = oct_cursor_root(octree);
+    stack[top++].expanded = false;
+
+    while (top > 0) {
+        OctVisitEntry* entry = &stack[top - 1];
+        if (entry->expanded) {
+            top--;
+            if (post_visit != NULL &&
+                post_visit(octree, &entry->cursor, context) ==
+                    OCT_VISIT_STOP) {
+                return false;
+            }
+            continue;
+        }
+
+        entry->expanded = true;
+        OctVisitResult result = pre_visit != NULL
+            ? pre_visit(octree, &entry->cursor, context)
+            : OCT_VISIT_CONTINUE;
+        if (result == OCT_VISIT_STOP) {
+            return false;
+        }
+        if (result == OCT_VISIT_SKIP) {
+            continue;
+        }
+
+        // Push the children backwards so they come off in Morton order.
+        uint8_t child_exists = oct_cursor_child_exists(octree, &entry->cursor);
+        for (int child = 7; child >= 0; child--) {
+            if (child_exists & (1u << child)) {
+                stack[top].expanded = false;
+                oct_cursor_step(octree, &entry->cursor, (uint8_t)child,
+                                &stack[top].cursor);
+                top++;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool
+oct_visit_breadth_first(Octree* octree, OctVisitCallback pre_visit,
+                        OctVisitCallback post_visit, void* context)
+{
+    // Every visited node stays in the queue when there are post visits to
+    // make afterwards. Without them the visited front is dropped as the queue
+    // fills up.
+    size_t capacity = OCT_VISIT_MIN_QUEUE;
+    OctCursor* queue = malloc(capacity * sizeof *queue);
+    if (queue == NULL) {
+        return false;
+    }
+
+    size_t head = 0;
+    size_t count = 0;
+    queue[count++] = oct_cursor_root(octree);
+    bool completed = true;
+    while (head < count) {
+        OctCursor cursor = queue[head++];
+        OctVisitResult result = pre_visit != NULL
+            ? pre_visit(octree, &cursor, context)
+            : OCT_VISIT_CONTINUE;
+        if (result == OCT_VISIT_STOP) {
+            completed = false;
+            break;
+        }
+        if (result == OCT_VISIT_SKIP) {
+            continue;
+        }
+
+        uint8_t child_exists = oct_cursor_child_exists(octree, &cursor);
+        if (count + 8 > capacity) {
+            if (post_visit == NULL && head >= capacity / 2) {
+                memmove(queue, queue + head, (count - head) * sizeof *queue);
+                count -= head;
+                head = 0;
+            } else {
+                OctCursor* grown =
+                    realloc(queue, 2 * capacity * sizeof *queue);
+                if (grown == NULL) {
+                    completed = false;
+                    break;
+                }
+                queue = grown;
+                capacity *= 2;
+            }
+        }
+
+        for (uint8_t child = 0; child < 8; child++) {
+            if (child_exists & (1u << child)) {
+                oct_cursor_step(octree, &cursor, child, &queue[count++]);
+            }
+        }
+    }
+
+    if (completed && post_visit != NULL) {
+        for (size_t i = count; i > 0; i--) {
+            if (post_visit(octree, &queue[i - 1], context) == OCT_VISIT_STOP) {
+                completed = false;
+                break;
+            }
+        }
+    }
+
+    free(queue);
+    return completed;
+}
+
+bool
+oct_octree_visit(Octree* octree, OctVisitOrder order,
+                 OctVisitCallback pre_visit, OctVisitCallback post_visit,
+                 void* context)
+{
+    if (order == OCT_VISIT_BREADTH_FIRST) {
+        return oct_visit_breadth_first(octree, pre_visit, post_visit,
+                                       context);
+    }
+    return oct_visit_depth_first(octree, pre_visit, post_visit, context);
+}
+
+/**
+ * @brief Count a node into the depth histogram and, for a leaf, into the
+ * occupancy histogram.
+ */
+static OctVisitResult
+oct_stats_visit(Octree* octree, const OctCursor* cursor, void* context)
+{
+    OctStats* stats = context;
+    stats->node_counts[cursor->depth]++;
+    if (cursor->depth > stats->depth) {
+        stats->depth = cursor->depth;
+    }
+    if (oct_cursor_child_exists(octree, cursor) != 0) {
+        return OCT_VISIT_CONTINUE;
+    }
+
+    size_t count;
+    oct_cursor_objects(octree, cursor, &count);
+    size_t bin = count * (OCT_STATS_OCCUPANCY_BINS - 1) / octree->leaf_capacity;
+    stats->occupancy_counts[bin < OCT_STATS_OCCUPANCY_BINS
+                                ? bin
+                                : OCT_STATS_OCCUPANCY_BINS - 1]++;
+    stats->leaf_counts[cursor->depth]++;
+    stats->mean_occupancy += (double)count;
+    if (count > stats->max_leaf_objects) {
+        stats->max_leaf_objects = count;
+    }
+    return OCT_VISIT_CONTINUE;
+}
+
+/**
+ * @brief The bytes a node map holds, in two allocations.
+ */
+static size_t
+oct_map_bytes(const node_map* map, size_t* allocations)
+{
+    if (map == NULL) {
+        return 0;
+    }
+    *allocations += 2;
+    return sizeof *map + map->capacity * sizeof *map->slots;
+}
+
+static size_t
+oct_pool_bytes(const node_pool* pool, size_t* allocations)
+{
+    *allocations += pool->slab_count;
+    return pool->allocated_bytes;
+}
+
+/**
+ * @brief The bytes the tree holds and the amount of allocations they are
+ * spread over. A mapped tree reads its nodes, codes and indices from the
+ * mapping, unless it is succinct and packed its own indices.
+ */
+static size_t
+oct_octree_memory(const Octree* octree, size_t* allocations)
+{
+    *allocations = 1;
+    size_t bytes = sizeof *octree;
+    bytes += oct_map_bytes(octree->nodes, allocations);
+    bytes += oct_map_bytes(octree->aggregates, allocations);
+    bytes += oct_pool_bytes(&octree->leaf_pool, allocations);
+    bytes += oct_pool_bytes(&octree->branch_pool, allocations);
+    bytes += oct_pool_bytes(&octree->aggregate_pool, allocations);
+    if (octree->mapping == NULL || octree->succinct != NULL) {
+        bytes += octree->slot_capacity * sizeof *octree->object_indices;
+        *allocations += octree->object_indices != NULL;
+    }
+    if (octree->mapping == NULL) {
+        bytes += octree->object_code_count * sizeof *octree->object_codes;
+        *allocations += octree->object_codes != NULL;
+    } else {
+        bytes += octree->mapping_size;
+        (*allocations)++;
+    }
+    if (octree->succinct != NULL) {
+        bytes += succinct_tree_bytes(octree->succinct);
+        *allocations += 4;
+    }
+    return bytes;
+}
+
+size_t
+oct_octree_get_bytes(Octree* octree)
+{
+    size_t allocations;
+    return oct_octree_memory(octree, &allocations);
+}
+
+void
+oct_octree_get_stats(Octree* octree, OctStats* stats)
+{
+    memset(stats, 0, sizeof *stats);
+
+    // The nodes of a tree taking concurrent inserts are not in the tree yet.
+    // The walk is not a query, the next query drops the steps it takes.
+    if (octree->concurrent == NULL) {
+        oct_octree_visit(octree, OCT_VISIT_DEPTH_FIRST, oct_stats_visit, NULL,
+                         stats);
+    }
+
+    size_t leaf_count = 0;
+    for (int depth = 0; depth <= OCT_MAX_DEPTH; depth++) {
+        leaf_count += stats->leaf_counts[depth];
+    }
+    if (leaf_count > 0) {
+        stats->mean_occupancy /= (double)leaf_count * octree->leaf_capacity;
+    }
+
+    if (octree->nodes != NULL) {
+        stats->load_factor =
+            (double)octree->nodes->size / (double)octree->nodes->capacity;
+        stats->max_probe_length = node_map_probe_lengths(
+            octree->nodes, stats->probe_counts, OCT_STATS_PROBE_BINS);
+    }
+
+    stats->bytes = oct_octree_memory(octree, &stats->allocations);
+    if (octree->object_count > 0) {
+        stats->bytes_per_object =
+            (double)stats->bytes / (double)octree->object_count;
+    }
+
+    stats->counters.splits = octree->counters.splits;
+    stats->counters.merges = octree->counters.merges;
+    stats->counters.queries = oct_counter_load(&octree->counters.queries);
+    stats->counters.nodes_visited =
+        oct_counter_load(&octree->counters.nodes_visited);
+    stats->counters.lookups = oct_counter_load(&octree->counters.lookups);
+}
+
+void
+oct_octree_reset_counters(Octree* octree)
+{
+    octree->counters = (OctCounters){0};
+}
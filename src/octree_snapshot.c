@@ -0,0 +1,218 @@
+#include "octree.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#define OCT_CACHE_LINE 64
+
+/**
+ * @brief The epoch a reader pinned its snapshot in, 0 while it holds none.
+ * Every reader has its own cache line so pins do not contend.
+ */
+typedef struct _OctSnapshotReader
+{
+    _Alignas(OCT_CACHE_LINE) atomic_uint_fast64_t epoch;
+    atomic_bool claimed;
+} OctSnapshotReader;
+
+/**
+ * @brief A version that was replaced, with the epoch it was replaced in. It
+ * can go once no reader pinned a snapshot before that epoch.
+ */
+typedef struct _OctRetiredTree
+{
+    Octree* octree;
+    uint64_t epoch;
+} OctRetiredTree;
+
+/**
+ * @brief Allocate size bytes aligned to a cache line. aligned_alloc is missing
+ * from the Windows C runtimes, which have their own aligned heap functions.
+ */
+static void*
+oct_cache_line_alloc(size_t size)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, OCT_CACHE_LINE);
+#else
+    return aligned_alloc(OCT_CACHE_LINE, size);
+#endif
+}
+
+/**
+ * @brief Free memory from oct_cache_line_alloc.
+ */
+static void
+oct_cache_line_free(void* pointer)
+{
+#if defined(_WIN32)
+    _aligned_free(pointer);
+#else
+    free(pointer);
+#endif
+}
+
+struct _OctSnapshots
+{
+    OctSnapshotReader readers[OCT_SNAPSHOT_MAX_READERS];
+    _Alignas(OCT_CACHE_LINE) _Atomic(Octree*) current;
+    atomic_uint_fast64_t epoch;
+
+    // Only the writer touches these.
+    OctRetiredTree* retired;
+    size_t retired_count;
+    size_t retired_capacity;
+    Octree* spare;
+};
+
+OctSnapshots*
+oct_snapshots_init(Octree* octree)
+{
+    // The struct is cache line aligned, so its size is a multiple of that.
+    OctSnapshots* snapshots = oct_cache_line_alloc(sizeof *snapshots);
+    if (snapshots == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < OCT_SNAPSHOT_MAX_READERS; i++) {
+        atomic_init(&snapshots->readers[i].epoch, 0);
+        atomic_init(&snapshots->readers[i].claimed, false);
+    }
+    atomic_init(&snapshots->current, octree);
+    atomic_init(&snapshots->epoch, 1);
+    snapshots->retired = NULL;
+    snapshots->retired_count = 0;
+    snapshots->retired_capacity = 0;
+    snapshots->spare = NULL;
+
+    return snapshots;
+}
+
+void
+oct_snapshots_free(OctSnapshots* snapshots)
+{
+    for (size_t i = 0; i < snapshots->retired_count; i++) {
+        oct_octree_free(snapshots->retired[i].octree);
+    }
+    if (snapshots->spare != NULL) {
+        oct_octree_free(snapshots->spare);
+    }
+    oct_octree_free(atomic_load(&snapshots->current));
+    free(snapshots->retired);
+    oct_cache_line_free(snapshots);
+}
+
+int
+oct_snapshots_register_reader(OctSnapshots* snapshots)
+{
+    for (int i = 0; i < OCT_SNAPSHOT_MAX_READERS; i++) {
+        bool claimed = false;
+        if (atomic_compare_exchange_strong(&snapshots->readers[i].claimed,
+                                           &claimed, true)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void
+oct_snapshots_unregister_reader(OctSnapshots* snapshots, int reader)
+{
+    atomic_store(&snapshots->readers[reader].epoch, 0);
+    atomic_store(&snapshots->readers[reader].claimed, false);
+}
+
+Octree*
+oct_snapshot_pin(OctSnapshots* snapshots, int reader)
+{
+    // The epoch is announced before the version is read. A writer that did
+    // not see the announcement replaced the version before the read, so the
+    // reader gets the new one.
+    atomic_store(&snapshots->readers[reader].epoch,
+                 atomic_load(&snapshots->epoch));
+    return atomic_load(&snapshots->current);
+}
+
+void
+oct_snapshot_unpin(OctSnapshots* snapshots, int reader)
+{
+    atomic_store_explicit(&snapshots->readers[reader].epoch, 0,
+                          memory_order_release);
+}
+
+/**
+ * @brief Free or keep as spare every retired version no reader can still
+ * hold: those replaced in an epoch no pinned reader started before.
+ */
+static void
+oct_snapshots_reclaim(OctSnapshots* snapshots)
+{
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < OCT_SNAPSHOT_MAX_READERS; i++) {
+        uint64_t epoch = atomic_load(&snapshots->readers[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < snapshots->retired_count; i++) {
+        OctRetiredTree retired = snapshots->retired[i];
+        if (retired.epoch > oldest) {
+            snapshots->retired[kept++] = retired;
+        } else if (snapshots->spare == NULL) {
+            snapshots->spare = retired.octree;
+        } else {
+            oct_octree_free(retired.octree);
+        }
+    }
+    snapshots->retired_count = kept;
+}
+
+Octree*
+oct_snapshots_next(OctSnapshots* snapshots)
+{
+    oct_snapshots_reclaim(snapshots);
+    if (snapshots->spare != NULL) {
+        Octree* octree = snapshots->spare;
+        snapshots->spare = NULL;
+        return octree;
+    }
+
+    const Octree* current = atomic_load(&snapshots->current);
+    return oct_octree_init(current->position, current->size,
+                           current->leaf_capacity, current->max_depth);
+}
+
+bool
+oct_snapshots_publish(OctSnapshots* snapshots, Octree* octree)
+{
+    if (snapshots->retired_count == snapshots->retired_capacity) {
+        size_t capacity =
+            snapshots->retired_capacity ? 2 * snapshots->retired_capacity : 4;
+        OctRetiredTree* retired =
+            realloc(snapshots->retired, capacity * sizeof *retired);
+        if (retired == NULL) {
+            return false;
+        }
+        snapshots->retired = retired;
+        snapshots->retired_capacity = capacity;
+    }
+
+    // Readers that announce the new epoch read the current version after
+    // the exchange, so only those that announced an older one can hold the
+    // replaced version.
+    Octree* replaced = atomic_exchange(&snapshots->current, octree);
+    uint64_t epoch = atomic_fetch_add(&snapshots->epoch, 1) + 1;
+    snapshots->retired[snapshots->retired_count].octree = replaced;
+    snapshots->retired[snapshots->retired_count].epoch = epoch;
+    snapshots->retired_count++;
+
+    oct_snapshots_reclaim(snapshots);
+    return true;
+}
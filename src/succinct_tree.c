@@ -0,0 +1,147 @@
+#include "succinct_tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCINCT_TREE_LOW_BITS 0x7f7f7f7f7f7f7f7full
+#define SUCCINCT_TREE_HIGH_BITS 0x8080808080808080ull
+
+static inline unsigned
+succinct_tree_popcount(uint64_t word)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_popcountll(word);
+#else
+    word -= (word >> 1) & 0x5555555555555555ull;
+    word = (word & 0x3333333333333333ull) +
+           ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (unsigned)((word * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+/**
+ * @brief The amount of non-zero bytes in a word, without a branch per byte.
+ */
+static inline unsigned
+succinct_tree_nonzero_bytes(uint64_t word)
+{
+    // The high bit of a byte ends up set if any of its other bits or the
+    // high bit itself was set.
+    uint64_t low = (word & SUCCINCT_TREE_LOW_BITS) + SUCCINCT_TREE_LOW_BITS;
+    return succinct_tree_popcount((low | word) & SUCCINCT_TREE_HIGH_BITS);
+}
+
+/**
+ * @brief Load up to eight masks as one word. Missing bytes read as empty masks,
+ * so a partial word only counts the masks before the node.
+ */
+static inline uint64_t
+succinct_tree_word(const uint8_t* masks, size_t count)
+{
+    uint64_t word = 0;
+    memcpy(&word, masks, count);
+    return word;
+}
+
+succinct_tree*
+succinct_tree_alloc(size_t node_count, size_t leaf_count)
+{
+    succinct_tree* tree = malloc(sizeof *tree);
+    if (tree == NULL) {
+        return NULL;
+    }
+
+    // The masks are padded to whole blocks so a rank never reads past them.
+    size_t block_count = node_count / SUCCINCT_TREE_BLOCK + 1;
+    tree->child_exists = calloc(block_count, SUCCINCT_TREE_BLOCK);
+    tree->ranks = malloc(block_count * sizeof *tree->ranks);
+    tree->leaf_offsets = malloc((leaf_count + 1) * sizeof *tree->leaf_offsets);
+    tree->node_count = node_count;
+    tree->leaf_count = leaf_count;
+    if (tree->child_exists == NULL || tree->ranks == NULL ||
+        tree->leaf_offsets == NULL) {
+        succinct_tree_free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+void
+succinct_tree_free(succinct_tree* tree)
+{
+    if (tree == NULL) {
+        return;
+    }
+
+    free(tree->child_exists);
+    free(tree->ranks);
+    free(tree->leaf_offsets);
+    free(tree);
+}
+
+void
+succinct_tree_finish(succinct_tree* tree)
+{
+    SuccinctRank rank = {0, 0};
+    size_t block_count = tree->node_count / SUCCINCT_TREE_BLOCK + 1;
+    for (size_t block = 0; block < block_count; block++) {
+        tree->ranks[block] = rank;
+        const uint8_t* masks = tree->child_exists + block * SUCCINCT_TREE_BLOCK;
+        for (size_t i = 0; i < SUCCINCT_TREE_BLOCK; i += sizeof(uint64_t)) {
+            uint64_t word = succinct_tree_word(masks + i, sizeof(uint64_t));
+            rank.children += succinct_tree_popcount(word);
+            rank.branches += succinct_tree_nonzero_bytes(word);
+        }
+    }
+}
+
+size_t
+succinct_tree_child(const succinct_tree* tree, size_t node, uint8_t child)
+{
+    size_t block = node / SUCCINCT_TREE_BLOCK;
+    size_t end = node % SUCCINCT_TREE_BLOCK;
+    const uint8_t* masks = tree->child_exists + block * SUCCINCT_TREE_BLOCK;
+
+    size_t rank = (size_t)tree->ranks[block].children;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= end; i += sizeof(uint64_t)) {
+        rank += succinct_tree_popcount(
+            succinct_tree_word(masks + i, sizeof(uint64_t)));
+    }
+    rank += succinct_tree_popcount(succinct_tree_word(masks + i, end - i));
+
+    // The root has no parent bit, so the first child of a node comes one
+    // after the child bits before it.
+    unsigned earlier = tree->child_exists[node] & ((1u << child) - 1);
+    return rank + succinct_tree_popcount(earlier) + 1;
+}
+
+size_t
+succinct_tree_leaf(const succinct_tree* tree, size_t node)
+{
+    size_t block = node / SUCCINCT_TREE_BLOCK;
+    size_t end = node % SUCCINCT_TREE_BLOCK;
+    const uint8_t* masks = tree->child_exists + block * SUCCINCT_TREE_BLOCK;
+
+    size_t branches = (size_t)tree->ranks[block].branches;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= end; i += sizeof(uint64_t)) {
+        branches += succinct_tree_nonzero_bytes(
+            succinct_tree_word(masks + i, sizeof(uint64_t)));
+    }
+    branches += succinct_tree_nonzero_bytes(
+        succinct_tree_word(masks + i, end - i));
+
+    return node - branches;
+}
+
+size_t
+succinct_tree_bytes(const succinct_tree* tree)
+{
+    size_t block_count = tree->node_count / SUCCINCT_TREE_BLOCK + 1;
+    return sizeof *tree + block_count * SUCCINCT_TREE_BLOCK +
+           block_count * sizeof *tree->ranks +
+           (tree->leaf_count + 1) * sizeof *tree->leaf_offsets;
+}
@@ -0,0 +1,108 @@
+#ifndef SUCCINCT_TREE_H
+#define SUCCINCT_TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Number of nodes covered by one entry of the rank directory. A block of
+ * child masks fills one cache line.
+ */
+#define SUCCINCT_TREE_BLOCK 64
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /**
+     * @brief One entry of the rank directory: the amount of child bits and
+     * of inner nodes in all blocks before it.
+     */
+    typedef struct _SuccinctRank
+    {
+        uint64_t children;
+        uint64_t branches;
+    } SuccinctRank;
+
+    /**
+     * @brief Pointerless octree topology.
+     *
+     * The nodes are numbered in level order, the root first and the children
+     * of a node in the order of its child bits, which is the order of their
+     * location codes. Each node only stores its child mask, so the children
+     * of the nodes of one level are the nodes of the next level in order: the
+     * first child of a node is one past the number of child bits before it.
+     * That count comes from the rank directory plus a popcount over at most
+     * one block. Nodes with an empty mask are leaves; leaves are numbered in
+     * the same order and their object ranges are given by leaf_offsets.
+     */
+    typedef struct _SuccinctTree
+    {
+        uint8_t* child_exists;
+        SuccinctRank* ranks;
+        uint64_t* leaf_offsets;
+        size_t node_count;
+        size_t leaf_count;
+    } succinct_tree;
+
+    /**
+     * @brief Allocate a tree for node_count nodes of which leaf_count are
+     * leaves. The caller fills child_exists in level order and
+     * leaf_offsets, with leaf_count + 1 entries, and then calls
+     * succinct_tree_finish.
+     *
+     * @param node_count
+     * @param leaf_count
+     * @return succinct_tree* tree NULL if the allocation failed
+     */
+    succinct_tree* succinct_tree_alloc(size_t node_count, size_t leaf_count);
+
+    /**
+     * @brief Deallocate the tree.
+     *
+     * @param tree
+     */
+    void succinct_tree_free(succinct_tree* tree);
+
+    /**
+     * @brief Build the rank directory once all child masks are filled in.
+     *
+     * @param tree
+     */
+    void succinct_tree_finish(succinct_tree* tree);
+
+    /**
+     * @brief Find a child of an inner node.
+     *
+     * @param tree
+     * @param node Level order index of the node
+     * @param child Child location, its bit must be set in the mask of node
+     * @return size_t child Level order index of the child
+     */
+    size_t succinct_tree_child(const succinct_tree* tree, size_t node,
+                               uint8_t child);
+
+    /**
+     * @brief Find the index of a leaf among the leaves, which is the index of
+     * its object range in leaf_offsets.
+     *
+     * @param tree
+     * @param node Level order index of a node with an empty mask
+     * @return size_t leaf
+     */
+    size_t succinct_tree_leaf(const succinct_tree* tree, size_t node);
+
+    /**
+     * @brief Get the amount of memory the tree uses.
+     *
+     * @param tree
+     * @return size_t bytes
+     */
+    size_t succinct_tree_bytes(const succinct_tree* tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
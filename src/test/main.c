@@ -1,10 +1,2236 @@
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "../../src/octree.h"
 
 #define ROWS 5
+#define RANDOM_ROWS 2000
+
+static float
+random_float(float min, float max)
+{
+    return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+static Position*
+random_positions(size_t count, float extent)
+{
+    Position* positions = malloc(count * sizeof *positions);
+    for (size_t i = 0; i < count; i++) {
+        positions[i].x = random_float(-extent, extent);
+        positions[i].y = random_float(-extent, extent);
+        positions[i].z = random_float(-extent, extent);
+    }
+    return positions;
+}
+
+static int
+compare_indices(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Check that a query returned exactly the objects that match.
+ */
+static void
+assert_same_objects(uint64_t* indices, size_t count, const bool* expected,
+                    size_t object_count)
+{
+    size_t expected_count = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        expected_count += expected[i];
+    }
+    assert(count == expected_count);
+
+    qsort(indices, count, sizeof *indices, compare_indices);
+    for (size_t i = 0; i < count; i++) {
+        assert(expected[indices[i]]);
+        assert(i == 0 || indices[i] != indices[i - 1]);
+    }
+}
+
+static void
+test_node_map()
+{
+    node_map* map = node_map_alloc(0);
+    static int values[RANDOM_ROWS];
+
+    // Sibling location codes, which the identity hash would put in
+    // neighbouring buckets.
+    void* old_value = &values[0];
+    for (uint64_t i = 0; i < RANDOM_ROWS; i++) {
+        assert(node_map_put(map, 8 + i, &values[i], &old_value));
+        assert(old_value == NULL);
+    }
+    assert(node_map_size(map) == RANDOM_ROWS);
+    assert(node_map_put(map, 8, &values[1], &old_value));
+    assert(old_value == &values[0]);
+    assert(node_map_put(map, 8, &values[0], &old_value));
+    assert(old_value == &values[1]);
+    assert(node_map_put(map, 8, &values[0], NULL));
+
+    for (uint64_t i = 0; i < RANDOM_ROWS; i += 2) {
+        assert(node_map_remove(map, 8 + i) == &values[i]);
+    }
+    assert(node_map_remove(map, 8) == NULL);
+    assert(node_map_size(map) == RANDOM_ROWS / 2);
+
+    for (uint64_t i = 0; i < RANDOM_ROWS; i++) {
+        void* expected = i % 2 ? &values[i] : NULL;
+        assert(node_map_get(map, 8 + i) == expected);
+    }
+
+    // Shrinking keeps the entries that are left.
+    size_t capacity = map->capacity;
+    assert(node_map_shrink(map));
+    assert(map->capacity < capacity);
+    assert(map->capacity == node_map_capacity_for(RANDOM_ROWS / 2));
+    for (uint64_t i = 0; i < RANDOM_ROWS; i++) {
+        void* expected = i % 2 ? &values[i] : NULL;
+        assert(node_map_get(map, 8 + i) == expected);
+    }
+
+    node_map_clear(map);
+    assert(node_map_size(map) == 0);
+    assert(node_map_get(map, 9) == NULL);
+    node_map_free(map);
+}
+
+/**
+ * @brief Check the structure of a tree: every object is in exactly one leaf on
+ * its own path, leaves respect the capacity, branches do not and the child
+ * bits match the nodes. With present set only the objects marked in it are
+ * in the tree, and branches only have to hold more than half the capacity.
+ */
+static void
+assert_valid_tree(Octree* octree, Position* positions, size_t count,
+                  const bool* present)
+{
+    uint64_t* codes = malloc(count * sizeof *codes);
+    size_t object_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        codes[i] = 0;
+        if (present == NULL || present[i]) {
+            codes[i] = oct_position_get_location_code(octree, positions[i]);
+            assert(octree->object_codes[i] == codes[i]);
+            object_count++;
+        }
+    }
+    assert(octree->object_count == object_count);
+    size_t branch_minimum = octree->leaf_capacity;
+    if (present != NULL) {
+        branch_minimum =
+            octree->leaf_capacity > 1 ? octree->leaf_capacity / 2 : 1;
+    }
+    size_t used_slots = 0;
+
+    int* seen = calloc(count, sizeof *seen);
+    size_t node_count = 0;
+    size_t iterator = 0;
+    uint64_t location_code;
+    void* value_pointer;
+    while (node_map_next(octree->nodes, &iterator, &location_code,
+                         &value_pointer)) {
+        BaseNode* node = value_pointer;
+        assert(node->location_code == location_code);
+        int depth = (int)oct_node_get_tree_depth(octree, node);
+        int shift = 3 * (OCT_MAX_DEPTH - depth);
+        assert(depth <= octree->max_depth);
+        node_count++;
+
+        if (node->location_code != 1) {
+            BranchNode* parent =
+                (BranchNode*)oct_node_get_parent(octree, node);
+            assert(parent != NULL && parent->base.type == INNER_NODE);
+            assert(parent->child_exists & (1u << (node->location_code & 7)));
+        }
+
+        if (node->type == LEAF_NODE) {
+            LeafNode* leaf = (LeafNode*)node;
+            assert(leaf->object_count <= octree->leaf_capacity ||
+                   depth == octree->max_depth);
+            assert(leaf->object_count > 0 || node->location_code == 1);
+            assert(leaf->object_count <= leaf->object_capacity);
+            assert(leaf->object_offset + leaf->object_capacity <=
+                   octree->slot_count);
+            used_slots += leaf->object_capacity;
+            for (uint32_t i = 0; i < leaf->object_count; i++) {
+                uint64_t object_index =
+                    octree->object_indices[leaf->object_offset + i];
+                assert(codes[object_index] >> shift == node->location_code);
+                seen[object_index]++;
+            }
+        } else {
+            assert(depth < octree->max_depth);
+            size_t subtree_count = 0;
+            for (size_t i = 0; i < count; i++) {
+                subtree_count += codes[i] >> shift == node->location_code;
+            }
+            assert(subtree_count > branch_minimum);
+
+            uint8_t child_exists = ((BranchNode*)node)->child_exists;
+            for (uint8_t i = 0; i < 8; i++) {
+                BaseNode* child =
+                    oct_node_get_child(octree, node->location_code, i);
+                assert((child != NULL) == ((child_exists >> i) & 1));
+            }
+        }
+    }
+
+    assert(node_count == oct_octree_get_leaf_count(octree) +
+                             oct_octree_get_inner_count(octree));
+    assert(used_slots == octree->slot_count - octree->free_slot_count);
+    for (size_t i = 0; i < count; i++) {
+        assert(seen[i] == (present == NULL || present[i]));
+    }
+
+    free(seen);
+    free(codes);
+}
+
+static void
+test_bulk_build()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 1, OCT_MAX_DEPTH);
+
+    Position* positions = malloc(RANDOM_ROWS * sizeof *positions);
+    for (int i = 0; i < RANDOM_ROWS; i++) {
+        positions[i].x = random_float(-1000, 1000);
+        positions[i].y = random_float(-1000, 1000);
+        positions[i].z = random_float(-1000, 1000);
+    }
+
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    assert(oct_octree_get_leaf_count(octree) == RANDOM_ROWS);
+    assert_valid_tree(octree, positions, RANDOM_ROWS, NULL);
+
+    // A rebuild reuses the slabs of the previous build.
+    size_t leaf_slabs = octree->leaf_pool.slab_count;
+    size_t branch_slabs = octree->branch_pool.slab_count;
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    assert(oct_octree_get_leaf_count(octree) == RANDOM_ROWS);
+    assert(octree->leaf_pool.slab_count == leaf_slabs);
+    assert(octree->branch_pool.slab_count == branch_slabs);
+
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_leaf_capacity()
+{
+    Position octree_position = {0, 0, 0};
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+
+    // Clustered objects and a pile of identical ones.
+    for (size_t i = 0; i < RANDOM_ROWS / 4; i++) {
+        positions[i].x = 300 + random_float(-1, 1);
+        positions[i].y = -200 + random_float(-1, 1);
+        positions[i].z = 10 + random_float(-1, 1);
+    }
+    for (size_t i = RANDOM_ROWS / 4; i < RANDOM_ROWS / 4 + 100; i++) {
+        positions[i] = (Position){-123.5f, 77.25f, 400};
+    }
+
+    Octree* single = oct_octree_init(octree_position, 1000, 1, OCT_MAX_DEPTH);
+    oct_octree_build(single, positions, RANDOM_ROWS);
+    assert_valid_tree(single, positions, RANDOM_ROWS, NULL);
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    assert_valid_tree(octree, positions, RANDOM_ROWS, NULL);
+    assert(oct_octree_get_leaf_count(octree) <
+           oct_octree_get_leaf_count(single) / 3);
+
+    BaseNode* pile = oct_point_locate(octree, positions[RANDOM_ROWS / 4]);
+    assert(pile->type == LEAF_NODE);
+    assert(((LeafNode*)pile)->object_count == 100);
+    assert(oct_node_get_tree_depth(octree, pile) == OCT_MAX_DEPTH);
+
+    // A shallow tree stops splitting at its maximum depth.
+    Octree* shallow = oct_octree_init(octree_position, 1000, 8, 3);
+    oct_octree_build(shallow, positions, RANDOM_ROWS);
+    assert_valid_tree(shallow, positions, RANDOM_ROWS, NULL);
+
+    // Everything fits in the root.
+    Octree* root_only = oct_octree_init(octree_position, 1000, 4096, 10);
+    oct_octree_build(root_only, positions, RANDOM_ROWS);
+    assert(oct_octree_get_leaf_count(root_only) == 1);
+    assert(oct_octree_get_inner_count(root_only) == 0);
+    assert_valid_tree(root_only, positions, RANDOM_ROWS, NULL);
+
+    // A capacity past what a leaf can count is clamped, not truncated.
+    Octree* unbounded =
+        oct_octree_init(octree_position, 1000, SIZE_MAX, OCT_MAX_DEPTH);
+    assert(unbounded->leaf_capacity == UINT32_MAX);
+    oct_octree_build(unbounded, positions, RANDOM_ROWS);
+    assert(oct_octree_get_leaf_count(unbounded) == 1);
+    assert(oct_octree_get_inner_count(unbounded) == 0);
+    oct_octree_free(unbounded);
+
+    free(positions);
+    oct_octree_free(single);
+    oct_octree_free(octree);
+    oct_octree_free(shallow);
+    oct_octree_free(root_only);
+}
+
+static void
+test_parallel_build()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* serial = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    Octree* parallel =
+        oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+
+    // Two dense clusters leave most of the partitions empty and put a few
+    // single objects at the top levels. Objects 0 and 2 share a shallow leaf
+    // with the lower index having the higher location code.
+    size_t count = 20000;
+    Position* positions = malloc(count * sizeof *positions);
+    for (size_t i = 0; i < count; i++) {
+        float center = i % 2 ? 500.0f : -700.0f;
+        positions[i].x = center + random_float(-50, 50);
+        positions[i].y = center + random_float(-50, 50);
+        positions[i].z = center + random_float(-50, 50);
+    }
+    positions[0] = (Position){900, -900, 900};
+    positions[1] = (Position){-100, 900, 100};
+    positions[2] = (Position){600, -900, 600};
+    positions[3] = positions[5];
+
+    oct_octree_build(serial, positions, count);
+    for (int threads = 1; threads <= 4; threads++) {
+        oct_octree_build_parallel(parallel, positions, count, threads);
+        assert(oct_octree_get_leaf_count(parallel) ==
+               oct_octree_get_leaf_count(serial));
+        assert(oct_octree_get_inner_count(parallel) ==
+               oct_octree_get_inner_count(serial));
+        assert(node_map_size(parallel->nodes) ==
+               node_map_size(serial->nodes));
+
+        size_t iterator = 0;
+        uint64_t location_code;
+        void* value_pointer;
+        while (node_map_next(serial->nodes, &iterator, &location_code,
+                             &value_pointer)) {
+            BaseNode* expected = value_pointer;
+            BaseNode* node = oct_node_lookup(parallel, location_code);
+            assert(node != NULL && node->type == expected->type);
+            if (node->type == LEAF_NODE) {
+                assert(((LeafNode*)node)->object_offset ==
+                       ((LeafNode*)expected)->object_offset);
+                assert(((LeafNode*)node)->object_count ==
+                       ((LeafNode*)expected)->object_count);
+            } else {
+                assert(((BranchNode*)node)->child_exists ==
+                       ((BranchNode*)expected)->child_exists);
+            }
+        }
+        assert(memcmp(serial->object_indices, parallel->object_indices,
+                      count * sizeof *serial->object_indices) == 0);
+    }
+
+    assert_valid_tree(parallel, positions, count, NULL);
+
+    free(positions);
+    oct_octree_free(serial);
+    oct_octree_free(parallel);
+}
+
+static void
+test_query_frustum()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+
+    // A camera in the middle of the tree looking down +z with a 90 degree
+    // field of view, near plane 10 and far plane 600.
+    Plane planes[6] = {
+        {1, 0, 1, 0},
+        {-1, 0, 1, 0},
+        {0, 1, 1, 0},
+        {0, -1, 1, 0},
+        {0, 0, 1, -10},
+        {0, 0, -1, 600},
+    };
+
+    bool* expected = calloc(RANDOM_ROWS, sizeof *expected);
+    for (size_t i = 0; i < RANDOM_ROWS; i++) {
+        Position p = positions[i];
+        expected[i] = true;
+        for (int j = 0; j < 6; j++) {
+            if (planes[j].a * p.x + planes[j].b * p.y + planes[j].c * p.z +
+                    planes[j].d < 0) {
+                expected[i] = false;
+            }
+        }
+    }
+
+    uint64_t* indices = malloc(RANDOM_ROWS * sizeof *indices);
+    size_t count = oct_query_frustum(octree, planes, indices, RANDOM_ROWS);
+    assert(count > 0);
+    assert_same_objects(indices, count, expected, RANDOM_ROWS);
+
+    // Too little room still reports the full count.
+    assert(oct_query_frustum(octree, planes, indices, 3) == count);
+
+    // A frustum that holds the whole tree reports everything.
+    Plane everything[6] = {
+        {1, 0, 0, 5000}, {-1, 0, 0, 5000}, {0, 1, 0, 5000},
+        {0, -1, 0, 5000}, {0, 0, 1, 5000}, {0, 0, -1, 5000},
+    };
+    assert(oct_query_frustum(octree, everything, indices, RANDOM_ROWS) ==
+           RANDOM_ROWS);
+
+    free(indices);
+    free(expected);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static RayHit
+brute_force_ray(Position* positions, size_t count, Ray ray, float radius,
+                float max_distance)
+{
+    Position d = ray.direction;
+    float length = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    d.x /= length;
+    d.y /= length;
+    d.z /= length;
+
+    RayHit hit = {ULLONG_MAX, INFINITY};
+    for (size_t i = 0; i < count; i++) {
+        float mx = ray.origin.x - positions[i].x;
+        float my = ray.origin.y - positions[i].y;
+        float mz = ray.origin.z - positions[i].z;
+        float b = mx * d.x + my * d.y + mz * d.z;
+        float c = mx * mx + my * my + mz * mz - radius * radius;
+        float discriminant = b * b - c;
+        if ((c > 0 && b > 0) || discriminant < 0) {
+            continue;
+        }
+        float distance = fmaxf(-b - sqrtf(discriminant), 0.0f);
+        if (distance <= max_distance && distance < hit.distance) {
+            hit.distance = distance;
+            hit.object_index = i;
+        }
+    }
+    return hit;
+}
+
+static void
+test_query_ray()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 1, OCT_MAX_DEPTH);
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+
+    size_t ray_count = 200;
+    Ray* rays = malloc(ray_count * sizeof *rays);
+    RayHit* hits = malloc(ray_count * sizeof *hits);
+    for (size_t i = 0; i < ray_count; i++) {
+        // Half of the rays come from one camera, the rest from anywhere.
+        if (i % 2) {
+            rays[i].origin = (Position){-1200, 10, 30};
+            rays[i].direction = (Position){1, random_float(-0.5f, 0.5f),
+                                           random_float(-0.5f, 0.5f)};
+        } else {
+            rays[i].origin = (Position){random_float(-1000, 1000),
+                                        random_float(-1000, 1000),
+                                        random_float(-1000, 1000)};
+            rays[i].direction = (Position){random_float(-1, 1),
+                                           random_float(-1, 1), 0};
+        }
+    }
+
+    size_t expected_hits = 0;
+    for (size_t i = 0; i < ray_count; i++) {
+        float max_distance = i % 5 ? 5000.0f : 300.0f;
+        RayHit expected =
+            brute_force_ray(positions, RANDOM_ROWS, rays[i], 25, max_distance);
+        RayHit hit;
+        bool found = oct_query_ray(octree, rays[i], 25, max_distance, &hit);
+        assert(found == (expected.object_index != ULLONG_MAX));
+        assert(hit.object_index == expected.object_index);
+        assert(hit.distance == expected.distance);
+        expected_hits += found;
+    }
+    assert(expected_hits > 0);
+
+    size_t hit_count =
+        oct_query_ray_packet(octree, rays, ray_count, 25, 5000, hits);
+    size_t packet_hits = 0;
+    for (size_t i = 0; i < ray_count; i++) {
+        RayHit expected =
+            brute_force_ray(positions, RANDOM_ROWS, rays[i], 25, 5000);
+        assert(hits[i].object_index == expected.object_index);
+        assert(hits[i].distance == expected.distance);
+        packet_hits += hits[i].object_index != ULLONG_MAX;
+    }
+    assert(hit_count == packet_hits);
+
+    // A ray that passes through a leaf but misses its objects is not a hit,
+    // even without a bound.
+    Position pair[2] = {{10, 10, 10}, {-10, 10, 10}};
+    oct_octree_build(octree, pair, 2);
+    Ray miss = {{500, 500, -500}, {0, 0, 1}};
+    RayHit hit;
+    assert(!oct_query_ray(octree, miss, 1, INFINITY, &hit));
+    assert(hit.object_index == ULLONG_MAX);
+    assert(oct_query_ray_packet(octree, &miss, 1, 1, INFINITY, hits) == 0);
+    assert(hits[0].object_index == ULLONG_MAX);
+
+    free(hits);
+    free(rays);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_point_locate()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    Position* probes = random_positions(RANDOM_ROWS, 1000);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    size_t node_count = node_map_size(octree->nodes);
+
+    for (size_t i = 0; i < RANDOM_ROWS; i++) {
+        BaseNode* node = oct_point_locate(octree, positions[i]);
+        assert(node->type == LEAF_NODE);
+        LeafNode* leaf = (LeafNode*)node;
+        bool found = false;
+        for (uint32_t j = 0; j < leaf->object_count; j++) {
+            found |= octree->object_indices[leaf->object_offset + j] == i;
+        }
+        assert(found);
+
+        // Walk down from the root to find the expected node for a probe.
+        uint64_t code = oct_position_get_location_code(octree, probes[i]);
+        BaseNode* expected = octree->root_node;
+        for (int depth = 1; expected->type == INNER_NODE; depth++) {
+            BaseNode* child = oct_node_lookup(
+                octree, code >> (3 * (OCT_MAX_DEPTH - depth)));
+            if (child == NULL) {
+                break;
+            }
+            expected = child;
+        }
+        assert(oct_point_locate(octree, probes[i]) == expected);
+    }
+    assert(node_map_size(octree->nodes) == node_count);
+
+    free(probes);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_query_knn()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+
+    size_t k = 16;
+    uint64_t indices[16];
+    float distances[16];
+    for (int probe = 0; probe < 50; probe++) {
+        Position position = {random_float(-1200, 1200),
+                             random_float(-1200, 1200),
+                             random_float(-1200, 1200)};
+        size_t found = oct_query_knn(octree, position, k, indices, distances);
+        assert(found == k);
+
+        // Every object that is not returned must be at least as far away as
+        // the last one that is.
+        bool* returned = calloc(RANDOM_ROWS, sizeof *returned);
+        for (size_t i = 0; i < found; i++) {
+            float dx = positions[indices[i]].x - position.x;
+            float dy = positions[indices[i]].y - position.y;
+            float dz = positions[indices[i]].z - position.z;
+            assert(distances[i] == dx * dx + dy * dy + dz * dz);
+            assert(i == 0 || distances[i - 1] <= distances[i]);
+            assert(!returned[indices[i]]);
+            returned[indices[i]] = true;
+        }
+        for (size_t i = 0; i < RANDOM_ROWS; i++) {
+            float dx = positions[i].x - position.x;
+            float dy = positions[i].y - position.y;
+            float dz = positions[i].z - position.z;
+            assert(returned[i] ||
+                   dx * dx + dy * dy + dz * dz >= distances[k - 1]);
+        }
+        free(returned);
+    }
+
+    // Asking for more objects than the tree holds returns all of them.
+    Position few[3] = {{1, 1, 1}, {-5, 5, 5}, {100, 0, 0}};
+    oct_octree_build(octree, few, 3);
+    assert(oct_query_knn(octree, (Position){0, 0, 0}, k, indices,
+                         distances) == 3);
+    assert(indices[0] == 0 && indices[1] == 1 && indices[2] == 2);
+
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_query_range()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 16, OCT_MAX_DEPTH);
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+
+    uint64_t* indices = malloc(RANDOM_ROWS * sizeof *indices);
+    bool* expected = calloc(RANDOM_ROWS, sizeof *expected);
+    for (int probe = 0; probe < 20; probe++) {
+        Position min = {random_float(-1100, 500), random_float(-1100, 500),
+                        random_float(-1100, 500)};
+        Position max = {min.x + random_float(0, 900),
+                        min.y + random_float(0, 900),
+                        min.z + random_float(0, 900)};
+        for (size_t i = 0; i < RANDOM_ROWS; i++) {
+            Position p = positions[i];
+            expected[i] = p.x >= min.x && p.x <= max.x && p.y >= min.y &&
+                          p.y <= max.y && p.z >= min.z && p.z <= max.z;
+        }
+        size_t count =
+            oct_query_aabb(octree, min, max, indices, RANDOM_ROWS);
+        assert_same_objects(indices, count, expected, RANDOM_ROWS);
+
+        Position center = {random_float(-1000, 1000),
+                           random_float(-1000, 1000),
+                           random_float(-1000, 1000)};
+        float radius = random_float(0, 1200);
+        for (size_t i = 0; i < RANDOM_ROWS; i++) {
+            float dx = positions[i].x - center.x;
+            float dy = positions[i].y - center.y;
+            float dz = positions[i].z - center.z;
+            expected[i] = dx * dx + dy * dy + dz * dz <= radius * radius;
+        }
+        count = oct_query_sphere(octree, center, radius, indices, RANDOM_ROWS);
+        assert_same_objects(indices, count, expected, RANDOM_ROWS);
+    }
+
+    Position min = {-2000, -2000, -2000};
+    Position max = {2000, 2000, 2000};
+    assert(oct_query_aabb(octree, min, max, indices, 0) == RANDOM_ROWS);
+    assert(oct_query_sphere(octree, min, 10, indices, RANDOM_ROWS) == 0);
+
+    free(expected);
+    free(indices);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_object_update()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = 3 * RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    bool* present = calloc(count, sizeof *present);
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    for (size_t i = 0; i < RANDOM_ROWS; i++) {
+        present[i] = true;
+    }
+
+    // Inserting splits leaves just like a build would.
+    for (size_t i = RANDOM_ROWS; i < count; i++) {
+        assert(oct_object_insert(octree, positions, i));
+        present[i] = true;
+    }
+    assert(!oct_object_insert(octree, positions, 0));
+    assert_valid_tree(octree, positions, count, NULL);
+
+    for (size_t i = 0; i < count; i += 2) {
+        assert(oct_object_remove(octree, i));
+        present[i] = false;
+    }
+    assert(!oct_object_remove(octree, 0));
+    assert(!oct_object_remove(octree, 10 * count));
+    assert_valid_tree(octree, positions, count, present);
+
+    // Small moves mostly stay in their leaf, large ones cross the tree.
+    for (size_t i = 1; i < count; i += 2) {
+        Position position = positions[i];
+        if (i % 3 == 0) {
+            position.x += random_float(-1, 1);
+            position.y += random_float(-1, 1);
+        } else {
+            position.x = random_float(-1000, 1000);
+            position.y = random_float(-1000, 1000);
+            position.z = random_float(-1000, 1000);
+        }
+        assert(oct_object_move(octree, i, position));
+        assert(positions[i].x == position.x && positions[i].y == position.y);
+    }
+    assert(!oct_object_move(octree, 0, octree_position));
+    assert_valid_tree(octree, positions, count, present);
+
+    // Objects piling up in one cell end up in a single leaf at max_depth.
+    for (size_t i = 1; i < 200; i += 2) {
+        assert(oct_object_move(octree, i, (Position){5, 5, 5}));
+    }
+    BaseNode* pile = oct_point_locate(octree, (Position){5, 5, 5});
+    assert(((LeafNode*)pile)->object_count == 100);
+    assert(oct_node_get_tree_depth(octree, pile) == OCT_MAX_DEPTH);
+    assert_valid_tree(octree, positions, count, present);
+
+    // Emptying the tree merges everything back into the root.
+    for (size_t i = 1; i < count; i += 2) {
+        assert(oct_object_remove(octree, i));
+        present[i] = false;
+    }
+    assert(octree->object_count == 0);
+    assert(oct_octree_get_leaf_count(octree) == 1);
+    assert(oct_octree_get_inner_count(octree) == 0);
+    assert(((BaseNode*)octree->root_node)->type == LEAF_NODE);
+
+    // An index past the built objects grows the tree's bookkeeping.
+    for (size_t i = count - 100; i < count; i++) {
+        assert(oct_object_insert(octree, positions, i));
+        present[i] = true;
+    }
+    assert_valid_tree(octree, positions, count, present);
+    free(present);
+    oct_octree_free(octree);
+
+    // A tree that starts out empty.
+    octree = oct_octree_init(octree_position, 1000, 1, OCT_MAX_DEPTH);
+    for (size_t i = 0; i < count; i++) {
+        assert(oct_object_insert(octree, positions, i));
+    }
+    // The hundred objects moved to one cell share a leaf.
+    assert(oct_octree_get_leaf_count(octree) == count - 99);
+    assert_valid_tree(octree, positions, count, NULL);
+
+    free(positions);
+    oct_octree_free(octree);
+}
+
+static void
+test_octree_update()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    Position* next = malloc(count * sizeof *next);
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, count);
+
+    // A small step leaves almost every object in its leaf.
+    for (size_t i = 0; i < count; i++) {
+        next[i] = positions[i];
+        next[i].x += random_float(-0.5f, 0.5f);
+        next[i].z += random_float(-0.5f, 0.5f);
+    }
+    assert(oct_octree_update(octree, next) == OCT_UPDATE_REINSERT);
+    assert(octree->object_positions == next);
+    assert_valid_tree(octree, next, count, NULL);
+
+    // Scattering everything is cheaper to rebuild, and gives the same tree
+    // a build does.
+    for (size_t i = 0; i < count; i++) {
+        positions[i].x = random_float(-1000, 1000);
+        positions[i].y = random_float(-1000, 1000);
+        positions[i].z = random_float(-1000, 1000);
+    }
+    assert(oct_octree_update(octree, positions) == OCT_UPDATE_REBUILD);
+    assert_valid_tree(octree, positions, count, NULL);
+
+    Octree* built = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(built, positions, count);
+    assert(oct_octree_get_leaf_count(octree) ==
+           oct_octree_get_leaf_count(built));
+    assert(oct_octree_get_inner_count(octree) ==
+           oct_octree_get_inner_count(built));
+    oct_octree_free(built);
+
+    // Objects taken out of the tree stay out.
+    bool* present = malloc(count * sizeof *present);
+    for (size_t i = 0; i < count; i++) {
+        present[i] = i % 5 != 0;
+        if (!present[i]) {
+            assert(oct_object_remove(octree, i));
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        next[i] = positions[i];
+        if (i % 50 == 1) {
+            next[i].y = random_float(-1000, 1000);
+        }
+    }
+    assert(oct_octree_update(octree, next) == OCT_UPDATE_REINSERT);
+    assert_valid_tree(octree, next, count, present);
+
+    Position* scattered = random_positions(count, 1000);
+    assert(oct_octree_update(octree, scattered) == OCT_UPDATE_REBUILD);
+    assert_valid_tree(octree, scattered, count, present);
+    free(scattered);
+
+    // After inserts, update only reads the positions of inserted indices,
+    // however much room the tree keeps for codes.
+    Octree* inserted = oct_octree_init(octree_position, 1000, 8,
+                                       OCT_MAX_DEPTH);
+    Position* few = malloc(3 * sizeof *few);
+    memcpy(few, positions, 3 * sizeof *few);
+    for (size_t i = 0; i < 3; i++) {
+        assert(oct_object_insert(inserted, few, i));
+    }
+    assert(inserted->object_index_count == 3);
+    few[1].x = -few[1].x;
+    assert(oct_octree_update(inserted, few) != OCT_UPDATE_FAILED);
+    assert_valid_tree(inserted, few, 3, NULL);
+    oct_octree_free(inserted);
+    free(few);
+
+    free(present);
+    free(next);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+/**
+ * @brief Check that two lists of object indices hold the same objects, in any
+ * order.
+ */
+static void
+assert_same_result(const uint64_t* a, size_t a_count, const uint64_t* b,
+                   size_t b_count)
+{
+    assert(a_count == b_count);
+    uint64_t* sorted = malloc(2 * a_count * sizeof *sorted + 1);
+    memcpy(sorted, a, a_count * sizeof *a);
+    memcpy(sorted + a_count, b, b_count * sizeof *b);
+    qsort(sorted, a_count, sizeof *sorted, compare_indices);
+    qsort(sorted + a_count, b_count, sizeof *sorted, compare_indices);
+    assert(memcmp(sorted, sorted + a_count, a_count * sizeof *a) == 0);
+    free(sorted);
+}
+
+/**
+ * @brief Check that two files have the same contents.
+ */
+static void
+assert_same_file(const char* path, const char* other_path)
+{
+    FILE* file = fopen(path, "rb");
+    FILE* other = fopen(other_path, "rb");
+    assert(file != NULL && other != NULL);
+    int a;
+    int b;
+    do {
+        a = fgetc(file);
+        b = fgetc(other);
+        assert(a == b);
+    } while (a != EOF);
+    fclose(file);
+    fclose(other);
+}
+
+/**
+ * @brief Check that every node of a tree is found in a mapped tree with the
+ * same contents.
+ */
+static void
+assert_mapped_tree(Octree* octree, Octree* mapped)
+{
+    assert(oct_octree_get_leaf_count(mapped) ==
+           oct_octree_get_leaf_count(octree));
+    assert(oct_octree_get_inner_count(mapped) ==
+           oct_octree_get_inner_count(octree));
+
+    size_t iterator = 0;
+    uint64_t location_code;
+    void* value_pointer;
+    while (node_map_next(octree->nodes, &iterator, &location_code,
+                         &value_pointer)) {
+        BaseNode* node = value_pointer;
+        BaseNode* record = oct_node_lookup(mapped, location_code);
+        assert(record != NULL && record->location_code == location_code);
+        assert(record->type == node->type);
+        if (node->type == LEAF_NODE) {
+            LeafNode* leaf = (LeafNode*)node;
+            LeafNode* mapped_leaf = (LeafNode*)record;
+            assert(mapped_leaf->object_count == leaf->object_count);
+            assert_same_result(
+                octree->object_indices + leaf->object_offset,
+                leaf->object_count,
+                mapped->object_indices + mapped_leaf->object_offset,
+                mapped_leaf->object_count);
+        } else {
+            assert(((BranchNode*)record)->child_exists ==
+                   ((BranchNode*)node)->child_exists);
+            for (uint8_t i = 0; i < 8; i++) {
+                assert((oct_node_get_child(mapped, location_code, i) != NULL) ==
+                       (oct_node_get_child(octree, location_code, i) != NULL));
+            }
+        }
+    }
+}
+
+/**
+ * @brief Overwrite size bytes of a file at offset, check the file no longer
+ * maps and put the old bytes back.
+ */
+static void
+assert_corrupt_file_refused(const char* path, long offset, const void* bytes,
+                            size_t size)
+{
+    char old[sizeof(LeafNode)];
+    assert(size <= sizeof old);
+    FILE* file = fopen(path, "r+b");
+    fseek(file, offset, SEEK_SET);
+    assert(fread(old, 1, size, file) == size);
+    fseek(file, offset, SEEK_SET);
+    fwrite(bytes, 1, size, file);
+    fclose(file);
+
+    assert(oct_octree_map(path) == NULL);
+
+    file = fopen(path, "r+b");
+    fseek(file, offset, SEEK_SET);
+    fwrite(old, 1, size, file);
+    fclose(file);
+    Octree* mapped = oct_octree_map(path);
+    assert(mapped != NULL);
+    oct_octree_free(mapped);
+}
+
+static void
+test_octree_file()
+{
+    const char* path = "octree_test.oct";
+    const char* copy_path = "octree_test_copy.oct";
+    Position octree_position = {10, -20, 30};
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, count);
+    for (size_t i = 0; i < count; i += 7) {
+        assert(oct_object_remove(octree, i));
+    }
+    assert(oct_octree_save(octree, path));
+
+    Octree* mapped = oct_octree_map(path);
+    assert(mapped != NULL);
+    assert(mapped->size == octree->size);
+    assert(mapped->leaf_capacity == octree->leaf_capacity);
+    assert(mapped->object_count == octree->object_count);
+    assert(memcmp(mapped->object_positions, positions,
+                  count * sizeof *positions) == 0);
+
+    assert_mapped_tree(octree, mapped);
+
+    // Queries answer the same from the mapping.
+    uint64_t* expected = malloc(count * sizeof *expected);
+    uint64_t* found = malloc(count * sizeof *found);
+    Position min = {-300, -500, -100};
+    Position max = {400, 200, 600};
+    size_t expected_count = oct_query_aabb(octree, min, max, expected, count);
+    size_t found_count = oct_query_aabb(mapped, min, max, found, count);
+    assert(expected_count > 0);
+    assert_same_result(expected, expected_count, found, found_count);
+
+    expected_count =
+        oct_query_sphere(octree, octree_position, 450, expected, count);
+    found_count = oct_query_sphere(mapped, octree_position, 450, found, count);
+    assert_same_result(expected, expected_count, found, found_count);
+
+    float expected_dist2[16];
+    float found_dist2[16];
+    assert(oct_query_knn(octree, min, 16, expected, expected_dist2) == 16);
+    assert(oct_query_knn(mapped, min, 16, found, found_dist2) == 16);
+    assert(memcmp(expected, found, 16 * sizeof *found) == 0);
+    assert(memcmp(expected_dist2, found_dist2, sizeof found_dist2) == 0);
+
+    Ray ray = {{-1200, -1100, -1000}, {1, 1.1f, 0.9f}};
+    RayHit expected_hit;
+    RayHit found_hit;
+    assert(oct_query_ray(octree, ray, 20, INFINITY, &expected_hit));
+    assert(oct_query_ray(mapped, ray, 20, INFINITY, &found_hit));
+    assert(expected_hit.object_index == found_hit.object_index);
+    assert(expected_hit.distance == found_hit.distance);
+
+    for (size_t i = 1; i < count; i += 97) {
+        if (i % 7 != 0) {
+            assert(oct_point_locate(mapped, positions[i])->location_code ==
+                   oct_point_locate(octree, positions[i])->location_code);
+        }
+    }
+
+    // A mapped tree is read only.
+    assert(!oct_object_insert(mapped, positions, 0));
+    assert(!oct_object_remove(mapped, 1));
+    assert(!oct_object_move(mapped, 1, octree_position));
+    assert(oct_octree_update(mapped, positions) == OCT_UPDATE_FAILED);
+    oct_octree_build(mapped, positions, count);
+    assert(oct_octree_get_leaf_count(mapped) ==
+           oct_octree_get_leaf_count(octree));
+
+    // Saving the mapped tree gives the same file.
+    assert(oct_octree_save(mapped, copy_path));
+    assert_same_file(path, copy_path);
+
+    // Nodes and indices that would be read out of bounds are refused.
+    const char* mapping = mapped->mapping;
+    long indices_offset = (long)((const char*)mapped->object_indices - mapping);
+    long codes_offset = (long)((const char*)mapped->mapped_codes - mapping);
+    long nodes_offset = (long)((const char*)mapped->mapped_nodes - mapping);
+    size_t leaf = 0;
+    while (mapped->mapped_nodes[leaf].base.type != LEAF_NODE) {
+        leaf++;
+    }
+    LeafNode record = mapped->mapped_nodes[leaf];
+    record.object_offset = mapped->object_count;
+    assert_corrupt_file_refused(
+        copy_path, nodes_offset + (long)(leaf * sizeof record), &record,
+        sizeof record);
+    uint64_t index = count;
+    assert_corrupt_file_refused(copy_path, indices_offset, &index,
+                                sizeof index);
+    uint64_t code = mapped->mapped_codes[2];
+    assert_corrupt_file_refused(copy_path,
+                                codes_offset + (long)sizeof code, &code,
+                                sizeof code);
+    BranchNode* root = (BranchNode*)&record;
+    record = mapped->mapped_nodes[0];
+    root->child_exists = 0xff;
+    if (((const BranchNode*)&mapped->mapped_nodes[0])->child_exists != 0xff) {
+        assert_corrupt_file_refused(copy_path, nodes_offset, &record,
+                                    sizeof record);
+    }
+
+    // Only the positions of objects that were put in the tree are saved.
+    Octree* inserted = oct_octree_init(octree_position, 1000, 8,
+                                       OCT_MAX_DEPTH);
+    Position* single = malloc(sizeof *single);
+    single[0] = positions[0];
+    assert(oct_object_insert(inserted, single, 0));
+    assert(oct_octree_save(inserted, copy_path));
+    Octree* mapped_single = oct_octree_map(copy_path);
+    assert(mapped_single != NULL && mapped_single->object_count == 1);
+    oct_octree_free(mapped_single);
+    oct_octree_free(inserted);
+    free(single);
+
+    // Anything that is not an octree file is refused.
+    assert(oct_octree_map("octree_test_missing.oct") == NULL);
+    FILE* file = fopen(copy_path, "r+b");
+    fputc('X', file);
+    fclose(file);
+    assert(oct_octree_map(copy_path) == NULL);
+
+    remove(path);
+    remove(copy_path);
+    free(expected);
+    free(found);
+    free(positions);
+    oct_octree_free(mapped);
+    oct_octree_free(octree);
+}
+
+typedef struct _PositionStream
+{
+    const Position* positions;
+    size_t count;
+    size_t next;
+} PositionStream;
+
+static size_t
+read_positions(void* context, Position* positions, size_t capacity)
+{
+    PositionStream* stream = context;
+    size_t count = stream->count - stream->next;
+    if (count > capacity) {
+        count = capacity;
+    }
+    if (count > 777) {
+        count = 777;
+    }
+
+    memcpy(positions, stream->positions + stream->next,
+           count * sizeof *positions);
+    stream->next += count;
+    return count;
+}
+
+static void
+test_build_stream()
+{
+    const char* path = "octree_stream.oct";
+    const char* saved_path = "octree_stream_saved.oct";
+    const char* built_path = "octree_stream_built.oct";
+    Position octree_position = {0, 0, 0};
+    size_t count = 25 * RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    for (size_t i = 0; i < count; i += 10) {
+        positions[i] = (Position){-321, 123, 45};
+    }
+
+    // The smallest budget gives runs of under 2000 codes, so the runs are
+    // merged in two passes.
+    for (int max_depth = 4; max_depth <= OCT_MAX_DEPTH; max_depth += 17) {
+        PositionStream stream = {positions, count, 0};
+        assert(oct_octree_build_stream(path, octree_position, 1000, 8,
+                                       max_depth, read_positions, &stream,
+                                       0));
+        Octree* mapped = oct_octree_map(path);
+        assert(mapped != NULL);
+        assert(mapped->object_count == count);
+        assert(memcmp(mapped->object_positions, positions,
+                      count * sizeof *positions) == 0);
+
+        Octree* octree = oct_octree_init(octree_position, 1000, 8, max_depth);
+        oct_octree_build(octree, positions, count);
+        assert_mapped_tree(octree, mapped);
+
+        // Saved again both give the same file, leaves hold their objects in
+        // the same order.
+        assert(oct_octree_save(mapped, saved_path));
+        assert(oct_octree_save(octree, built_path));
+        assert_same_file(saved_path, built_path);
+
+        oct_octree_free(mapped);
+        oct_octree_free(octree);
+    }
+
+    // A capacity past what a leaf can count is clamped as for
+    // oct_octree_init, and everything fits in the root.
+    PositionStream unbounded = {positions, count, 0};
+    assert(oct_octree_build_stream(path, octree_position, 1000, SIZE_MAX,
+                                   OCT_MAX_DEPTH, read_positions, &unbounded,
+                                   1 << 20));
+    Octree* clamped = oct_octree_map(path);
+    assert(clamped != NULL);
+    assert(clamped->leaf_capacity == UINT32_MAX);
+    assert(oct_octree_get_leaf_count(clamped) == 1);
+    assert(((LeafNode*)clamped->root_node)->object_count == count);
+    oct_octree_free(clamped);
+
+    // Nothing to read gives a tree with an empty root.
+    PositionStream empty = {positions, 0, 0};
+    assert(oct_octree_build_stream(path, octree_position, 1000, 8,
+                                   OCT_MAX_DEPTH, read_positions, &empty,
+                                   1 << 20));
+    Octree* mapped = oct_octree_map(path);
+    assert(mapped != NULL);
+    assert(oct_octree_get_leaf_count(mapped) == 1);
+    assert(oct_octree_get_inner_count(mapped) == 0);
+    assert(((LeafNode*)mapped->root_node)->object_count == 0);
+    oct_octree_free(mapped);
+
+    remove(path);
+    remove(saved_path);
+    remove(built_path);
+    free(positions);
+}
+
+static void
+test_node_pool()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 100, 4, OCT_MAX_DEPTH);
+    Position positions[3] = {{10, 10, 10}, {-10, 10, 10}, {20, 30, 40}};
+    oct_octree_build(octree, positions, 3);
+
+    // Splitting the root makes the children first and gives the leaf back
+    // after, so it is not reused by them.
+    LeafNode* root = octree->root_node;
+    BranchNode* branch = oct_leaf_node_split(octree, root);
+    assert(branch == octree->root_node);
+    assert(branch->child_exists == 0b11000000);
+    assert(oct_octree_get_leaf_count(octree) == 2);
+    assert(oct_octree_get_inner_count(octree) == 1);
+
+    LeafNode* first = (LeafNode*)oct_node_lookup(octree, 0b1110);
+    assert(first != root && first->object_count == 1);
+    LeafNode* child = (LeafNode*)oct_node_lookup(octree, 0b1111);
+    assert(child->object_count == 2);
+
+    oct_leaf_node_free(octree, child->base.location_code);
+    assert(oct_octree_get_leaf_count(octree) == 1);
+    assert(oct_node_lookup(octree, 0b1111) == NULL);
+    assert(node_pool_alloc(&octree->leaf_pool) == child);
+    assert(node_pool_alloc(&octree->leaf_pool) == root);
+
+    // An empty leaf has nothing to split and stays in the tree.
+    Octree* empty = oct_octree_init(octree_position, 100, 4, OCT_MAX_DEPTH);
+    oct_octree_build(empty, positions, 0);
+    assert(oct_leaf_node_split(empty, empty->root_node) == NULL);
+    assert(((BaseNode*)empty->root_node)->type == LEAF_NODE);
+    assert(oct_octree_get_leaf_count(empty) == 1);
+
+    oct_octree_free(empty);
+    oct_octree_free(octree);
+}
+
+/**
+ * @brief Run every query on both trees and check the answers are the same.
+ */
+static void
+assert_same_queries(Octree* expected_tree, Octree* tree, size_t count)
+{
+    uint64_t* expected = malloc(count * sizeof *expected);
+    uint64_t* found = malloc(count * sizeof *found);
+    Position center = expected_tree->position;
+
+    Plane planes[6] = {
+        {1, 0, 1, 0},  {-1, 0, 1, 0},  {0, 1, 1, 0},
+        {0, -1, 1, 0}, {0, 0, 1, -10}, {0, 0, -1, 600},
+    };
+    size_t expected_count =
+        oct_query_frustum(expected_tree, planes, expected, count);
+    size_t found_count = oct_query_frustum(tree, planes, found, count);
+    assert(expected_count > 0);
+    assert_same_result(expected, expected_count, found, found_count);
+
+    Position min = {-300, -500, -100};
+    Position max = {400, 200, 600};
+    expected_count = oct_query_aabb(expected_tree, min, max, expected, count);
+    found_count = oct_query_aabb(tree, min, max, found, count);
+    assert(expected_count > 0);
+    assert_same_result(expected, expected_count, found, found_count);
+
+    expected_count = oct_query_sphere(expected_tree, center, 450, expected,
+                                      count);
+    found_count = oct_query_sphere(tree, center, 450, found, count);
+    assert_same_result(expected, expected_count, found, found_count);
+
+    float expected_dist2[16];
+    float found_dist2[16];
+    assert(oct_query_knn(expected_tree, min, 16, expected, expected_dist2) ==
+           16);
+    assert(oct_query_knn(tree, min, 16, found, found_dist2) == 16);
+    assert(memcmp(expected, found, 16 * sizeof *found) == 0);
+    assert(memcmp(expected_dist2, found_dist2, sizeof found_dist2) == 0);
+
+    Ray rays[100];
+    RayHit expected_hits[100];
+    RayHit found_hits[100];
+    for (int i = 0; i < 100; i++) {
+        rays[i].origin = (Position){-1200, -1100, -1000};
+        rays[i].direction = (Position){1, 1 + i * 0.01f, 0.9f};
+    }
+    size_t hit_count = oct_query_ray_packet(expected_tree, rays, 100, 20,
+                                            INFINITY, expected_hits);
+    assert(hit_count > 0);
+    assert(oct_query_ray_packet(tree, rays, 100, 20, INFINITY, found_hits) ==
+           hit_count);
+    for (int i = 0; i < 100; i++) {
+        assert(expected_hits[i].object_index == found_hits[i].object_index);
+        assert(expected_hits[i].distance == found_hits[i].distance);
+        RayHit hit;
+        oct_query_ray(tree, rays[i], 20, INFINITY, &hit);
+        assert(hit.object_index == found_hits[i].object_index);
+    }
+
+    free(expected);
+    free(found);
+}
+
+/**
+ * @brief Walk a node of the normal tree and the same node of a succinct tree
+ * together and check they have the same children and objects.
+ */
+static void
+assert_succinct_node(Octree* octree, const BaseNode* node,
+                     const Octree* succinct, size_t index)
+{
+    const succinct_tree* tree = succinct->succinct;
+    assert(index < tree->node_count);
+    if (node->type == LEAF_NODE) {
+        const LeafNode* leaf = (const LeafNode*)node;
+        assert(tree->child_exists[index] == 0);
+        size_t leaf_index = succinct_tree_leaf(tree, index);
+        assert(leaf_index < tree->leaf_count);
+        uint64_t offset = tree->leaf_offsets[leaf_index];
+        assert_same_result(octree->object_indices + leaf->object_offset,
+                           leaf->object_count,
+                           succinct->object_indices + offset,
+                           tree->leaf_offsets[leaf_index + 1] - offset);
+        return;
+    }
+
+    uint8_t child_exists = ((const BranchNode*)node)->child_exists;
+    assert(tree->child_exists[index] == child_exists);
+    for (uint8_t child = 0; child < 8; child++) {
+        if (child_exists & (1u << child)) {
+            assert_succinct_node(
+                octree, oct_node_get_child(octree, node->location_code, child),
+                succinct, succinct_tree_child(tree, index, child));
+        }
+    }
+}
+
+static void
+test_succinct_tree()
+{
+    const char* path = "octree_succinct.oct";
+    Position octree_position = {0, 0, 0};
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    Octree* succinct = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, count);
+    oct_octree_build(succinct, positions, count);
+    for (size_t i = 0; i < count; i += 7) {
+        assert(oct_object_remove(octree, i));
+        assert(oct_object_remove(succinct, i));
+    }
+    assert(oct_octree_make_succinct(succinct));
+    assert(oct_octree_make_succinct(succinct));
+
+    const succinct_tree* tree = succinct->succinct;
+    size_t node_count = octree->leaf_count + octree->inner_count;
+    assert(tree != NULL);
+    assert(tree->node_count == node_count);
+    assert(tree->leaf_count == octree->leaf_count);
+    assert(tree->leaf_offsets[tree->leaf_count] == octree->object_count);
+    assert(succinct->nodes == NULL);
+    assert_succinct_node(octree, octree->root_node, succinct, 0);
+
+    // One byte per node and the rank directory, on top of the leaf ranges.
+    size_t leaf_bytes = (tree->leaf_count + 1) * sizeof *tree->leaf_offsets;
+    assert(succinct_tree_bytes(tree) - leaf_bytes <=
+           node_count + node_count / 4 + 256);
+
+    assert_same_queries(octree, succinct, count);
+
+    // There are no nodes to hand out or change.
+    assert(oct_point_locate(succinct, positions[1]) == NULL);
+    assert(oct_node_lookup(succinct, 0b1) == NULL);
+    assert(!oct_object_insert(succinct, positions, 0));
+    assert(!oct_object_remove(succinct, 1));
+    assert(!oct_object_move(succinct, 1, octree_position));
+    assert(oct_octree_update(succinct, positions) == OCT_UPDATE_FAILED);
+    assert(!oct_octree_save(succinct, path));
+
+    // A build goes back to the normal form.
+    oct_octree_build(succinct, positions, count);
+    assert(succinct->succinct == NULL);
+    assert_valid_tree(succinct, positions, count, NULL);
+    assert(oct_object_remove(succinct, 1));
+
+    // A mapped tree can be made succinct as well.
+    assert(oct_octree_save(octree, path));
+    Octree* mapped = oct_octree_map(path);
+    assert(mapped != NULL);
+    assert(oct_octree_make_succinct(mapped));
+    assert_same_queries(octree, mapped, count);
+
+    remove(path);
+    free(positions);
+    oct_octree_free(mapped);
+    oct_octree_free(succinct);
+    oct_octree_free(octree);
+}
+
+static void
+test_location_codes()
+{
+    Position octree_position = {10, -20, 30};
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    size_t count = RANDOM_ROWS + 3;
+    Position* positions = random_positions(count, 1100);
+
+    // Corners, the center, cell boundaries and positions far outside.
+    Position special[] = {
+        {-990, -1020, -970}, {1010, 980, 1030}, {10, -20, 30},
+        {10.0001f, -20.0001f, 30}, {-1e30f, 1e30f, 0}, {-990, 980, 1030},
+        {9.9999f, -19.999f, 29.9999f}, {1e-30f, -1e-30f, 0},
+    };
+    memcpy(positions, special, sizeof special);
+
+    uint64_t* codes = malloc(count * sizeof *codes);
+    for (size_t offset = 0; offset < 4; offset++) {
+        oct_positions_get_location_codes(octree, positions + offset,
+                                         count - offset, codes);
+        for (size_t i = 0; i + offset < count; i++) {
+            assert(codes[i] == oct_position_get_location_code(
+                                   octree, positions[i + offset]));
+        }
+    }
+
+    // Descending by the code of a position ends in the leaf that holds it.
+    oct_octree_build(octree, positions, count);
+    for (size_t i = 0; i < count; i++) {
+        LeafNode* leaf =
+            oct_leaf_node_find(octree, octree->root_node, positions[i]);
+        uint64_t code = oct_position_get_location_code(octree, positions[i]);
+        int depth = (int)oct_node_get_tree_depth(octree, &leaf->base);
+        assert(leaf->base.location_code ==
+               code >> (3 * (OCT_MAX_DEPTH - depth)));
+    }
+
+    free(codes);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+/**
+ * @brief Walk the tree with a cursor and check the center, size and depth
+ * it carries against the node. Returns the number of objects below it.
+ */
+static size_t
+assert_cursor(Octree* octree, const OctCursor* cursor,
+              const Position* positions)
+{
+    size_t count;
+    const uint64_t* objects = oct_cursor_objects(octree, cursor, &count);
+    uint8_t child_exists = oct_cursor_child_exists(octree, cursor);
+    assert(child_exists == 0 || (objects == NULL && count == 0));
+
+    if (cursor->node != NULL) {
+        assert(cursor->node->location_code == cursor->location_code);
+        assert((int)oct_node_get_tree_depth(octree, cursor->node) ==
+               cursor->depth);
+
+        Position center = oct_node_get_position(octree, cursor->node);
+        assert(fabsf(center.x - cursor->center.x) < 1e-3f);
+        assert(fabsf(center.y - cursor->center.y) < 1e-3f);
+        assert(fabsf(center.z - cursor->center.z) < 1e-3f);
+
+        OctCursor from_node = oct_cursor_from_node(octree, cursor->node);
+        assert(from_node.location_code == cursor->location_code);
+        assert(from_node.depth == cursor->depth);
+        assert(from_node.half_size == cursor->half_size);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        Position p = positions[objects[i]];
+        float half = cursor->half_size * 1.0001f;
+        assert(fabsf(p.x - cursor->center.x) <= half);
+        assert(fabsf(p.y - cursor->center.y) <= half);
+        assert(fabsf(p.z - cursor->center.z) <= half);
+    }
+
+    for (uint8_t child = 0; child < 8; child++) {
+        OctCursor child_cursor;
+        bool exists = oct_cursor_child(octree, cursor, child, &child_cursor);
+        assert(exists == ((child_exists >> child) & 1));
+        if (exists) {
+            assert(child_cursor.depth == cursor->depth + 1);
+            assert(child_cursor.half_size == cursor->half_size * 0.5f);
+            count += assert_cursor(octree, &child_cursor, positions);
+        }
+    }
+    return count;
+}
+
+static void
+test_cursor()
+{
+    Position octree_position = {10, -20, 30};
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 990);
+    for (size_t i = 0; i < count; i++) {
+        positions[i].x += octree_position.x;
+        positions[i].y += octree_position.y;
+        positions[i].z += octree_position.z;
+    }
+
+    oct_octree_build(octree, positions, count);
+    OctCursor root = oct_cursor_root(octree);
+    assert(root.depth == 0 && root.location_code == 0b1);
+    assert(assert_cursor(octree, &root, positions) == count);
+
+    // The center of a node is decoded from its location code.
+    BaseNode* leaf = oct_point_locate(octree, positions[0]);
+    Position center = oct_node_get_position(octree, leaf);
+    int depth = (int)oct_node_get_tree_depth(octree, leaf);
+    float cell = 2000.0f / (float)(1u << depth);
+    assert(fabsf(positions[0].x - center.x) <= cell / 2);
+    assert(fabsf(positions[0].y - center.y) <= cell / 2);
+    assert(fabsf(positions[0].z - center.z) <= cell / 2);
+
+    OctCursor missing;
+    assert(!oct_cursor_child(octree, &root, 8, &missing));
+
+    // The same walk works on the succinct form.
+    assert(oct_octree_make_succinct(octree));
+    root = oct_cursor_root(octree);
+    assert(root.node == NULL);
+    assert(assert_cursor(octree, &root, positions) == count);
+
+    free(positions);
+    oct_octree_free(octree);
+}
+
+typedef struct _VisitLog
+{
+    uint64_t* codes;
+    int* depths;
+    size_t count;
+    size_t* object_counts;
+    size_t post_count;
+    int skip_depth;
+    size_t stop_after;
+} VisitLog;
+
+static OctVisitResult
+log_pre_visit(Octree* octree, const OctCursor* cursor, void* context)
+{
+    VisitLog* log = context;
+    if (log->count == log->stop_after) {
+        return OCT_VISIT_STOP;
+    }
+
+    log->codes[log->count] = cursor->location_code;
+    log->depths[log->count] = cursor->depth;
+    log->count++;
+    assert(cursor->depth == 0 ||
+           (cursor->node == NULL) == (octree->succinct != NULL));
+    return cursor->depth == log->skip_depth ? OCT_VISIT_SKIP
+                                            : OCT_VISIT_CONTINUE;
+}
+
+/**
+ * @brief Count the objects below a node on the way back up. The counts of
+ * the children are on a stack indexed by depth.
+ */
+static OctVisitResult
+count_post_visit(Octree* octree, const OctCursor* cursor, void* context)
+{
+    VisitLog* log = context;
+    size_t count;
+    oct_cursor_objects(octree, cursor, &count);
+    log->object_counts[cursor->depth] += count;
+    if (cursor->depth > 0) {
+        log->object_counts[cursor->depth - 1] +=
+            log->object_counts[cursor->depth];
+        log->object_counts[cursor->depth] = 0;
+    }
+    log->post_count++;
+    return OCT_VISIT_CONTINUE;
+}
+
+static void
+test_visit()
+{
+    Position octree_position = {0, 0, 0};
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    oct_octree_build(octree, positions, count);
+    size_t node_count = octree->leaf_count + octree->inner_count;
+
+    VisitLog log = {0};
+    log.codes = malloc(node_count * sizeof *log.codes);
+    log.depths = malloc(node_count * sizeof *log.depths);
+    size_t object_counts[OCT_MAX_DEPTH + 2];
+    log.object_counts = object_counts;
+
+    for (int form = 0; form < 2; form++) {
+        // Depth first comes in Morton order, and every node's post visit
+        // comes after those of its children.
+        memset(object_counts, 0, sizeof object_counts);
+        log.count = 0;
+        log.post_count = 0;
+        log.skip_depth = -1;
+        log.stop_after = SIZE_MAX;
+        assert(oct_octree_visit(octree, OCT_VISIT_DEPTH_FIRST, log_pre_visit,
+                                count_post_visit, &log));
+        assert(log.count == node_count);
+        assert(log.post_count == node_count);
+        assert(object_counts[0] == count);
+        for (size_t i = 1; i < log.count; i++) {
+            uint64_t previous = log.codes[i - 1]
+                                << (3 * (OCT_MAX_DEPTH - log.depths[i - 1]));
+            uint64_t current = log.codes[i]
+                               << (3 * (OCT_MAX_DEPTH - log.depths[i]));
+            assert(previous < current ||
+                   (previous == current && log.depths[i - 1] < log.depths[i]));
+        }
+
+        // Breadth first comes level by level, in code order within a level.
+        memset(object_counts, 0, sizeof object_counts);
+        log.count = 0;
+        log.post_count = 0;
+        assert(oct_octree_visit(octree, OCT_VISIT_BREADTH_FIRST,
+                                log_pre_visit, count_post_visit, &log));
+        assert(log.count == node_count);
+        assert(log.post_count == node_count);
+        assert(object_counts[0] == count);
+        for (size_t i = 1; i < log.count; i++) {
+            assert(log.codes[i - 1] < log.codes[i]);
+        }
+        assert(oct_octree_visit(octree, OCT_VISIT_BREADTH_FIRST, NULL, NULL,
+                                NULL));
+
+        // Skipping below depth 2 leaves only the first three levels.
+        size_t shallow_count = 0;
+        for (size_t i = 0; i < node_count; i++) {
+            shallow_count += log.depths[i] <= 2;
+        }
+        for (int order = 0; order < 2; order++) {
+            log.count = 0;
+            log.skip_depth = 2;
+            assert(oct_octree_visit(octree, (OctVisitOrder)order,
+                                    log_pre_visit, NULL, &log));
+            assert(log.count == shallow_count);
+        }
+
+        // A stop ends the walk right away.
+        for (int order = 0; order < 2; order++) {
+            log.count = 0;
+            log.post_count = 0;
+            log.skip_depth = -1;
+            log.stop_after = 10;
+            assert(!oct_octree_visit(octree, (OctVisitOrder)order,
+                                     log_pre_visit, count_post_visit, &log));
+            assert(log.count == 10);
+            assert(order == 1 || log.post_count < 10);
+            assert(order == 0 || log.post_count == 0);
+        }
+
+        assert(oct_octree_make_succinct(octree));
+    }
+
+    free(log.codes);
+    free(log.depths);
+    free(positions);
+    oct_octree_free(octree);
+}
+
+typedef struct _NodeMass
+{
+    uint64_t count;
+    double mass;
+    Position min;
+    Position max;
+} NodeMass;
+
+static void
+node_mass_init(void* value, void* context)
+{
+    (void)context;
+    NodeMass* node_mass = value;
+    node_mass->count = 0;
+    node_mass->mass = 0;
+    node_mass->min = (Position){INFINITY, INFINITY, INFINITY};
+    node_mass->max = (Position){-INFINITY, -INFINITY, -INFINITY};
+}
+
+static void
+node_mass_add(NodeMass* node_mass, uint64_t count, double mass, Position min,
+              Position max)
+{
+    node_mass->count += count;
+    node_mass->mass += mass;
+    node_mass->min.x = fminf(node_mass->min.x, min.x);
+    node_mass->min.y = fminf(node_mass->min.y, min.y);
+    node_mass->min.z = fminf(node_mass->min.z, min.z);
+    node_mass->max.x = fmaxf(node_mass->max.x, max.x);
+    node_mass->max.y = fmaxf(node_mass->max.y, max.y);
+    node_mass->max.z = fmaxf(node_mass->max.z, max.z);
+}
+
+static void
+node_mass_add_object(void* value, uint64_t object_index, Position position,
+                     void* context)
+{
+    const double* masses = context;
+    node_mass_add(value, 1, masses[object_index], position, position);
+}
+
+static void
+node_mass_combine(void* value, const void* child_value, void* context)
+{
+    (void)context;
+    const NodeMass* child = child_value;
+    node_mass_add(value, child->count, child->mass, child->min, child->max);
+}
+
+typedef struct _MassCheck
+{
+    const Position* positions;
+    const bool* present;
+    const double* masses;
+    size_t count;
+    size_t node_count;
+} MassCheck;
+
+/**
+ * @brief Compare the aggregate of a node with the objects whose location code
+ * falls inside it.
+ */
+static OctVisitResult
+check_node_mass(Octree* octree, const OctCursor* cursor, void* context)
+{
+    MassCheck* check = context;
+    NodeMass expected;
+    node_mass_init(&expected, NULL);
+    for (size_t i = 0; i < check->count; i++) {
+        uint64_t code =
+            oct_position_get_location_code(octree, check->positions[i]);
+        if ((check->present == NULL || check->present[i]) &&
+            code >> (3 * (OCT_MAX_DEPTH - cursor->depth)) ==
+                cursor->location_code) {
+            node_mass_add(&expected, 1, check->masses[i], check->positions[i],
+                          check->positions[i]);
+        }
+    }
+
+    const NodeMass* node_mass =
+        oct_node_get_aggregate(octree, cursor->location_code);
+    assert(node_mass != NULL);
+    assert((uintptr_t)node_mass % _Alignof(max_align_t) == 0);
+    assert(node_mass->count == expected.count);
+    assert(node_mass->mass == expected.mass);
+    assert(memcmp(&node_mass->min, &expected.min, sizeof expected.min) == 0);
+    assert(memcmp(&node_mass->max, &expected.max, sizeof expected.max) == 0);
+    check->node_count++;
+    return OCT_VISIT_CONTINUE;
+}
+
+static void
+assert_node_masses(Octree* octree, const Position* positions,
+                   const bool* present, const double* masses, size_t count)
+{
+    MassCheck check = {positions, present, masses, count, 0};
+    assert(oct_octree_visit(octree, OCT_VISIT_DEPTH_FIRST, check_node_mass,
+                            NULL, &check));
+
+    // Freed nodes take their values with them.
+    assert(node_map_size(octree->aggregates) == check.node_count);
+}
+
+static void
+test_aggregates()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = 2 * RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    double* masses = malloc(count * sizeof *masses);
+    bool* present = calloc(count, sizeof *present);
+    for (size_t i = 0; i < count; i++) {
+        masses[i] = (double)(i % 16 + 1);
+    }
+    OctAggregate aggregate = {
+        sizeof(NodeMass), node_mass_init, node_mass_add_object,
+        node_mass_combine, masses,
+    };
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    assert(oct_node_get_aggregate(octree, 0b1) == NULL);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    for (size_t i = 0; i < RANDOM_ROWS; i++) {
+        present[i] = true;
+    }
+    assert(oct_octree_set_aggregate(octree, &aggregate));
+    assert_node_masses(octree, positions, present, masses, count);
+
+    // Inserts, removes and moves only compute their paths again.
+    for (size_t i = RANDOM_ROWS; i < count; i++) {
+        assert(oct_object_insert(octree, positions, i));
+        present[i] = true;
+    }
+    assert_node_masses(octree, positions, present, masses, count);
+
+    for (size_t i = 0; i < count; i += 3) {
+        assert(oct_object_remove(octree, i));
+        present[i] = false;
+    }
+    assert_node_masses(octree, positions, present, masses, count);
+
+    for (size_t i = 1; i < count; i += 3) {
+        Position position = positions[i];
+        if (i % 2 == 0) {
+            position.x += random_float(-1, 1);
+        } else {
+            position.x = random_float(-1000, 1000);
+            position.y = random_float(-1000, 1000);
+        }
+        assert(oct_object_move(octree, i, position));
+    }
+    assert_node_masses(octree, positions, present, masses, count);
+
+    // An update computes everything again, whether it moves or rebuilds.
+    Position* new_positions = malloc(count * sizeof *new_positions);
+    for (int step = 0; step < 2; step++) {
+        for (size_t i = 0; i < count; i++) {
+            new_positions[i] = step == 0 ? positions[i]
+                                         : (Position){-positions[i].x,
+                                                      positions[i].y,
+                                                      positions[i].z};
+        }
+        new_positions[1].x = -new_positions[1].x;
+        OctUpdateStrategy strategy = oct_octree_update(octree, new_positions);
+        assert(strategy ==
+               (step == 0 ? OCT_UPDATE_REINSERT : OCT_UPDATE_REBUILD));
+        assert_node_masses(octree, new_positions, present, masses, count);
+    }
+
+    // Builds keep the aggregate, and so does the succinct form.
+    oct_octree_build_parallel(octree, positions, count, 4);
+    assert_node_masses(octree, positions, NULL, masses, count);
+    assert(oct_octree_make_succinct(octree));
+    assert_node_masses(octree, positions, NULL, masses, count);
+
+    assert(oct_octree_set_aggregate(octree, NULL));
+    assert(oct_node_get_aggregate(octree, 0b1) == NULL);
+
+    oct_octree_free(octree);
+    free(new_positions);
+    free(present);
+    free(masses);
+    free(positions);
+}
+
+/**
+ * @brief Relative difference between an approximated and an exact
+ * acceleration.
+ */
+static double
+acceleration_error(Position approximation, Position exact)
+{
+    double dx = (double)approximation.x - exact.x;
+    double dy = (double)approximation.y - exact.y;
+    double dz = (double)approximation.z - exact.z;
+    double norm = (double)exact.x * exact.x + (double)exact.y * exact.y +
+                  (double)exact.z * exact.z;
+    return sqrt((dx * dx + dy * dy + dz * dz) / norm);
+}
+
+static void
+test_nbody()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    float* masses = malloc(count * sizeof *masses);
+    Position* exact = calloc(count, sizeof *exact);
+    Position* acc = malloc(count * sizeof *acc);
+    Position* succinct_acc = malloc(count * sizeof *succinct_acc);
+    for (size_t i = 0; i < count; i++) {
+        masses[i] = random_float(1, 10);
+    }
+
+    // The direct O(n^2) sum to compare with.
+    for (size_t i = 0; i < count; i++) {
+        double sum[3] = {0, 0, 0};
+        for (size_t j = 0; j < count; j++) {
+            double dx = (double)positions[j].x - positions[i].x;
+            double dy = (double)positions[j].y - positions[i].y;
+            double dz = (double)positions[j].z - positions[i].z;
+            double distance2 = dx * dx + dy * dy + dz * dz;
+            if (j == i || distance2 == 0) {
+                continue;
+            }
+            double scale = masses[j] / (distance2 * sqrt(distance2));
+            sum[0] += dx * scale;
+            sum[1] += dy * scale;
+            sum[2] += dz * scale;
+        }
+        exact[i] = (Position){(float)sum[0], (float)sum[1], (float)sum[2]};
+    }
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, count);
+
+    // Without an opening angle every pair is summed directly.
+    assert(oct_nbody_accelerations(octree, masses, 0, acc));
+    for (size_t i = 0; i < count; i++) {
+        assert(acceleration_error(acc[i], exact[i]) < 1e-4);
+    }
+
+    // A typical opening angle stays within a percent or so on average.
+    assert(oct_nbody_accelerations(octree, masses, 0.5f, acc));
+    double error_sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        error_sum += acceleration_error(acc[i], exact[i]);
+    }
+    assert(error_sum / count < 0.01);
+
+    // The succinct form walks the same nodes in the same order.
+    assert(oct_octree_make_succinct(octree));
+    assert(oct_nbody_accelerations(octree, masses, 0.5f, succinct_acc));
+    assert(memcmp(acc, succinct_acc, count * sizeof *acc) == 0);
+
+    oct_octree_free(octree);
+    free(succinct_acc);
+    free(acc);
+    free(exact);
+    free(masses);
+    free(positions);
+}
+
+static void
+test_snapshots()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+    Position min = {-1000, -1000, -1000};
+    Position max = {1000, 1000, 1000};
+
+    Octree* first = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(first, positions, 100);
+    OctSnapshots* snapshots = oct_snapshots_init(first);
+    int reader = oct_snapshots_register_reader(snapshots);
+    assert(reader >= 0);
+
+    // A pinned version outlives its replacement.
+    Octree* pinned = oct_snapshot_pin(snapshots, reader);
+    assert(pinned == first);
+    Octree* second = oct_snapshots_next(snapshots);
+    assert(second != NULL && second != first);
+    oct_octree_build(second, positions, 200);
+    assert(oct_snapshots_publish(snapshots, second));
+    Octree* third = oct_snapshots_next(snapshots);
+    assert(third != first && third != second);
+    assert(oct_query_aabb(pinned, min, max, NULL, 0) == 100);
+    oct_snapshot_unpin(snapshots, reader);
+
+    // Once unpinned, a replaced version is built in again.
+    assert(oct_snapshot_pin(snapshots, reader) == second);
+    oct_snapshot_unpin(snapshots, reader);
+    oct_octree_build(third, positions, 300);
+    assert(oct_snapshots_publish(snapshots, third));
+    Octree* recycled = oct_snapshots_next(snapshots);
+    assert(recycled == first || recycled == second);
+    oct_octree_build(recycled, positions, 400);
+    assert(oct_snapshots_publish(snapshots, recycled));
+    oct_snapshots_unregister_reader(snapshots, reader);
+
+    // Readers keep querying while versions are published.
+    int done = 0;
+    #pragma omp parallel num_threads(4)
+    {
+        int thread = 0;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+#endif
+        if (thread == 0) {
+            for (size_t version = 0; version < 100; version++) {
+                Octree* octree = oct_snapshots_next(snapshots);
+                oct_octree_build(octree, positions,
+                                 100 + version * 97 % (count - 100));
+                assert(oct_snapshots_publish(snapshots, octree));
+            }
+            #pragma omp atomic write
+            done = 1;
+        } else {
+            int reader = oct_snapshots_register_reader(snapshots);
+            assert(reader >= 0);
+            int finished = 0;
+            while (!finished) {
+                #pragma omp atomic read
+                finished = done;
+                Octree* octree = oct_snapshot_pin(snapshots, reader);
+                assert(oct_query_aabb(octree, min, max, NULL, 0) ==
+                       octree->object_count);
+                oct_snapshot_unpin(snapshots, reader);
+            }
+            oct_snapshots_unregister_reader(snapshots, reader);
+        }
+    }
+
+    oct_snapshots_free(snapshots);
+    free(positions);
+}
+
+static void
+test_concurrent_insert()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = 4 * RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+
+    // A tenth of the objects sit on one point, so leaves at max_depth grow.
+    for (size_t i = 0; i < count; i += 10) {
+        positions[i] = (Position){5, 5, 5};
+    }
+
+    Octree* octree = oct_octree_init(octree_position, 1000, 4, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+    assert(oct_octree_begin_concurrent(octree, positions, count));
+    assert(!oct_octree_begin_concurrent(octree, positions, count));
+    assert(!oct_object_insert(octree, positions, count - 1));
+    assert(!oct_octree_make_succinct(octree));
+    assert(octree->succinct == NULL);
+    assert(!oct_octree_save(octree, "octree_concurrent.oct"));
+    assert(fopen("octree_concurrent.oct", "rb") == NULL);
+
+    size_t inserted = 0;
+    long long i;
+    #pragma omp parallel for schedule(dynamic, 7) num_threads(4) \
+        reduction(+ : inserted)
+    for (i = 0; i < (long long)count; i++) {
+        inserted += oct_object_insert_concurrent(octree, (uint64_t)i);
+    }
+    assert(inserted == count - RANDOM_ROWS);
+    assert(!oct_object_insert_concurrent(octree, count));
+    assert(oct_octree_end_concurrent(octree));
+    assert(!oct_octree_end_concurrent(octree));
+    assert(!oct_object_insert_concurrent(octree, 0));
+    assert_valid_tree(octree, positions, count, NULL);
+
+    // The tree is an ordinary one again.
+    assert(oct_object_remove(octree, 1));
+    assert(oct_object_insert(octree, positions, 1));
+    assert(oct_query_aabb(octree, (Position){-1000, -1000, -1000},
+                          (Position){1000, 1000, 1000}, NULL, 0) == count);
+    oct_octree_free(octree);
+
+    free(positions);
+
+    // Starting from an empty tree with room for one object per leaf, most
+    // inserts race for children nobody made yet.
+    count = 25 * RANDOM_ROWS;
+    positions = random_positions(count, 1000);
+    for (int run = 0; run < 2; run++) {
+        Octree* empty =
+            oct_octree_init(octree_position, 1000, 1, OCT_MAX_DEPTH);
+        assert(oct_octree_begin_concurrent(empty, positions, count));
+        inserted = 0;
+        #pragma omp parallel for schedule(dynamic, 7) num_threads(16) \
+            reduction(+ : inserted)
+        for (i = 0; i < (long long)count; i++) {
+            inserted += oct_object_insert_concurrent(empty, (uint64_t)i);
+        }
+        assert(inserted == count);
+        assert(oct_octree_end_concurrent(empty));
+        assert_valid_tree(empty, positions, count, NULL);
+        oct_octree_free(empty);
+    }
+    free(positions);
+}
+
+/**
+ * @brief Check the shape statistics against the counts the tree keeps.
+ */
+static void
+assert_stats_shape(Octree* octree, const OctStats* stats)
+{
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    for (int depth = 0; depth <= OCT_MAX_DEPTH; depth++) {
+        node_count += stats->node_counts[depth];
+        leaf_count += stats->leaf_counts[depth];
+        assert(stats->leaf_counts[depth] <= stats->node_counts[depth]);
+        assert(depth <= stats->depth || stats->node_counts[depth] == 0);
+    }
+    assert(node_count == octree->leaf_count + octree->inner_count);
+    assert(leaf_count == octree->leaf_count);
+    assert(stats->node_counts[0] == 1);
+    assert(stats->node_counts[stats->depth] > 0);
+
+    size_t binned = 0;
+    for (size_t i = 0; i < OCT_STATS_OCCUPANCY_BINS; i++) {
+        binned += stats->occupancy_counts[i];
+    }
+    assert(binned == leaf_count);
+    double objects =
+        stats->mean_occupancy * (double)leaf_count * octree->leaf_capacity;
+    assert(fabs(objects - (double)octree->object_count) < 1e-6 * objects + 1);
+    assert(stats->bytes > sizeof *octree);
+    assert(stats->allocations > 0);
+}
+
+static void
+test_stats()
+{
+    Position octree_position = {0, 0, 0};
+    Position* positions = random_positions(RANDOM_ROWS, 1000);
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    oct_octree_build(octree, positions, RANDOM_ROWS);
+
+    OctStats stats;
+    oct_octree_get_stats(octree, &stats);
+    assert_stats_shape(octree, &stats);
+    assert(stats.max_leaf_objects <= 8);
+    assert(stats.max_leaf_objects == 8 ||
+           stats.occupancy_counts[OCT_STATS_OCCUPANCY_BINS - 1] == 0);
+    assert(stats.bytes_per_object ==
+           (double)stats.bytes / (double)RANDOM_ROWS);
+
+    // Every node is in the map, and the probe lengths cover all of them.
+    size_t node_count = octree->leaf_count + octree->inner_count;
+    assert(stats.load_factor ==
+           (double)node_count / (double)octree->nodes->capacity);
+    assert(stats.load_factor > 0 && stats.load_factor <= 0.875);
+    size_t probed = 0;
+    for (size_t i = 0; i < OCT_STATS_PROBE_BINS; i++) {
+        probed += stats.probe_counts[i];
+        assert(stats.probe_counts[i] == 0 || i <= stats.max_probe_length);
+    }
+    assert(probed == node_count);
+
+#ifndef OCT_NO_STATS
+    // The build is not counted as splits, and neither is the stats walk as
+    // a query.
+    assert(stats.counters.splits == 0 && stats.counters.queries == 0);
+    assert(stats.counters.nodes_visited == 0);
+
+    Position min = {-1000, -1000, -1000};
+    Position max = {1000, 1000, 1000};
+    assert(oct_query_aabb(octree, min, max, NULL, 0) == RANDOM_ROWS);
+    uint64_t indices[4];
+    float distances[4];
+    assert(oct_query_knn(octree, positions[0], 4, indices, distances) == 4);
+    oct_octree_get_stats(octree, &stats);
+    assert(stats.counters.queries == 2);
+    assert(stats.counters.nodes_visited > 2);
+    assert(stats.counters.lookups == stats.counters.nodes_visited - 2);
+
+    // Inserting objects at one point splits leaves down to max_depth, and
+    // removing them merges the branches again.
+    Position* grown = malloc((RANDOM_ROWS + 16) * sizeof *grown);
+    memcpy(grown, positions, RANDOM_ROWS * sizeof *grown);
+    for (size_t i = RANDOM_ROWS; i < RANDOM_ROWS + 16; i++) {
+        grown[i] = (Position){1, 1, 1};
+        assert(oct_object_insert(octree, grown, i));
+    }
+    oct_octree_get_stats(octree, &stats);
+    assert_stats_shape(octree, &stats);
+    assert(stats.counters.splits > 0);
+    assert(stats.depth == octree->max_depth);
+    assert(stats.max_leaf_objects >= 16);
+    assert(stats.occupancy_counts[OCT_STATS_OCCUPANCY_BINS - 1] > 0);
+    for (size_t i = RANDOM_ROWS; i < RANDOM_ROWS + 16; i++) {
+        assert(oct_object_remove(octree, i));
+    }
+    oct_octree_get_stats(octree, &stats);
+    assert_stats_shape(octree, &stats);
+    assert(stats.counters.merges > 0);
+
+    oct_octree_reset_counters(octree);
+    oct_octree_get_stats(octree, &stats);
+    assert(stats.counters.splits == 0 && stats.counters.merges == 0);
+    assert(stats.counters.queries == 0 && stats.counters.lookups == 0);
+
+    // Steps taken outside a query, here computing an aggregate, are not
+    // added to the next query.
+    assert(oct_query_aabb(octree, min, max, NULL, 0) == RANDOM_ROWS);
+    oct_octree_get_stats(octree, &stats);
+    uint64_t query_visits = stats.counters.nodes_visited;
+    oct_octree_reset_counters(octree);
+    double* masses = calloc(RANDOM_ROWS + 16, sizeof *masses);
+    OctAggregate aggregate = {
+        sizeof(NodeMass), node_mass_init, node_mass_add_object,
+        node_mass_combine, masses,
+    };
+    assert(oct_octree_set_aggregate(octree, &aggregate));
+    assert(oct_query_aabb(octree, min, max, NULL, 0) == RANDOM_ROWS);
+    oct_octree_get_stats(octree, &stats);
+    assert(stats.counters.nodes_visited == query_visits);
+    assert(oct_octree_set_aggregate(octree, NULL));
+    free(masses);
+    oct_octree_reset_counters(octree);
+
+    // A succinct tree has no node map to look nodes up in.
+    assert(oct_octree_make_succinct(octree));
+    oct_octree_get_stats(octree, &stats);
+    assert_stats_shape(octree, &stats);
+    assert(stats.load_factor == 0 && stats.max_probe_length == 0);
+    assert(oct_query_aabb(octree, min, max, NULL, 0) == RANDOM_ROWS);
+    oct_octree_get_stats(octree, &stats);
+    assert(stats.counters.queries == 1);
+    assert(stats.counters.nodes_visited > 1);
+    assert(stats.counters.lookups == 0);
+    free(grown);
+#endif
+
+    oct_octree_free(octree);
+    free(positions);
+}
+
+static void
+test_sized_init()
+{
+    Position octree_position = {0, 0, 0};
+    size_t count = 4 * RANDOM_ROWS;
+    Position* positions = random_positions(count, 1000);
+
+    // An empty tree only holds its root and a small node map.
+    Octree* octree = oct_octree_init(octree_position, 1000, 8, OCT_MAX_DEPTH);
+    assert(oct_octree_get_bytes(octree) == oct_octree_estimate_bytes(8, 0));
+    assert(oct_octree_get_bytes(octree) < 4096);
+    oct_octree_free(octree);
+
+    // A sized tree reserves what the estimate promises, and inserting the
+    // expected objects does not grow the node map or the code array.
+    octree = oct_octree_init_sized(octree_position, 1000, 8, OCT_MAX_DEPTH,
+                                   count, 0);
+    assert(oct_octree_get_bytes(octree) ==
+           oct_octree_estimate_bytes(8, count));
+    size_t map_capacity = octree->nodes->capacity;
+    uint64_t* codes = octree->object_codes;
+    for (size_t i = 0; i < count; i++) {
+        assert(oct_object_insert(octree, positions, i));
+    }
+    assert(octree->nodes->capacity == map_capacity);
+    assert(octree->object_codes == codes);
+    assert_valid_tree(octree, positions, count, NULL);
+
+    // Shrinking packs the tree to what it holds, and it keeps working.
+    size_t bytes = oct_octree_get_bytes(octree);
+    assert(oct_octree_shrink_to_fit(octree));
+    assert(oct_octree_get_bytes(octree) < bytes);
+    assert(octree->slot_capacity == count);
+    assert(octree->free_slot_count == 0);
+    assert(octree->nodes->capacity ==
+           node_map_capacity_for(octree->leaf_count + octree->inner_count));
+    assert_valid_tree(octree, positions, count, NULL);
+    assert(oct_object_remove(octree, 0));
+    assert(oct_object_insert(octree, positions, 0));
+    assert_valid_tree(octree, positions, count, NULL);
+
+    // A build from the expected objects stays close to the estimate.
+    oct_octree_build(octree, positions, count);
+    bytes = oct_octree_get_bytes(octree);
+    size_t estimate = oct_octree_estimate_bytes(8, count);
+    assert(bytes < 2 * estimate && estimate < 2 * bytes);
+    OctStats stats;
+    oct_octree_get_stats(octree, &stats);
+    assert(stats.bytes == bytes);
+    oct_octree_free(octree);
+
+    // With a small budget the tree is sized for fewer objects, and without
+    // room for an empty tree there is none.
+    size_t budget = oct_octree_estimate_bytes(8, count / 4);
+    octree = oct_octree_init_sized(octree_position, 1000, 8, OCT_MAX_DEPTH,
+                                   count, budget);
+    assert(oct_octree_get_bytes(octree) <= budget);
+    assert(octree->object_code_count >= count / 4);
+    assert(octree->object_code_count < count);
+    oct_octree_build(octree, positions, count);
+    assert_valid_tree(octree, positions, count, NULL);
+    oct_octree_free(octree);
+    assert(oct_octree_init_sized(octree_position, 1000, 8, OCT_MAX_DEPTH,
+                                 count, sizeof *octree) == NULL);
+
+    free(positions);
+}
 
 int
 main()
@@ -16,7 +2242,8 @@ main()
 
     int octree_size = 100;
     Position octree_position = {30, 30, 30};
-    Octree* octree = oct_octree_init(octree_position, octree_size);
+    Octree* octree =
+        oct_octree_init(octree_position, octree_size, 1, OCT_MAX_DEPTH);
     
     int count = 0;
     Position positions[ROWS];
@@ -28,17 +2255,40 @@ main()
 
     oct_octree_build(octree, positions, ROWS);
 
-    unordered_map_iterator* iterator =
-        unordered_map_iterator_alloc(octree->nodes);
-    
-    while (unordered_map_iterator_has_next(iterator) > 0) {
-        void* key_pointer;
-        void* value_pointer;
-        unordered_map_iterator_next(iterator, &key_pointer, &value_pointer);
+    size_t iterator = 0;
+    uint64_t location_code;
+    void* value_pointer;
+    while (node_map_next(octree->nodes, &iterator, &location_code,
+                         &value_pointer)) {
         printf("%u\n", ((BaseNode*)value_pointer)->type);
     }
 
     oct_octree_free(octree);
 
+    test_node_map();
+    test_bulk_build();
+    test_leaf_capacity();
+    test_node_pool();
+    test_parallel_build();
+    test_query_frustum();
+    test_query_ray();
+    test_point_locate();
+    test_query_knn();
+    test_query_range();
+    test_object_update();
+    test_octree_update();
+    test_octree_file();
+    test_build_stream();
+    test_succinct_tree();
+    test_location_codes();
+    test_cursor();
+    test_visit();
+    test_aggregates();
+    test_nbody();
+    test_snapshots();
+    test_concurrent_insert();
+    test_stats();
+    test_sized_init();
+
     return 0;
 }